@@ -0,0 +1,345 @@
+/**************************************************************
+ * File: BinarySerialization.h
+ *
+ * Helpers for reading and writing the fixed, endian-defined
+ * binary formats used to persist KDTrees to disk.  Every
+ * multi-byte quantity is stored little-endian regardless of
+ * the byte order of the host, so a file written on one machine
+ * can be loaded on any other.
+ *
+ * Writing goes through a BinaryWriter, which accumulates the
+ * encoded bytes in memory so that the file can be written with
+ * a single call:
+ *
+ * BinaryWriter out;
+ * out.writeUInt32(137);
+ * out.writeDouble(2.71828);
+ * out.saveToFile("data.bin");
+ *
+ * Reading goes through a BinaryReader, which pulls the whole
+ * file into memory in one sequential read and then decodes it:
+ *
+ * BinaryReader in("data.bin");
+ * uint32_t value = in.readUInt32();
+ *
+ * Any attempt to read past the end of the data throws a
+ * runtime_error, as does any failure to open or write a file.
+ *
+ * Values stored in the tree are encoded through the
+ * ValueSerializer<T> template.  Arithmetic types and strings
+ * are supported out of the box; other types may be supported
+ * by specializing ValueSerializer.
+ */
+
+#ifndef BINARY_SERIALIZATION_INCLUDED
+#define BINARY_SERIALIZATION_INCLUDED
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <stdint.h>
+
+using namespace std;
+
+class BinaryWriter {
+public:
+    /**
+     * void writeBytes(const void* data, size_t numBytes);
+     * void writeUInt8(uint8_t value);
+     * void writeUInt32(uint32_t value);
+     * void writeUInt64(uint64_t value);
+     * void writeDouble(double value);
+     * Usage: out.writeUInt64(kd.size());
+     * --------------------------------------------------
+     * Appends the specified value to the buffer.  Integers
+     * and doubles are written in little-endian order; raw
+     * bytes are copied verbatim.
+     */
+    void writeBytes(const void* data, size_t numBytes);
+    void writeUInt8(uint8_t value);
+    void writeUInt32(uint32_t value);
+    void writeUInt64(uint64_t value);
+    void writeDouble(double value);
+
+    /**
+     * const string& bytes() const;
+     * Usage: cout << out.bytes().size() << endl;
+     * --------------------------------------------------
+     * Returns the bytes written so far.
+     */
+    const string& bytes() const;
+
+    /**
+     * void saveToFile(const string& path) const;
+     * Usage: out.saveToFile("tree.kdt");
+     * --------------------------------------------------
+     * Writes the accumulated bytes to the specified file,
+     * replacing its contents.  Throws runtime_error if the
+     * file cannot be written.
+     */
+    void saveToFile(const string& path) const;
+
+private:
+    string buffer;
+};
+
+class BinaryReader {
+public:
+    /**
+     * Constructor: BinaryReader(const string& path);
+     * Usage: BinaryReader in("tree.kdt");
+     * --------------------------------------------------
+     * Reads the entire contents of the specified file into
+     * memory.  Throws runtime_error if the file cannot be
+     * read.
+     */
+    explicit BinaryReader(const string& path);
+
+    /**
+     * void readBytes(void* out, size_t numBytes);
+     * uint8_t readUInt8();
+     * uint32_t readUInt32();
+     * uint64_t readUInt64();
+     * double readDouble();
+     * Usage: uint64_t count = in.readUInt64();
+     * --------------------------------------------------
+     * Decodes the next value from the buffer.  Throws
+     * runtime_error if the data is truncated.
+     */
+    void readBytes(void* out, size_t numBytes);
+    uint8_t readUInt8();
+    uint32_t readUInt32();
+    uint64_t readUInt64();
+    double readDouble();
+
+    /**
+     * bool atEnd() const;
+     * Usage: if (!in.atEnd()) error("Trailing data");
+     * --------------------------------------------------
+     * Returns whether every byte of the file has been read.
+     */
+    bool atEnd() const;
+
+    /**
+     * size_t bytesRemaining() const;
+     * Usage: if (length > in.bytesRemaining()) error("Corrupt");
+     * --------------------------------------------------
+     * Returns the number of bytes that have not yet been
+     * read.
+     */
+    size_t bytesRemaining() const;
+
+private:
+    vector<char> buffer;
+    size_t position;
+};
+
+/**
+ * ValueSerializer<T>
+ * Usage: ValueSerializer<T>::write(out, value);
+ *        ValueSerializer<T>::read(in, value);
+ * --------------------------------------------------
+ * Encodes and decodes a single value of type T.  The
+ * primary template handles arithmetic types by writing
+ * their bytes in little-endian order; the specialization
+ * below handles strings.
+ */
+template <typename T>
+struct ValueSerializer {
+    static void write(BinaryWriter& out, const T& value);
+    static void read(BinaryReader& in, T& value);
+};
+
+template <>
+struct ValueSerializer<string> {
+    static void write(BinaryWriter& out, const string& value);
+    static void read(BinaryReader& in, string& value);
+};
+
+
+////////////////////////////////////////////////////
+// Binary serialization implementation details    //
+////////////////////////////////////////////////////
+
+#include <type_traits>
+
+/*
+ * Returns whether the host stores multi-byte integers with the least
+ * significant byte first.
+ */
+inline bool HostIsLittleEndian() {
+    const uint16_t probe = 1;
+    unsigned char firstByte;
+    memcpy(&firstByte, &probe, 1);
+    return firstByte == 1;
+}
+
+/*
+ * Copies numBytes bytes from source to dest, reversing their order if
+ * the host is big-endian.  This converts between host order and the
+ * little-endian order used on disk in both directions.
+ */
+inline void CopyLittleEndian(void* dest, const void* source, size_t numBytes) {
+    if (HostIsLittleEndian()) {
+        memcpy(dest, source, numBytes);
+        return;
+    }
+    const unsigned char* in = static_cast<const unsigned char*>(source);
+    unsigned char* out = static_cast<unsigned char*>(dest);
+    for (size_t i = 0; i < numBytes; ++i)
+        out[i] = in[numBytes - 1 - i];
+}
+
+/*
+ * Writer functions encode into a small scratch buffer, then append.
+ */
+inline void BinaryWriter::writeBytes(const void* data, size_t numBytes) {
+    buffer.append(static_cast<const char*>(data), numBytes);
+}
+
+inline void BinaryWriter::writeUInt8(uint8_t value) {
+    buffer.push_back(char(value));
+}
+
+inline void BinaryWriter::writeUInt32(uint32_t value) {
+    char bytes[sizeof(value)];
+    CopyLittleEndian(bytes, &value, sizeof(value));
+    writeBytes(bytes, sizeof(value));
+}
+
+inline void BinaryWriter::writeUInt64(uint64_t value) {
+    char bytes[sizeof(value)];
+    CopyLittleEndian(bytes, &value, sizeof(value));
+    writeBytes(bytes, sizeof(value));
+}
+
+/*
+ * Doubles are stored as their IEEE-754 bit pattern.
+ */
+inline void BinaryWriter::writeDouble(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeUInt64(bits);
+}
+
+inline const string& BinaryWriter::bytes() const {
+    return buffer;
+}
+
+inline void BinaryWriter::saveToFile(const string& path) const {
+    ofstream output(path.c_str(), ios::binary | ios::trunc);
+    if (!output)
+        throw runtime_error("Couldn't open " + path + " for writing");
+    output.write(buffer.data(), streamsize(buffer.size()));
+    if (!output)
+        throw runtime_error("Couldn't write to " + path);
+}
+
+/*
+ * The reader slurps the whole file with a single read so that decoding
+ * never touches the disk again.
+ */
+inline BinaryReader::BinaryReader(const string& path) {
+    position = 0;
+    ifstream input(path.c_str(), ios::binary);
+    if (!input)
+        throw runtime_error("Couldn't open " + path + " for reading");
+
+    input.seekg(0, ios::end);
+    streamoff length = input.tellg();
+    input.seekg(0, ios::beg);
+    if (length < 0)
+        throw runtime_error("Couldn't determine the size of " + path);
+
+    buffer.resize(size_t(length));
+    if (!buffer.empty() && !input.read(&buffer[0], streamsize(buffer.size())))
+        throw runtime_error("Couldn't read " + path);
+}
+
+inline void BinaryReader::readBytes(void* out, size_t numBytes) {
+    if (buffer.size() - position < numBytes)
+        throw runtime_error("Unexpected end of binary data");
+    if (numBytes != 0)
+        memcpy(out, &buffer[position], numBytes);
+    position += numBytes;
+}
+
+inline uint8_t BinaryReader::readUInt8() {
+    uint8_t value;
+    readBytes(&value, sizeof(value));
+    return value;
+}
+
+inline uint32_t BinaryReader::readUInt32() {
+    char bytes[sizeof(uint32_t)];
+    readBytes(bytes, sizeof(bytes));
+    uint32_t value;
+    CopyLittleEndian(&value, bytes, sizeof(value));
+    return value;
+}
+
+inline uint64_t BinaryReader::readUInt64() {
+    char bytes[sizeof(uint64_t)];
+    readBytes(bytes, sizeof(bytes));
+    uint64_t value;
+    CopyLittleEndian(&value, bytes, sizeof(value));
+    return value;
+}
+
+inline double BinaryReader::readDouble() {
+    uint64_t bits = readUInt64();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline bool BinaryReader::atEnd() const {
+    return position == buffer.size();
+}
+
+inline size_t BinaryReader::bytesRemaining() const {
+    return buffer.size() - position;
+}
+
+/*
+ * Arithmetic values are written byte-for-byte in little-endian order.
+ * Types that aren't arithmetic need their own specialization.
+ */
+template <typename T>
+void ValueSerializer<T>::write(BinaryWriter& out, const T& value) {
+    static_assert(is_arithmetic<T>::value,
+                  "Specialize ValueSerializer to save non-arithmetic values");
+    char bytes[sizeof(T)];
+    CopyLittleEndian(bytes, &value, sizeof(T));
+    out.writeBytes(bytes, sizeof(T));
+}
+
+template <typename T>
+void ValueSerializer<T>::read(BinaryReader& in, T& value) {
+    static_assert(is_arithmetic<T>::value,
+                  "Specialize ValueSerializer to load non-arithmetic values");
+    char bytes[sizeof(T)];
+    in.readBytes(bytes, sizeof(T));
+    CopyLittleEndian(&value, bytes, sizeof(T));
+}
+
+/*
+ * Strings are written as a 64-bit length followed by their characters.
+ */
+inline void ValueSerializer<string>::write(BinaryWriter& out, const string& value) {
+    out.writeUInt64(value.size());
+    out.writeBytes(value.data(), value.size());
+}
+
+inline void ValueSerializer<string>::read(BinaryReader& in, string& value) {
+    uint64_t length = in.readUInt64();
+    if (length > in.bytesRemaining())
+        throw runtime_error("Unexpected end of binary data");
+    value.resize(size_t(length));
+    if (length != 0)
+        in.readBytes(&value[0], size_t(length));
+}
+
+#endif // BINARY_SERIALIZATION_INCLUDED
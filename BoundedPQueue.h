@@ -133,6 +133,19 @@ public:
     double best()  const;
     double worst() const;
 
+    /**
+     * const_iterator begin() const;
+     * const_iterator end() const;
+     * Usage: for (BoundedPQueue<int>::const_iterator itr = bpq.begin(); itr != bpq.end(); ++itr)
+     * --------------------------------------------------
+     * Iterates over the (priority, element) pairs stored in
+     * the queue, from smallest to largest priority, without
+     * removing them.
+     */
+    typedef typename multimap<double, T>::const_iterator const_iterator;
+    const_iterator begin() const;
+    const_iterator end() const;
+
 private:
     /*
      * This class is layered on top of a multimap mapping from priorities
@@ -221,4 +234,18 @@ double BoundedPQueue<T>::worst() const {
     return empty()? numeric_limits<double>::infinity() : elems.rbegin()->first;
 }
 
+/*
+ * Iteration walks the underlying multimap, which is already sorted by
+ * priority.
+ */
+template <typename T>
+typename BoundedPQueue<T>::const_iterator BoundedPQueue<T>::begin() const {
+    return elems.begin();
+}
+
+template <typename T>
+typename BoundedPQueue<T>::const_iterator BoundedPQueue<T>::end() const {
+    return elems.end();
+}
+
 #endif // BOUNDED_PQUEUE_INCLUDED
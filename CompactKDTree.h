@@ -0,0 +1,461 @@
+/**************************************************************
+ * File: CompactKDTree.h
+ *
+ * A static kd-tree for points whose coordinates are small
+ * unsigned integers, such as the bytes of an RGB color.  Each
+ * point is stored packed, in N bytes for uint8_t coordinates
+ * or 2N bytes for uint16_t, and distances are computed in
+ * integer arithmetic:
+ *
+ * CompactKDTree<3, uint8_t, string> colors;
+ * colors.build(elems);
+ * CompactPoint<3, uint8_t> color;
+ * color[0] = 255; color[1] = 128; color[2] = 0;
+ * cout << colors.kNNValue(color, 3) << endl;
+ *
+ * The tree is implicit, like a fully split LazyKDTree: the
+ * points live in one array in tree order, and each subtree
+ * keeps its splitting point at the middle of its range, so
+ * there are no child pointers or levels to store.  A split
+ * value is simply the integer coordinate of that point.  The
+ * values live in a separate array that searches only touch
+ * when they vote, so a search walks three bytes per color
+ * rather than a whole node.
+ *
+ * Like KDTree, a CompactKDTree stores each point once, with
+ * the last value given for it.  Distances between integer
+ * points tie often; when they do, which of the tied points
+ * take part in a k-NN vote is unspecified.
+ */
+
+#ifndef COMPACT_KDTREE_INCLUDED
+#define COMPACT_KDTREE_INCLUDED
+
+#include "BoundedPQueue.h"
+#include "BinarySerialization.h"
+#include "KDTree.h"
+#include <vector>
+#include <limits>
+#include <stdint.h>
+
+using namespace std;
+
+/* Blocks of at most this many points are scanned rather than searched. */
+static const size_t kCompactKDTreeLeafSize = 8;
+
+/**
+ * Type: CompactCoordinate<Coord>
+ * --------------------------------------------------
+ * The coordinate types a CompactKDTree supports, each with
+ * an unsigned type wide enough to hold a squared distance.
+ */
+template <typename Coord> struct CompactCoordinate;
+template <> struct CompactCoordinate<uint8_t> { typedef uint32_t Distance; };
+template <> struct CompactCoordinate<uint16_t> { typedef uint64_t Distance; };
+
+/**
+ * Class: CompactPoint<N, Coord>
+ * Usage: CompactPoint<3, uint8_t> color;
+ * --------------------------------------------------
+ * A point with N integer coordinates, packed with no
+ * padding.  Like Point, its coordinates start out
+ * uninitialized.
+ */
+template <size_t N, typename Coord>
+class CompactPoint {
+public:
+    Coord& operator[] (size_t index);
+    Coord operator[] (size_t index) const;
+    size_t size() const;
+
+private:
+    Coord mCoords[N];
+};
+
+template <size_t N, typename Coord>
+bool operator==(const CompactPoint<N, Coord>& one, const CompactPoint<N, Coord>& two);
+template <size_t N, typename Coord>
+bool operator!=(const CompactPoint<N, Coord>& one, const CompactPoint<N, Coord>& two);
+
+template <size_t N, typename Coord, typename ElemType>
+class CompactKDTree {
+public:
+    /* The type squared distances between points are computed in. */
+    typedef typename CompactCoordinate<Coord>::Distance Distance;
+
+    /**
+     * Constructor: CompactKDTree();
+     * Usage: CompactKDTree<3, uint8_t, string> myTree;
+     * ----------------------------------------------------
+     * Constructs an empty CompactKDTree.
+     */
+    CompactKDTree();
+
+    /**
+     * void build(vector< pair<CompactPoint<N, Coord>, ElemType> > elems);
+     * Usage: kd.build(move(elems));
+     * ----------------------------------------------------
+     * Replaces the contents of the tree with the specified
+     * points and values.  If a point appears more than
+     * once, the last value given for it wins, as with
+     * insert on a KDTree.  Moving the elements in avoids
+     * copying the values.
+     */
+    void build(vector< pair<CompactPoint<N, Coord>, ElemType> > elems);
+
+    /**
+     * size_t dimension() const;
+     * size_t size() const;
+     * bool empty() const;
+     * Usage: if (kd.empty())
+     * ----------------------------------------------------
+     * Returns the dimension of the points, the number of
+     * elements in the tree and whether it is empty.
+     */
+    size_t dimension() const;
+    size_t size() const;
+    bool empty() const;
+
+    /**
+     * bool contains(const CompactPoint<N, Coord>& pt) const;
+     * const ElemType& at(const CompactPoint<N, Coord>& pt) const;
+     * Usage: if (kd.contains(v)) cout << kd.at(v) << endl;
+     * ----------------------------------------------------
+     * Returns whether the point is in the tree, or the value
+     * associated with it.  at throws out_of_range if the
+     * point is not in the tree.
+     */
+    bool contains(const CompactPoint<N, Coord>& pt) const;
+    const ElemType& at(const CompactPoint<N, Coord>& pt) const;
+
+    /**
+     * ElemType kNNValue(const CompactPoint<N, Coord>& key, size_t k) const
+     * Usage: cout << kd.kNNValue(v, 3) << endl;
+     * ----------------------------------------------------
+     * Given a point v and an integer k, finds the k points
+     * in the tree nearest to v and returns the most common
+     * value associated with those points.  In the event of
+     * a tie, one of the most frequent value will be chosen.
+     */
+    ElemType kNNValue(const CompactPoint<N, Coord>& key, size_t k) const;
+
+    /**
+     * void save(const string& path, uint64_t sourceFingerprint = 0) const;
+     * void load(const string& path, uint64_t sourceFingerprint = 0);
+     * Usage: kd.save("colors.kdc", FileFingerprint("colors.txt"));
+     *        kd.load("colors.kdc", FileFingerprint("colors.txt"));
+     * ----------------------------------------------------
+     * Writes the tree to a file, or replaces the contents
+     * of this tree with the contents of a file.  As with
+     * LazyKDTree, the fingerprint of the source data is
+     * stored in the file and load rejects a mismatch.  Both
+     * throw runtime_error on failure; if load fails, this
+     * tree is left unchanged.
+     */
+    void save(const string& path, uint64_t sourceFingerprint = 0) const;
+    void load(const string& path, uint64_t sourceFingerprint = 0);
+
+private:
+    /* The points in tree order, and values[i] the value of points[i]. */
+    vector< CompactPoint<N, Coord> > points;
+    vector<ElemType> values;
+
+    static Distance squaredDistance(const CompactPoint<N, Coord>& one, const CompactPoint<N, Coord>& two);
+    static void buildRange(vector< pair<CompactPoint<N, Coord>, ElemType> >& elems,
+                           size_t begin, size_t end, size_t depth);
+    bool findIndex(const CompactPoint<N, Coord>& pt, size_t begin, size_t end, size_t depth, size_t& index) const;
+    void searchRange(const CompactPoint<N, Coord>& key, BoundedPQueue<const ElemType*>& nearest,
+                     size_t begin, size_t end, size_t depth) const;
+};
+
+
+////////////////////////////////////////////////
+// CompactKDTree class implementation details //
+////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+template <size_t N, typename Coord>
+Coord& CompactPoint<N, Coord>::operator[] (size_t index) {
+    return mCoords[index];
+}
+
+template <size_t N, typename Coord>
+Coord CompactPoint<N, Coord>::operator[] (size_t index) const {
+    return mCoords[index];
+}
+
+template <size_t N, typename Coord>
+size_t CompactPoint<N, Coord>::size() const {
+    return N;
+}
+
+template <size_t N, typename Coord>
+bool operator==(const CompactPoint<N, Coord>& one, const CompactPoint<N, Coord>& two) {
+    for (size_t i = 0; i < N; ++i) {
+        if (one[i] != two[i]) return false;
+    }
+    return true;
+}
+
+template <size_t N, typename Coord>
+bool operator!=(const CompactPoint<N, Coord>& one, const CompactPoint<N, Coord>& two) {
+    return !(one == two);
+}
+
+template <size_t N, typename Coord, typename ElemType>
+CompactKDTree<N, Coord, ElemType>::CompactKDTree() {
+    static_assert(numeric_limits<Distance>::max() / Distance(numeric_limits<Coord>::max())
+                  / Distance(numeric_limits<Coord>::max()) >= N,
+                  "Squared distances of this dimension can overflow");
+}
+
+/*
+ * The differences are taken in unsigned arithmetic, larger minus smaller,
+ * so no coordinate ever needs a signed type.
+ */
+template <size_t N, typename Coord, typename ElemType>
+typename CompactKDTree<N, Coord, ElemType>::Distance
+CompactKDTree<N, Coord, ElemType>::squaredDistance(const CompactPoint<N, Coord>& one,
+                                                   const CompactPoint<N, Coord>& two) {
+    Distance result = 0;
+    for (size_t i = 0; i < N; ++i) {
+        Distance diff = one[i] > two[i] ? Distance(one[i] - two[i]) : Distance(two[i] - one[i]);
+        result += diff * diff;
+    }
+    return result;
+}
+
+/*
+ * build(elems)
+ * The elements are arranged in place and then split into the point and
+ * value arrays, so only the packed points are copied.
+ */
+template <size_t N, typename Coord, typename ElemType>
+void CompactKDTree<N, Coord, ElemType>::build(vector< pair<CompactPoint<N, Coord>, ElemType> > elems) {
+    KDTREE_TRACE_SPAN("CompactKDTree::build");
+    {
+        KDTREE_TRACE_SPAN("Remove duplicate points");
+        RemoveDuplicatePoints(elems);
+    }
+    {
+        KDTREE_TRACE_SPAN("Split points");
+        buildRange(elems, 0, elems.size(), 0);
+    }
+
+    KDTREE_TRACE_SPAN("Copy points and values");
+    vector< CompactPoint<N, Coord> > newPoints;
+    vector<ElemType> newValues;
+    newPoints.reserve(elems.size());
+    newValues.reserve(elems.size());
+    for (size_t i = 0; i < elems.size(); ++i) {
+        newPoints.push_back(elems[i].first);
+        newValues.push_back(move(elems[i].second));
+    }
+    points.swap(newPoints);
+    values.swap(newValues);
+}
+
+template <size_t N, typename Coord, typename ElemType>
+void CompactKDTree<N, Coord, ElemType>::buildRange(vector< pair<CompactPoint<N, Coord>, ElemType> >& elems,
+                                                   size_t begin, size_t end, size_t depth) {
+    while (end - begin > kCompactKDTreeLeafSize) {
+        size_t mid = begin + (end - begin) / 2;
+        size_t keyIndex = depth % N;
+        nth_element(elems.begin() + begin, elems.begin() + mid, elems.begin() + end,
+                    [keyIndex](const pair<CompactPoint<N, Coord>, ElemType>& one,
+                               const pair<CompactPoint<N, Coord>, ElemType>& two) {
+            return one.first[keyIndex] < two.first[keyIndex];
+        });
+        buildRange(elems, begin, mid, depth + 1);
+        begin = mid + 1;
+        ++depth;
+    }
+}
+
+template <size_t N, typename Coord, typename ElemType>
+size_t CompactKDTree<N, Coord, ElemType>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename Coord, typename ElemType>
+size_t CompactKDTree<N, Coord, ElemType>::size() const {
+    return points.size();
+}
+
+template <size_t N, typename Coord, typename ElemType>
+bool CompactKDTree<N, Coord, ElemType>::empty() const {
+    return points.empty();
+}
+
+/*
+ * findIndex(pt, begin, end, depth, index)
+ * As in LazyKDTree, points with the same coordinate as the middle point
+ * may be on either side of it, so a point on the splitting plane is
+ * looked for in both halves.
+ */
+template <size_t N, typename Coord, typename ElemType>
+bool CompactKDTree<N, Coord, ElemType>::findIndex(const CompactPoint<N, Coord>& pt, size_t begin, size_t end,
+                                                  size_t depth, size_t& index) const {
+    while (end - begin > kCompactKDTreeLeafSize) {
+        size_t mid = begin + (end - begin) / 2;
+        if (points[mid] == pt) {
+            index = mid;
+            return true;
+        }
+
+        size_t keyIndex = depth % N;
+        Coord split = points[mid][keyIndex];
+        if (pt[keyIndex] == split && findIndex(pt, begin, mid, depth + 1, index))
+            return true;
+        if (pt[keyIndex] < split) {
+            end = mid;
+        } else {
+            begin = mid + 1;
+        }
+        ++depth;
+    }
+    for (size_t i = begin; i < end; ++i) {
+        if (points[i] == pt) {
+            index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+template <size_t N, typename Coord, typename ElemType>
+bool CompactKDTree<N, Coord, ElemType>::contains(const CompactPoint<N, Coord>& pt) const {
+    size_t index;
+    return findIndex(pt, 0, points.size(), 0, index);
+}
+
+template <size_t N, typename Coord, typename ElemType>
+const ElemType& CompactKDTree<N, Coord, ElemType>::at(const CompactPoint<N, Coord>& pt) const {
+    size_t index;
+    if (!findIndex(pt, 0, points.size(), 0, index))
+        throw out_of_range("That point does not exist");
+    return values[index];
+}
+
+/*
+ * searchRange(key, nearest, begin, end, depth)
+ * The queue is ordered by squared distance, which ranks points the same
+ * way as distance and is exact in a double, so the plane test compares
+ * the squared distance to the plane.
+ */
+template <size_t N, typename Coord, typename ElemType>
+void CompactKDTree<N, Coord, ElemType>::searchRange(const CompactPoint<N, Coord>& key,
+                                                    BoundedPQueue<const ElemType*>& nearest,
+                                                    size_t begin, size_t end, size_t depth) const {
+    if (end - begin <= kCompactKDTreeLeafSize) {
+        for (size_t i = begin; i < end; ++i)
+            nearest.enqueue(&values[i], double(squaredDistance(points[i], key)));
+        return;
+    }
+
+    size_t mid = begin + (end - begin) / 2;
+    nearest.enqueue(&values[mid], double(squaredDistance(points[mid], key)));
+
+    size_t keyIndex = depth % N;
+    Coord split = points[mid][keyIndex];
+    bool goesLeft = key[keyIndex] < split;
+    if (goesLeft) {
+        searchRange(key, nearest, begin, mid, depth + 1);
+    } else {
+        searchRange(key, nearest, mid + 1, end, depth + 1);
+    }
+
+    Distance planeDistance = goesLeft ? Distance(split - key[keyIndex]) : Distance(key[keyIndex] - split);
+    if (nearest.size() != nearest.maxSize() || double(planeDistance * planeDistance) < nearest.worst()) {
+        if (goesLeft) {
+            searchRange(key, nearest, mid + 1, end, depth + 1);
+        } else {
+            searchRange(key, nearest, begin, mid, depth + 1);
+        }
+    }
+}
+
+template <size_t N, typename Coord, typename ElemType>
+ElemType CompactKDTree<N, Coord, ElemType>::kNNValue(const CompactPoint<N, Coord>& key, size_t k) const {
+    if (k == 0) return ElemType();
+    BoundedPQueue<const ElemType*> nearest(k);
+    searchRange(key, nearest, 0, points.size(), 0);
+    return MostCommonValue(nearest);
+}
+
+/*
+ * File format.  All integers are little-endian.
+ *
+ *   header:    magic "KDTC", uint32 version, uint32 dimension,
+ *              uint32 bytes per coordinate, uint64 source fingerprint,
+ *              uint64 number of elements
+ *   elements:  in tree order, each as the N coordinates and the value as
+ *              encoded by ValueSerializer<ElemType>
+ */
+static const char kCompactKDTreeMagic[4] = { 'K', 'D', 'T', 'C' };
+static const uint32_t kCompactKDTreeVersion = 1;
+
+template <size_t N, typename Coord, typename ElemType>
+void CompactKDTree<N, Coord, ElemType>::save(const string& path, uint64_t sourceFingerprint) const {
+    KDTREE_TRACE_SPAN("CompactKDTree::save");
+    BinaryWriter out;
+    out.writeBytes(kCompactKDTreeMagic, sizeof(kCompactKDTreeMagic));
+    out.writeUInt32(kCompactKDTreeVersion);
+    out.writeUInt32(uint32_t(N));
+    out.writeUInt32(uint32_t(sizeof(Coord)));
+    out.writeUInt64(sourceFingerprint);
+    out.writeUInt64(points.size());
+
+    for (size_t i = 0; i < points.size(); ++i) {
+        for (size_t j = 0; j < N; ++j) {
+            for (size_t byte = 0; byte < sizeof(Coord); ++byte)
+                out.writeUInt8(uint8_t(points[i][j] >> (8 * byte)));
+        }
+        ValueSerializer<ElemType>::write(out, values[i]);
+    }
+    out.saveToFile(path);
+}
+
+template <size_t N, typename Coord, typename ElemType>
+void CompactKDTree<N, Coord, ElemType>::load(const string& path, uint64_t sourceFingerprint) {
+    KDTREE_TRACE_SPAN("CompactKDTree::load");
+    BinaryReader in(path);
+
+    char magic[sizeof(kCompactKDTreeMagic)];
+    in.readBytes(magic, sizeof(magic));
+    if (memcmp(magic, kCompactKDTreeMagic, sizeof(magic)) != 0)
+        throw runtime_error(path + " is not a CompactKDTree file");
+    if (in.readUInt32() != kCompactKDTreeVersion)
+        throw runtime_error(path + " has an unsupported version");
+    if (in.readUInt32() != N)
+        throw runtime_error(path + " stores points of a different dimension");
+    if (in.readUInt32() != sizeof(Coord))
+        throw runtime_error(path + " stores coordinates of a different size");
+    if (in.readUInt64() != sourceFingerprint)
+        throw runtime_error(path + " was built from different data");
+    uint64_t count = in.readUInt64();
+    if (count > in.bytesRemaining() / (N * sizeof(Coord)))
+        throw runtime_error(path + " is a corrupt CompactKDTree file");
+
+    vector< CompactPoint<N, Coord> > newPoints(count);
+    vector<ElemType> newValues(count);
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = 0; j < N; ++j) {
+            Coord coordinate = 0;
+            for (size_t byte = 0; byte < sizeof(Coord); ++byte)
+                coordinate |= Coord(Coord(in.readUInt8()) << (8 * byte));
+            newPoints[i][j] = coordinate;
+        }
+        ValueSerializer<ElemType>::read(in, newValues[i]);
+    }
+    if (!in.atEnd())
+        throw runtime_error(path + " is a corrupt CompactKDTree file");
+
+    points.swap(newPoints);
+    values.swap(newValues);
+}
+
+#endif // COMPACT_KDTREE_INCLUDED
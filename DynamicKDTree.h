@@ -0,0 +1,209 @@
+/**************************************************************
+ * File: DynamicKDTree.h
+ *
+ * A kd-tree that stays balanced under a steady stream of
+ * inserts, using the logarithmic method of Bentley and Saxe.
+ * The points are spread over a series of static, balanced
+ * KDTrees, where level i is either empty or holds exactly 2^i
+ * points.  Inserting a point works like incrementing a binary
+ * counter: the new point and every full level below the first
+ * empty one are rebuilt together into that empty level.
+ *
+ * DynamicKDTree<2, string> kd;
+ * kd.insert(v, "Some value");
+ * if (kd.contains(v)) cout << kd.kNNValue(v, 3) << endl;
+ *
+ * Each point is rebuilt once per level it moves through, so an
+ * insert costs O(log^2 n) amortized time, and every tree is
+ * balanced.  Lookups search every level, costing a log factor
+ * more than a single balanced tree; k-NN searches share one
+ * queue across the levels, so each level is pruned by the
+ * best candidates the others have already found.
+ */
+
+#ifndef DYNAMIC_KDTREE_INCLUDED
+#define DYNAMIC_KDTREE_INCLUDED
+
+#include "KDTree.h"
+#include <deque>
+
+using namespace std;
+
+template <size_t N, typename ElemType>
+class DynamicKDTree {
+public:
+    /**
+     * Constructor: DynamicKDTree(KDTreeNodeLayout layout = kKDTreeVanEmdeBoasOrder);
+     * Usage: DynamicKDTree<3, int> myTree;
+     * ----------------------------------------------------
+     * Constructs an empty DynamicKDTree.  Each level is laid
+     * out in memory as specified whenever it is rebuilt.
+     */
+    explicit DynamicKDTree(KDTreeNodeLayout layout = kKDTreeVanEmdeBoasOrder);
+
+    /**
+     * size_t dimension() const;
+     * Usage: size_t dim = kd.dimension();
+     * ----------------------------------------------------
+     * Returns the dimension of the points stored in this
+     * DynamicKDTree.
+     */
+    size_t dimension() const;
+
+    /**
+     * size_t size() const;
+     * bool empty() const;
+     * Usage: if (kd.empty())
+     * ----------------------------------------------------
+     * Returns the number of elements in the tree and whether
+     * the tree is empty.
+     */
+    size_t size() const;
+    bool empty() const;
+
+    /**
+     * bool contains(const Point<N>& pt) const;
+     * Usage: if (kd.contains(pt))
+     * ----------------------------------------------------
+     * Returns whether the specified point is contained in
+     * the tree.
+     */
+    bool contains(const Point<N>& pt) const;
+
+    /**
+     * void insert(const Point<N>& pt, const ElemType& value);
+     * Usage: kd.insert(v, "This value is associated with v.");
+     * ----------------------------------------------------
+     * Inserts the point pt into the tree, associating it
+     * with the specified value.  If the element already
+     * existed in the tree, the new value will overwrite the
+     * existing one.
+     */
+    void insert(const Point<N>& pt, const ElemType& value);
+
+    /**
+     * ElemType& at(const Point<N>& pt);
+     * const ElemType& at(const Point<N>& pt) const;
+     * Usage: cout << kd.at(v) << endl;
+     * ----------------------------------------------------
+     * Returns a reference to the value associated with the
+     * point pt.  If the point is not in the tree, this
+     * function throws an out_of_range exception.  The
+     * reference remains valid until the next insert.
+     */
+    ElemType& at(const Point<N>& pt);
+    const ElemType& at(const Point<N>& pt) const;
+
+    /**
+     * ElemType kNNValue(const Point<N>& key, size_t k) const
+     * Usage: cout << kd.kNNValue(v, 3) << endl;
+     * ----------------------------------------------------
+     * Given a point v and an integer k, finds the k points
+     * in the tree nearest to v and returns the most common
+     * value associated with those points.  In the event of
+     * a tie, one of the most frequent value will be chosen.
+     */
+    ElemType kNNValue(const Point<N>& key, size_t k) const;
+
+private:
+    /* levels[i] is either empty or holds exactly 2^i points. */
+    deque< KDTree<N, ElemType> > levels;
+    size_t numElements;
+    KDTreeNodeLayout layout;
+};
+
+
+////////////////////////////////////////////////
+// DynamicKDTree class implementation details //
+////////////////////////////////////////////////
+
+template <size_t N, typename ElemType>
+DynamicKDTree<N, ElemType>::DynamicKDTree(KDTreeNodeLayout layout) : numElements(0), layout(layout) {}
+
+template <size_t N, typename ElemType>
+size_t DynamicKDTree<N, ElemType>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename ElemType>
+size_t DynamicKDTree<N, ElemType>::size() const {
+    return numElements;
+}
+
+template <size_t N, typename ElemType>
+bool DynamicKDTree<N, ElemType>::empty() const {
+    return numElements == 0;
+}
+
+template <size_t N, typename ElemType>
+bool DynamicKDTree<N, ElemType>::contains(const Point<N>& pt) const {
+    for (size_t i = 0; i < levels.size(); ++i) {
+        if (levels[i].contains(pt)) return true;
+    }
+    return false;
+}
+
+/*
+ * insert(pt, value)
+ * A point that is already present is overwritten in place, which keeps
+ * every point in exactly one level.  Otherwise the full levels below the
+ * first empty one are merged, along with the new point, into that level.
+ */
+template <size_t N, typename ElemType>
+void DynamicKDTree<N, ElemType>::insert(const Point<N>& pt, const ElemType& value) {
+    for (size_t i = 0; i < levels.size(); ++i) {
+        if (levels[i].contains(pt)) {
+            levels[i].at(pt) = value;
+            return;
+        }
+    }
+
+    size_t target = 0;
+    while (target < levels.size() && !levels[target].empty()) ++target;
+    if (target == levels.size()) levels.push_back(KDTree<N, ElemType>());
+
+    vector< pair<Point<N>, ElemType> > elems;
+    elems.reserve(size_t(1) << target);
+    for (size_t i = 0; i < target; ++i) {
+        vector< pair<Point<N>, ElemType> > levelElems = levels[i].elements();
+        elems.insert(elems.end(), levelElems.begin(), levelElems.end());
+    }
+    elems.push_back(make_pair(pt, value));
+
+    levels[target].build(elems, layout);
+    for (size_t i = 0; i < target; ++i) {
+        levels[i] = KDTree<N, ElemType>();
+    }
+    ++numElements;
+}
+
+template <size_t N, typename ElemType>
+ElemType& DynamicKDTree<N, ElemType>::at(const Point<N>& pt) {
+    const DynamicKDTree& constThis = *this;
+    return const_cast<ElemType&>(constThis.at(pt));
+}
+
+template <size_t N, typename ElemType>
+const ElemType& DynamicKDTree<N, ElemType>::at(const Point<N>& pt) const {
+    for (size_t i = 0; i < levels.size(); ++i) {
+        if (levels[i].contains(pt)) return levels[i].at(pt);
+    }
+    throw out_of_range("Point not found in the DynamicKDTree");
+}
+
+/*
+ * kNNValue(key, k)
+ * Searches every level with the same queue, then votes exactly as
+ * KDTree::kNNValue does, so the two agree on the same points.
+ */
+template <size_t N, typename ElemType>
+ElemType DynamicKDTree<N, ElemType>::kNNValue(const Point<N>& key, size_t k) const {
+    BoundedPQueue<const ElemType*> nearest(k);
+    if (k == 0) return ElemType();
+    for (size_t i = 0; i < levels.size(); ++i) {
+        levels[i].kNearest(key, nearest);
+    }
+    return MostCommonValue(nearest);
+}
+
+#endif // DYNAMIC_KDTREE_INCLUDED
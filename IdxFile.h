@@ -0,0 +1,174 @@
+/**************************************************************
+ * File: IdxFile.h
+ *
+ * A read-only, memory-mapped view of a file in the IDX format
+ * used by the MNIST data sets.  An IDX file holds one array
+ * of numbers: a four-byte magic number giving the element
+ * type and the number of dimensions, the size of each
+ * dimension as a big-endian 32-bit integer, and then the
+ * elements themselves in row-major order:
+ *
+ * IdxFile images("training-images");
+ * for (size_t i = 0; i < images.count(); ++i) {
+ *     const unsigned char* pixels = images.record(i);
+ *     ...
+ * }
+ *
+ * The header is checked against the size of the file when it
+ * is opened, so every record handed out lies within the file.
+ * The elements themselves are never copied; records point
+ * straight into the mapping, which lives exactly as long as
+ * the IdxFile object.
+ */
+
+#ifndef IDX_FILE_INCLUDED
+#define IDX_FILE_INCLUDED
+
+#include "MappedFile.h"
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <stdint.h>
+
+using namespace std;
+
+/* The element types an IDX file can hold, as stored in its magic number. */
+enum IdxDataType {
+    kIdxUnsignedByte = 0x08,
+    kIdxSignedByte = 0x09,
+    kIdxShort = 0x0B,
+    kIdxInt = 0x0C,
+    kIdxFloat = 0x0D,
+    kIdxDouble = 0x0E
+};
+
+class IdxFile {
+public:
+    /**
+     * Constructor: IdxFile(const string& path);
+     * Usage: IdxFile labels("training-labels");
+     * --------------------------------------------------
+     * Maps the named file and validates its header.  Throws
+     * runtime_error if the file can't be mapped, isn't an
+     * IDX file, or is shorter or longer than its header
+     * says.
+     */
+    explicit IdxFile(const string& path);
+
+    /**
+     * IdxDataType dataType() const;
+     * const vector<size_t>& dimensions() const;
+     * Usage: if (file.dataType() != kIdxUnsignedByte) ...
+     * --------------------------------------------------
+     * Returns the element type and the size of each
+     * dimension of the array.
+     */
+    IdxDataType dataType() const;
+    const vector<size_t>& dimensions() const;
+
+    /**
+     * size_t count() const;
+     * size_t recordSize() const;
+     * const unsigned char* record(size_t index) const;
+     * Usage: const unsigned char* pixels = images.record(i);
+     * --------------------------------------------------
+     * Returns the number of records, meaning the size of the
+     * first dimension; the size of each record in bytes; and
+     * the address of the raw, big-endian bytes of a record.
+     */
+    size_t count() const;
+    size_t recordSize() const;
+    const unsigned char* record(size_t index) const;
+
+private:
+    MappedFile file;
+    IdxDataType type;
+    vector<size_t> dims;
+    const unsigned char* elements;
+    size_t bytesPerRecord;
+
+    IdxFile(const IdxFile&);
+    IdxFile& operator=(const IdxFile&);
+};
+
+
+//////////////////////////////////////////
+// IdxFile class implementation details //
+//////////////////////////////////////////
+
+/* Returns the size in bytes of one element of the specified type, or zero if
+ * the type isn't a valid IDX type.
+ */
+inline size_t IdxElementSize(unsigned char type) {
+    switch (type) {
+    case kIdxUnsignedByte:
+    case kIdxSignedByte:
+        return 1;
+    case kIdxShort:
+        return 2;
+    case kIdxInt:
+    case kIdxFloat:
+        return 4;
+    case kIdxDouble:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * The size check guards every later access to the mapping.  Products are
+ * checked against the file size before they are formed, so an absurd
+ * header can't overflow them.
+ */
+inline IdxFile::IdxFile(const string& path) : file(path) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(file.data());
+    size_t size = file.size();
+    if (size < 4 || bytes[0] != 0 || bytes[1] != 0 || IdxElementSize(bytes[2]) == 0 || bytes[3] == 0)
+        throw runtime_error(path + " is not an IDX file");
+
+    type = IdxDataType(bytes[2]);
+    size_t numDims = bytes[3];
+    size_t headerSize = 4 + 4 * numDims;
+    if (size < headerSize)
+        throw runtime_error(path + " is a truncated IDX file");
+
+    size_t payloadSize = IdxElementSize(type);
+    for (size_t i = 0; i < numDims; ++i) {
+        const unsigned char* field = bytes + 4 + 4 * i;
+        dims.push_back((size_t(field[0]) << 24) | (size_t(field[1]) << 16) | (size_t(field[2]) << 8) | field[3]);
+        if (i == 0) continue;
+        if (dims[i] != 0 && payloadSize > size / dims[i])
+            throw runtime_error(path + " has an IDX header that doesn't match its size");
+        payloadSize *= dims[i];
+    }
+
+    bytesPerRecord = payloadSize;
+    if (dims[0] != 0 && bytesPerRecord > (size - headerSize) / dims[0])
+        throw runtime_error(path + " is a truncated IDX file");
+    if (headerSize + dims[0] * bytesPerRecord != size)
+        throw runtime_error(path + " has an IDX header that doesn't match its size");
+    elements = bytes + headerSize;
+}
+
+inline IdxDataType IdxFile::dataType() const {
+    return type;
+}
+
+inline const vector<size_t>& IdxFile::dimensions() const {
+    return dims;
+}
+
+inline size_t IdxFile::count() const {
+    return dims[0];
+}
+
+inline size_t IdxFile::recordSize() const {
+    return bytesPerRecord;
+}
+
+inline const unsigned char* IdxFile::record(size_t index) const {
+    return elements + index * bytesPerRecord;
+}
+
+#endif // IDX_FILE_INCLUDED
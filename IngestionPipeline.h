@@ -0,0 +1,377 @@
+/**************************************************************
+ * File: IngestionPipeline.h
+ *
+ * A three-stage pipeline for loading a data set into a kd-tree
+ * using every core.  A reader thread cuts the input into large
+ * chunks, a pool of parser threads turns each chunk into a
+ * batch of points and values, and the calling thread hands
+ * each finished batch to a builder.  The stages are joined by
+ * bounded queues, so a slow stage holds back the ones before
+ * it instead of letting chunks pile up in memory:
+ *
+ * typedef IngestionPipeline<2, string> Pipeline;
+ * ifstream input("points.txt");
+ * Pipeline::Batch elems;
+ * Pipeline().run(TextChunkReader(input), ParseLines, [&](Pipeline::Batch& batch) {
+ *     elems.insert(elems.end(), batch.begin(), batch.end());
+ * });
+ * kd.build(move(elems));
+ *
+ * Chunks are parsed in parallel, so batches reach the builder
+ * in no particular order.  If any stage throws, the pipeline
+ * shuts down and run rethrows the first exception raised.
+ */
+
+#ifndef INGESTION_PIPELINE_INCLUDED
+#define INGESTION_PIPELINE_INCLUDED
+
+#include "Point.h"
+#include "Tracing.h"
+#include <deque>
+#include <vector>
+#include <string>
+#include <istream>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+using namespace std;
+
+/* The number of bytes TextChunkReader reads at a time. */
+static const size_t kIngestionChunkSize = 1 << 20;
+
+/* How many chunks or batches each queue holds per parser thread. */
+static const size_t kIngestionQueueDepth = 2;
+
+/**
+ * Class: BlockingQueue<T>
+ * Usage: BlockingQueue<string> chunks(8);
+ * --------------------------------------------------
+ * A fixed-capacity queue shared between threads.  push
+ * waits while the queue is full and pop waits while it is
+ * empty.  Once the queue is closed, push drops its item and
+ * returns false, and pop returns the items still queued and
+ * then false.
+ */
+template <typename T>
+class BlockingQueue {
+public:
+    explicit BlockingQueue(size_t capacity);
+
+    bool push(T& item);
+    bool pop(T& item);
+    void close();
+
+private:
+    deque<T> items;
+    size_t capacity;
+    bool closed;
+    mutex lock;
+    condition_variable notFull;
+    condition_variable notEmpty;
+
+    BlockingQueue(const BlockingQueue&);
+    BlockingQueue& operator=(const BlockingQueue&);
+};
+
+/**
+ * Class: TextChunkReader
+ * Usage: TextChunkReader reader(input);
+ * --------------------------------------------------
+ * A reader stage for line-oriented text.  Each call reads
+ * the next block of the stream and returns it cut at the
+ * last newline, so no line is split between two chunks;
+ * the rest of the block starts the next chunk.
+ */
+class TextChunkReader {
+public:
+    explicit TextChunkReader(istream& input, size_t chunkSize = kIngestionChunkSize);
+
+    /* Stores the next chunk and returns true, or returns false at the end. */
+    bool operator()(string& chunk);
+
+private:
+    istream* input;
+    size_t chunkSize;
+    string carry;
+};
+
+/**
+ * Class: MappedChunkReader
+ * Usage: MappedChunkReader reader(file.data(), file.data() + file.size());
+ * --------------------------------------------------
+ * A reader stage for line-oriented text already in memory,
+ * such as a MappedFile.  Each call copies out the next
+ * block of about chunkSize bytes, extended to the end of
+ * the line it stops in.  The memory must outlive the
+ * pipeline run.
+ */
+class MappedChunkReader {
+public:
+    MappedChunkReader(const char* begin, const char* end, size_t chunkSize = kIngestionChunkSize);
+
+    /* Stores the next chunk and returns true, or returns false at the end. */
+    bool operator()(string& chunk);
+
+private:
+    const char* position;
+    const char* end;
+    size_t chunkSize;
+};
+
+template <size_t N, typename ElemType>
+class IngestionPipeline {
+public:
+    /* A group of parsed points and their values. */
+    typedef vector< pair<Point<N>, ElemType> > Batch;
+
+    /* Reader: stores the next chunk and returns true, or returns false at the end. */
+    typedef function<bool(string&)> ChunkReader;
+
+    /* Parser: appends the points in a chunk to a batch. */
+    typedef function<void(const string&, Batch&)> ChunkParser;
+
+    /* Builder: consumes one batch.  Runs on the thread that called run. */
+    typedef function<void(Batch&)> BatchBuilder;
+
+    /**
+     * Constructor: IngestionPipeline(size_t numParsers = 0);
+     * Usage: IngestionPipeline<2, string> pipeline;
+     * ----------------------------------------------------
+     * Creates a pipeline with the specified number of
+     * parser threads, or one per hardware thread if
+     * numParsers is zero.
+     */
+    explicit IngestionPipeline(size_t numParsers = 0);
+
+    /**
+     * size_t numParsers() const;
+     * Usage: size_t parsers = pipeline.numParsers();
+     * ----------------------------------------------------
+     * Returns the number of parser threads run uses.
+     */
+    size_t numParsers() const;
+
+    /**
+     * void run(const ChunkReader& read, const ChunkParser& parse,
+     *          const BatchBuilder& build);
+     * Usage: pipeline.run(reader, parser, builder);
+     * ----------------------------------------------------
+     * Reads the whole input, parsing chunks in parallel and
+     * passing every batch to the builder on the calling
+     * thread.  Returns once every batch has been built.  If
+     * any stage throws, the others are stopped and the first
+     * exception is rethrown.
+     */
+    void run(const ChunkReader& read, const ChunkParser& parse, const BatchBuilder& build);
+
+private:
+    size_t parserCount;
+};
+
+
+////////////////////////////////////////////////////
+// IngestionPipeline class implementation details //
+////////////////////////////////////////////////////
+
+#include <atomic>
+#include <cstring>
+
+template <typename T>
+BlockingQueue<T>::BlockingQueue(size_t capacity) : capacity(capacity), closed(false) {
+    // Handled in initializer list
+}
+
+/*
+ * Items are moved through the queue by swapping, so that chunks and
+ * batches are never copied.
+ */
+template <typename T>
+bool BlockingQueue<T>::push(T& item) {
+    unique_lock<mutex> guard(lock);
+    while (!closed && items.size() >= capacity)
+        notFull.wait(guard);
+    if (closed) return false;
+
+    items.push_back(T());
+    swap(items.back(), item);
+    notEmpty.notify_one();
+    return true;
+}
+
+template <typename T>
+bool BlockingQueue<T>::pop(T& item) {
+    unique_lock<mutex> guard(lock);
+    while (!closed && items.empty())
+        notEmpty.wait(guard);
+    if (items.empty()) return false;
+
+    swap(item, items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+}
+
+template <typename T>
+void BlockingQueue<T>::close() {
+    lock_guard<mutex> guard(lock);
+    closed = true;
+    notFull.notify_all();
+    notEmpty.notify_all();
+}
+
+inline TextChunkReader::TextChunkReader(istream& input, size_t chunkSize)
+    : input(&input), chunkSize(chunkSize) {
+    // Handled in initializer list
+}
+
+/*
+ * The carried-over partial line goes at the front of the next chunk.  A
+ * block with no newline at all, such as one long line, keeps growing
+ * until the line ends or the stream does.
+ */
+inline bool TextChunkReader::operator()(string& chunk) {
+    chunk.swap(carry);
+    carry.clear();
+    while (*input) {
+        size_t oldSize = chunk.size();
+        chunk.resize(oldSize + chunkSize);
+        input->read(&chunk[oldSize], streamsize(chunkSize));
+        chunk.resize(oldSize + size_t(input->gcount()));
+
+        size_t lastNewline = chunk.find_last_of('\n');
+        if (lastNewline != string::npos && lastNewline >= oldSize) {
+            carry.assign(chunk, lastNewline + 1, string::npos);
+            chunk.resize(lastNewline + 1);
+            return true;
+        }
+    }
+    return !chunk.empty();
+}
+
+inline MappedChunkReader::MappedChunkReader(const char* begin, const char* end, size_t chunkSize)
+    : position(begin), end(end), chunkSize(chunkSize) {
+    // Handled in initializer list
+}
+
+inline bool MappedChunkReader::operator()(string& chunk) {
+    if (position == end) return false;
+
+    const char* cut = position + min(chunkSize, size_t(end - position));
+    if (cut != end) {
+        const char* newline = static_cast<const char*>(memchr(cut, '\n', end - cut));
+        cut = (newline == NULL ? end : newline + 1);
+    }
+    chunk.assign(position, cut);
+    position = cut;
+    return true;
+}
+
+template <size_t N, typename ElemType>
+IngestionPipeline<N, ElemType>::IngestionPipeline(size_t numParsers) : parserCount(numParsers) {
+    if (parserCount == 0)
+        parserCount = max(1u, thread::hardware_concurrency());
+}
+
+template <size_t N, typename ElemType>
+size_t IngestionPipeline<N, ElemType>::numParsers() const {
+    return parserCount;
+}
+
+/*
+ * run(read, parse, build)
+ * Each stage closes the queue after it once it runs out of input; the
+ * last parser to finish closes the batch queue.  A stage that throws
+ * records its exception and closes both queues, which wakes every other
+ * stage and makes their pushes fail, so all the threads wind down
+ * quickly and can be joined before the exception is rethrown.
+ */
+template <size_t N, typename ElemType>
+void IngestionPipeline<N, ElemType>::run(const ChunkReader& read, const ChunkParser& parse,
+                                         const BatchBuilder& build) {
+    KDTREE_TRACE_SPAN("IngestionPipeline::run");
+    BlockingQueue<string> chunks(parserCount * kIngestionQueueDepth);
+    BlockingQueue<Batch> batches(parserCount * kIngestionQueueDepth);
+
+    mutex errorLock;
+    exception_ptr error;
+    auto fail = [&]() {
+        {
+            lock_guard<mutex> guard(errorLock);
+            if (!error) error = current_exception();
+        }
+        chunks.close();
+        batches.close();
+    };
+
+    thread reader([&]() {
+        KDTREE_TRACE_THREAD_NAME("Ingestion reader");
+        try {
+            string chunk;
+            while (true) {
+                {
+                    KDTREE_TRACE_SPAN("Read chunk");
+                    if (!read(chunk)) break;
+                }
+                if (!chunks.push(chunk)) break;
+            }
+            chunks.close();
+        } catch (...) {
+            fail();
+        }
+    });
+
+    /* If a parser can't be started, the failure shuts the pipeline down
+     like any other, so the threads already running are still joined
+     below.  Reserving first means push_back can't throw once a thread
+     exists. */
+    atomic<size_t> parsersLeft(parserCount);
+    vector<thread> parsers;
+    try {
+        parsers.reserve(parserCount);
+        for (size_t i = 0; i < parserCount; ++i) {
+            parsers.push_back(thread([&]() {
+                KDTREE_TRACE_THREAD_NAME("Ingestion parser");
+                try {
+                    string chunk;
+                    while (chunks.pop(chunk)) {
+                        Batch batch;
+                        {
+                            KDTREE_TRACE_SPAN("Parse chunk");
+                            parse(chunk, batch);
+                        }
+                        if (!batches.push(batch)) break;
+                    }
+                } catch (...) {
+                    fail();
+                }
+                if (--parsersLeft == 0) batches.close();
+            }));
+        }
+    } catch (...) {
+        fail();
+    }
+
+    try {
+        Batch batch;
+        while (batches.pop(batch)) {
+            {
+                lock_guard<mutex> guard(errorLock);
+                if (error) break;
+            }
+            KDTREE_TRACE_SPAN("Build batch");
+            build(batch);
+        }
+    } catch (...) {
+        fail();
+    }
+
+    reader.join();
+    for (size_t i = 0; i < parsers.size(); ++i)
+        parsers[i].join();
+    if (error) rethrow_exception(error);
+}
+
+#endif // INGESTION_PIPELINE_INCLUDED
@@ -0,0 +1,226 @@
+/**************************************************************
+ * File: InternedKDTree.h
+ *
+ * A kd-tree whose nodes store value IDs instead of values.
+ * Every distinct value is interned once in a ValueDictionary,
+ * and the underlying tree maps each point to a four-byte ID.
+ * A tree labelling millions of points with a few thousand
+ * strings then needs no per-point string at all:
+ *
+ * InternedKDTree<2, string> kd;
+ * kd.insert(v, "US06");
+ * cout << kd.kNNValue(v, 3) << endl;
+ *
+ * k-NN votes are counted on the IDs, and only the winning ID
+ * is turned back into a value.  Any tree type taking <N,
+ * ElemType> template arguments can sit underneath, so a
+ * LazyKDTree can be interned the same way:
+ *
+ * InternedKDTree<2, string, LazyKDTree> kd;
+ * kd.build(elems);
+ *
+ * Each of the underlying tree's operations is only available
+ * if that tree supports it.  Values are read-only through the
+ * interned tree, since one dictionary entry is shared by many
+ * points.  When several values tie in a vote, the one chosen
+ * may differ from the one a plain tree over the same points
+ * would choose.
+ */
+
+#ifndef INTERNED_KDTREE_INCLUDED
+#define INTERNED_KDTREE_INCLUDED
+
+#include "KDTree.h"
+#include "ValueDictionary.h"
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree = KDTree>
+class InternedKDTree {
+public:
+    /**
+     * size_t dimension() const;
+     * size_t size() const;
+     * bool empty() const;
+     * Usage: if (kd.empty())
+     * ----------------------------------------------------
+     * Returns the dimension of the points, the number of
+     * elements in the tree and whether it is empty.
+     */
+    size_t dimension() const;
+    size_t size() const;
+    bool empty() const;
+
+    /**
+     * const ValueDictionary<ElemType>& dictionary() const;
+     * Usage: cout << kd.dictionary().size() << " distinct values" << endl;
+     * ----------------------------------------------------
+     * Returns the dictionary of values in the tree.
+     */
+    const ValueDictionary<ElemType>& dictionary() const;
+
+    /**
+     * void insert(const Point<N>& pt, const ElemType& value);
+     * Usage: kd.insert(v, "This value is associated with v.");
+     * ----------------------------------------------------
+     * Inserts the point pt into the tree, associating it
+     * with the specified value.  If the element already
+     * existed in the tree, the new value will overwrite the
+     * existing one.
+     */
+    void insert(const Point<N>& pt, const ElemType& value);
+
+    /**
+     * void build(const vector< pair<Point<N>, ElemType> >& elems);
+     * Usage: kd.build(elems);
+     * ----------------------------------------------------
+     * Replaces the contents of the tree with the specified
+     * points and values, interning the values on the way.
+     * The dictionary keeps any values interned before.
+     */
+    void build(const vector< pair<Point<N>, ElemType> >& elems);
+
+    /**
+     * bool contains(const Point<N>& pt) const;
+     * const ElemType& at(const Point<N>& pt) const;
+     * Usage: if (kd.contains(v)) cout << kd.at(v) << endl;
+     * ----------------------------------------------------
+     * Returns whether the point is in the tree, or the value
+     * associated with it.  at throws out_of_range if the
+     * point is not in the tree.
+     */
+    bool contains(const Point<N>& pt) const;
+    const ElemType& at(const Point<N>& pt) const;
+
+    /**
+     * ElemType kNNValue(const Point<N>& key, size_t k) const
+     * Usage: cout << kd.kNNValue(v, 3) << endl;
+     * ----------------------------------------------------
+     * Given a point v and an integer k, finds the k points
+     * in the tree nearest to v and returns the most common
+     * value associated with those points.  In the event of
+     * a tie, one of the most frequent value will be chosen.
+     */
+    ElemType kNNValue(const Point<N>& key, size_t k) const;
+
+    /**
+     * void save(const string& path, uint64_t sourceFingerprint = 0) const;
+     * void load(const string& path, uint64_t sourceFingerprint = 0);
+     * Usage: kd.save("places.kdt");
+     *        kd.load("places.kdt");
+     * ----------------------------------------------------
+     * Writes the tree to a file in the underlying tree's
+     * format, with the dictionary alongside it in path plus
+     * ".values", or replaces the contents of this tree with
+     * the contents of such a pair of files.  The tree file
+     * records the fingerprint of the dictionary it was
+     * saved with, so load rejects a tree and a dictionary
+     * that don't belong together, as well as a tree built
+     * from different source data.  Both throw runtime_error
+     * on failure; if load fails, this tree is left
+     * unchanged.
+     */
+    void save(const string& path, uint64_t sourceFingerprint = 0) const;
+    void load(const string& path, uint64_t sourceFingerprint = 0);
+
+private:
+    Tree<N, uint32_t> tree;
+    ValueDictionary<ElemType> values;
+};
+
+
+/////////////////////////////////////////////////
+// InternedKDTree class implementation details //
+/////////////////////////////////////////////////
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+size_t InternedKDTree<N, ElemType, Tree>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+size_t InternedKDTree<N, ElemType, Tree>::size() const {
+    return tree.size();
+}
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+bool InternedKDTree<N, ElemType, Tree>::empty() const {
+    return tree.empty();
+}
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+const ValueDictionary<ElemType>& InternedKDTree<N, ElemType, Tree>::dictionary() const {
+    return values;
+}
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+void InternedKDTree<N, ElemType, Tree>::insert(const Point<N>& pt, const ElemType& value) {
+    tree.insert(pt, values.intern(value));
+}
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+void InternedKDTree<N, ElemType, Tree>::build(const vector< pair<Point<N>, ElemType> >& elems) {
+    KDTREE_TRACE_SPAN("InternedKDTree::build");
+    vector< pair<Point<N>, uint32_t> > interned;
+    {
+        KDTREE_TRACE_SPAN("Intern values");
+        interned.reserve(elems.size());
+        for (size_t i = 0; i < elems.size(); ++i)
+            interned.push_back(make_pair(elems[i].first, values.intern(elems[i].second)));
+    }
+    tree.build(move(interned));
+}
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+bool InternedKDTree<N, ElemType, Tree>::contains(const Point<N>& pt) const {
+    return tree.contains(pt);
+}
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+const ElemType& InternedKDTree<N, ElemType, Tree>::at(const Point<N>& pt) const {
+    return values.value(tree.at(pt));
+}
+
+/*
+ * kNNValue(key, k)
+ * An empty tree votes for ID zero by default, which may be a real value,
+ * so that case is answered here.
+ */
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+ElemType InternedKDTree<N, ElemType, Tree>::kNNValue(const Point<N>& key, size_t k) const {
+    if (k == 0 || tree.empty()) return ElemType();
+    return values.value(tree.kNNValue(key, k));
+}
+
+/*
+ * Returns the fingerprint stored in the tree file: that of the source data
+ * mixed with that of the dictionary, so that a change to either one shows.
+ */
+inline uint64_t InternedKDTreeFingerprint(uint64_t sourceFingerprint, uint64_t dictionaryFingerprint) {
+    return (sourceFingerprint * 0x9E3779B97F4A7C15ULL) ^ dictionaryFingerprint;
+}
+
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+void InternedKDTree<N, ElemType, Tree>::save(const string& path, uint64_t sourceFingerprint) const {
+    values.save(path + ".values");
+    tree.save(path, InternedKDTreeFingerprint(sourceFingerprint, values.fingerprint()));
+}
+
+/*
+ * load(path, sourceFingerprint)
+ * The dictionary is read into a scratch copy first so that a missing or
+ * corrupt tree file leaves this tree as it was.  The tree file only loads
+ * if it was saved with that same dictionary, so every ID it holds names
+ * a value in it.
+ */
+template <size_t N, typename ElemType, template <size_t, typename> class Tree>
+void InternedKDTree<N, ElemType, Tree>::load(const string& path, uint64_t sourceFingerprint) {
+    ValueDictionary<ElemType> loaded;
+    loaded.load(path + ".values");
+    tree.load(path, InternedKDTreeFingerprint(sourceFingerprint, loaded.fingerprint()));
+    swap(values, loaded);
+}
+
+#endif // INTERNED_KDTREE_INCLUDED
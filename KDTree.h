@@ -12,16 +12,161 @@
 
 #include "Point.h"
 #include "BoundedPQueue.h"
+#include "BinarySerialization.h"
+#include "WorkStealingPool.h"
+#include "Tracing.h"
 #include <stdexcept>
 #include <cmath>
 #include <assert.h>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <limits>
+
+/* KDTREE_PREFETCH(address) hints to the processor that the memory at the
+ * address will be read soon.  It expands to nothing on compilers without
+ * a prefetch builtin.
+ */
+#if defined(__GNUC__)
+#define KDTREE_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define KDTREE_PREFETCH(address) ((void)0)
+#endif
+
+/* KDTREE_PREFETCH_DISTANCE is how many levels below the current node the
+ * lookups and the k-NN search prefetch as they descend.  At 1 only the
+ * children are prefetched, which never reads memory that isn't already on
+ * its way; larger distances also read the child pointers of nodes that
+ * were prefetched on earlier steps, trading some risk of stalling for a
+ * longer head start.  Define it as 0 to turn prefetching off.
+ */
+#ifndef KDTREE_PREFETCH_DISTANCE
+#define KDTREE_PREFETCH_DISTANCE 1
+#endif
 
 // Again, "using namespace" in a header file is not conventionally a good idea,
 // but we use it here so that you may use things like size_t without having to
 // type std::size_t every time.
 using namespace std;
 
+/* Orders in which KDTree::relayout can arrange the nodes of a tree in memory. */
+enum KDTreeNodeLayout {
+    kKDTreeAllocationOrder,   // Leave every node where it was allocated
+    kKDTreeBreadthFirstOrder, // Level by level from the root
+    kKDTreeVanEmdeBoasOrder   // Top half of the tree, then each bottom subtree, recursively
+};
+
+/**
+ * Trait: KDTreeValuesOutOfLine<ElemType>
+ * Usage: template <> struct KDTreeValuesOutOfLine<Record> : true_type {};
+ * ----------------------------------------------------
+ * Whether KDTrees keep their values out of line.  By
+ * default every node holds its value next to its point,
+ * which is best for small values.  Specializing this trait
+ * as true_type for a large value type leaves only a
+ * pointer to the value in each node, so that searches,
+ * which never look at values until they vote, touch far
+ * fewer cache lines.  The cost is one more allocation per
+ * point.
+ */
+template <typename ElemType>
+struct KDTreeValuesOutOfLine : false_type {};
+
+/* What a node holds in place of a value kept out of line.  It owns the
+ * value and copies it deeply, and converts to a reference to it, so the
+ * tree reads and writes values the same way whichever way they are kept.
+ * No value is allocated until one is first stored.
+ */
+template <typename ElemType>
+class KDTreeOutOfLineValue {
+public:
+    KDTreeOutOfLineValue();
+    KDTreeOutOfLineValue(const KDTreeOutOfLineValue& other);
+    ~KDTreeOutOfLineValue();
+
+    KDTreeOutOfLineValue& operator=(const KDTreeOutOfLineValue& other);
+    KDTreeOutOfLineValue& operator=(const ElemType& newValue);
+
+    operator ElemType&();
+    operator const ElemType&() const;
+
+    friend void swap(KDTreeOutOfLineValue& one, KDTreeOutOfLineValue& two) {
+        std::swap(one.value, two.value);
+    }
+
+private:
+    ElemType* value;
+};
+
+/**
+ * Struct: KDTreeQueryStats
+ * Usage: KDTreeQueryStats stats;
+ *        kd.kNNValue(v, 3, stats);
+ * ----------------------------------------------------
+ * Counters describing the work done by one k-NN search.
+ * A far branch is the child on the other side of a
+ * splitting plane from the query; it is explored only
+ * if the plane is closer than the k-th best distance
+ * found so far, and pruned otherwise.  maxDepth is the
+ * deepest level of the recursion, counting the root as
+ * depth one.
+ */
+struct KDTreeQueryStats {
+    size_t nodesVisited;
+    size_t distancesComputed;
+    size_t farBranchesExplored;
+    size_t farBranchesPruned;
+    size_t maxDepth;
+    double elapsedSeconds;
+
+    KDTreeQueryStats();
+
+    /* Hooks called by the search as it goes. */
+    void visitNode(size_t depth);
+    void computeDistance();
+    void exploreFarBranch();
+    void pruneFarBranch();
+};
+
+/**
+ * Struct: KDTreeShapeStats
+ * Usage: KDTreeShapeStats shape = kd.stats();
+ *        if (shape.height > 4 * log2(kd.size() + 1)) rebuild();
+ * ----------------------------------------------------
+ * A description of the shape and memory use of a tree.
+ * Depths count the root as depth zero, so height is the
+ * number of levels and nodesAtDepth has one entry per
+ * level.  imbalanceAtDepth gives, for each level, the
+ * average over the nodes there with children of the
+ * share of their descendants in the larger subtree:
+ * 0.5 is perfectly balanced and 1.0 is a chain.  The
+ * byte counts cover the nodes themselves, split into
+ * coordinates, values and everything else (level and
+ * child pointers), but not memory that values such as
+ * strings allocate on their own.  nodeCount includes
+ * the nodes of erased points that are still waiting to
+ * be compacted away; numElements does not.
+ */
+struct KDTreeShapeStats {
+    size_t height;
+    size_t nodeCount;
+    size_t numElements;
+    size_t leafCount;
+    double averageLeafDepth;
+    vector<size_t> nodesAtDepth;
+    vector<double> imbalanceAtDepth;
+
+    size_t nodeOverheadBytes;
+    size_t coordinateBytes;
+    size_t valueBytes;
+
+    KDTreeShapeStats();
+
+    /* Returns the sum of the three byte counts. */
+    size_t totalBytes() const;
+};
+
 template <size_t N, typename ElemType>
 class KDTree {
 public:
@@ -78,7 +223,7 @@ public:
      * Usage: if (kd.contains(pt)) { ... }
      * ----------------------------------------------------
      * Returns whether the specified point is contained in 
-     * the KDTree.
+     * the KDTree.  This never allocates memory.
      */
     bool contains(const Point<N>& pt) const;
 
@@ -89,10 +234,74 @@ public:
      * Inserts the point pt into the KDTree, associating it
      * with the specified value. If the element already existed
      * in the tree, the new value will overwrite the existing
-     * one.
+     * one.  If the new point lands too deep in the tree, the
+     * smallest subtree above it that is out of balance is
+     * rebuilt around its medians, so the height stays
+     * logarithmic whatever order the points arrive in.
      */
     void insert(const Point<N>& pt, const ElemType& value);
 
+    /**
+     * bool erase(const Point<N>& pt);
+     * Usage: if (kd.erase(v)) cout << "Removed v" << endl;
+     * ----------------------------------------------------
+     * Removes the point pt and its value from the KDTree,
+     * returning whether the point was there.  The point's
+     * node is only marked as erased, which takes time
+     * proportional to its depth, and searches step over
+     * it.  Once erased nodes make up more than a quarter
+     * of the tree, the tree is compacted.
+     */
+    bool erase(const Point<N>& pt);
+
+    /**
+     * void compact();
+     * Usage: kd.compact();
+     * ----------------------------------------------------
+     * Frees the nodes of erased points and rebuilds the
+     * tree around its medians from the points that
+     * remain.  erase compacts the tree on its own when
+     * needed; this is for compacting it sooner, say
+     * before saving it.  The nodes of the remaining points
+     * are reused in place, so their values don't move.
+     */
+    void compact();
+
+    /**
+     * void build(const vector< pair<Point<N>, ElemType> >& elems);
+     * void build(const vector< pair<Point<N>, ElemType> >& elems, WorkStealingPool& pool);
+     * Usage: kd.build(elems, pool);
+     * ----------------------------------------------------
+     * Replaces the contents of the KDTree with a balanced
+     * tree holding the specified points and values, built
+     * by repeatedly splitting the points at their median.
+     * If a point appears more than once, the last value
+     * wins, just as if the elements had been inserted in
+     * order.  The second version splits the work across
+     * the threads of the pool.
+     */
+    void build(const vector< pair<Point<N>, ElemType> >& elems,
+               KDTreeNodeLayout layout = kKDTreeAllocationOrder);
+    void build(const vector< pair<Point<N>, ElemType> >& elems, WorkStealingPool& pool,
+               KDTreeNodeLayout layout = kKDTreeAllocationOrder);
+
+    /**
+     * void relayout(KDTreeNodeLayout layout = kKDTreeVanEmdeBoasOrder);
+     * Usage: kd.relayout();
+     * ----------------------------------------------------
+     * Moves every node of the tree into one contiguous
+     * block of memory, arranged in the specified order.
+     * In van Emde Boas order each small subtree occupies a
+     * contiguous run of memory at every scale, so the steps
+     * of a descent, and the descents of nearby queries,
+     * tend to share cache lines and pages whatever the
+     * cache sizes are.  Points inserted afterwards are
+     * allocated individually as usual; relayout again
+     * after large batches of inserts.  The build functions
+     * accept a layout to apply once the tree is built.
+     */
+    void relayout(KDTreeNodeLayout layout = kKDTreeVanEmdeBoasOrder);
+
     /**
      * ElemType& operator[](const Point<N>& pt);
      * Usage: kd[v] = "Some Value";
@@ -100,7 +309,7 @@ public:
      * Returns a reference to the value associated with point
      * pt in the KDTree. If the point does not exist, then
      * it is added to the KDTree using the default value of
-     * ElemType as its key.
+     * ElemType as its key, rebalancing just as insert does.
      */
     ElemType& operator[](const Point<N>& pt);
 
@@ -111,7 +320,8 @@ public:
      * ----------------------------------------------------
      * Returns a reference to the key associated with the point
      * pt. If the point is not in the tree, this function throws
-     * an out_of_range exception.
+     * an out_of_range exception.  Finding a point never
+     * allocates memory.
      */
     ElemType& at(const Point<N>& pt);
     const ElemType& at(const Point<N>& pt) const;
@@ -127,14 +337,120 @@ public:
      */
     ElemType kNNValue(const Point<N>& key, size_t k) const;
 
+    /**
+     * ElemType kNNValue(const Point<N>& key, size_t k, KDTreeQueryStats& stats) const
+     * Usage: KDTreeQueryStats stats;
+     *        cout << kd.kNNValue(v, 3, stats) << endl;
+     *        cout << stats.nodesVisited << endl;
+     * ----------------------------------------------------
+     * Same as kNNValue, but also fills in stats with the
+     * work the search did and how long it took.  The plain
+     * kNNValue shares the same search code with the
+     * counting compiled out, so it pays nothing for this.
+     */
+    ElemType kNNValue(const Point<N>& key, size_t k, KDTreeQueryStats& stats) const;
+
+    /**
+     * ElemType kNNValue(const Point<N>& key, size_t k, WorkStealingPool& pool) const
+     * Usage: cout << kd.kNNValue(v, 3, pool) << endl;
+     * ----------------------------------------------------
+     * Same as kNNValue, but splits a single search across
+     * the threads of the pool.  The top levels of the tree
+     * are expanded into subtrees that are searched as
+     * separate tasks, all pruning against a shared bound
+     * on the distance to the k-th nearest point found so
+     * far.  This pays off for large, high-dimensional trees
+     * where one query visits many nodes.
+     */
+    ElemType kNNValue(const Point<N>& key, size_t k, WorkStealingPool& pool) const;
+
+    /**
+     * vector<ElemType> kNNValues(const vector< Point<N> >& keys, size_t k,
+     *                            size_t inFlight = 16) const
+     * Usage: vector<string> names = kd.kNNValues(queries, 3);
+     * ----------------------------------------------------
+     * Returns kNNValue(keys[i], k) for every key, in order.
+     * Rather than running the searches one at a time, up
+     * to inFlight of them are interleaved on the calling
+     * thread: each search advances by one node and then
+     * prefetches the node it will visit next while the
+     * other searches take their turns.  On trees too large
+     * for the cache this overlaps the memory stalls of the
+     * different searches.
+     */
+    vector<ElemType> kNNValues(const vector< Point<N> >& keys, size_t k, size_t inFlight = 16) const;
+
+    /**
+     * void kNearest(const Point<N>& key, BoundedPQueue<const ElemType*>& nearest) const;
+     * Usage: BoundedPQueue<const string*> nearest(3);
+     *        one.kNearest(v, nearest);
+     *        two.kNearest(v, nearest);
+     * ----------------------------------------------------
+     * Offers the points of this tree nearest to key to the
+     * queue, as pointers to their values, skipping any
+     * subtree that can't beat the k-th best distance the
+     * queue already holds.  Searching several trees with
+     * one queue therefore finds the k nearest points
+     * across all of them, with each search pruned by what
+     * the others found.  The pointers remain valid until
+     * this tree is next modified.
+     */
+    void kNearest(const Point<N>& key, BoundedPQueue<const ElemType*>& nearest) const;
+
+    /**
+     * vector< pair<Point<N>, ElemType> > elements() const;
+     * Usage: vector< pair<Point<2>, string> > elems = kd.elements();
+     * ----------------------------------------------------
+     * Returns every point in the tree along with its value,
+     * in no particular order.
+     */
+    vector< pair<Point<N>, ElemType> > elements() const;
+
+    /**
+     * void save(const string& path, uint64_t sourceFingerprint = 0) const;
+     * void load(const string& path, uint64_t sourceFingerprint = 0);
+     * Usage: kd.save("places.kdt");
+     *        kd.load("places.kdt");
+     * ----------------------------------------------------
+     * Writes the KDTree to a binary snapshot file, or
+     * replaces the contents of this KDTree with the tree
+     * stored in such a file.  The snapshot records the
+     * node layout of the tree, so loading it restores the
+     * exact same tree without reinserting any points.  It
+     * also records the fingerprint of the data the tree
+     * was built from, and load rejects a snapshot stored
+     * with a different one.  Both functions throw
+     * runtime_error on failure; if load fails, this KDTree
+     * is left unchanged.
+     */
+    void save(const string& path, uint64_t sourceFingerprint = 0) const;
+    void load(const string& path, uint64_t sourceFingerprint = 0);
+
+    /**
+     * KDTreeShapeStats stats() const;
+     * Usage: KDTreeShapeStats shape = kd.stats();
+     * ----------------------------------------------------
+     * Walks the whole tree and reports its height, how
+     * its nodes are spread over the levels, how balanced
+     * each level is, and how much memory its nodes use.
+     * This takes time linear in the size of the tree.
+     */
+    KDTreeShapeStats stats() const;
+
 private:
   /******************************************
    *        Implementation details.         *
    ******************************************/
+    /* What a node holds its value in: the value itself, or a handle to it
+     if the value is kept out of line */
+    typedef typename conditional<KDTreeValuesOutOfLine<ElemType>::value,
+                                 KDTreeOutOfLineValue<ElemType>, ElemType>::type ValueSlot;
+    
     struct Node {
         
         Point<N> key;
-        ElemType value;
+        ValueSlot value;
+        bool erased;
         size_t level;
         
         Node* rNodePtr;
@@ -143,37 +459,253 @@ private:
     
     Node* root;
     
-    /* The number of elements currently stored */
+    /* The number of elements currently stored, and the number of nodes
+     still in the tree whose points have been erased */
     size_t numElements;
+    size_t numErased;
+    
+    /* The contiguous block of nodes made by relayout, if any.  Nodes inside
+     it are freed with the block rather than one at a time. */
+    Node* nodeArena;
+    size_t nodeArenaSize;
     
     /* Takes in a node and recursively delete's the subtree it represents
      going from its children up */
     void deleteNode(Node* currentNode);
     
+    /* Frees every node, including the arena, leaving the tree empty */
+    void clearTree();
+    
+    /* Returns whether a node lives in the arena */
+    bool isArenaNode(Node* currentNode) const;
+    
+    /* Work that rebalancing may still do before it is skipped, negative
+     while it is in debt; see rebalanceAfterInsert */
+    ptrdiff_t rebuildCredit;
+    
+    /* Scapegoat rebalancing.  After a point is inserted at some depth, finds
+     the subtree above it that is too deep for its size and rebuilds it
+     around its medians, reusing the existing nodes */
+    void rebalanceAfterInsert(const Point<N>& pt, size_t depth);
+    static size_t scapegoatHeight(size_t size);
+    size_t subtreeSize(Node* currentNode) const;
+    void flattenSubtree(Node* currentNode, Node*& list);
+    Node* buildFromList(Node* list, size_t count, size_t level);
+    static void moveList(Node* source, Node*& destination, size_t& destinationCount);
+    
+    /* Helpers for relayout that compute a subtree's height and list its
+     nodes in van Emde Boas order */
+    size_t subtreeHeight(Node* currentNode) const;
+    void vanEmdeBoasOrder(Node* currentNode, size_t height, vector<Node*>& order) const;
+    void collectAtDepth(Node* currentNode, size_t depth, vector<Node*>& nodes) const;
+    
     /* Helper function for copyinga KDTree */
     Node* copyTree(Node* rootNode);
     
-    /* Recursive helper function for the KNNValue function */
-    void KNNValueRecurse(const Point<N>&key, BoundedPQueue<Node*>& nearestPQ, Node* currentNode) const;
+    /* A node waiting to be placed by build, tagged with its position in the
+     input so that the last of several duplicates can be kept */
+    struct BuildEntry {
+        Node* node;
+        size_t order;
+    };
+    
+    /* State shared by every task of one call to build */
+    struct BuildContext {
+        WorkStealingPool* pool;
+        WorkStealingPool::TaskGroup* group;
+        BuildEntry* entries;
+        BuildEntry* scratch;
+        atomic<size_t> duplicates;
+    };
+    
+    /* Shared implementation of both versions of build */
+    void buildTree(const vector< pair<Point<N>, ElemType> >& elems, WorkStealingPool* pool);
+    
+    /* Builds a balanced subtree from a range of entries and stores its root in slot */
+    void buildSubtree(BuildContext& context, BuildEntry* begin, BuildEntry* end, size_t level, Node** slot);
+    
+    /* Moves the entries satisfying a predicate to the front of a range, in
+     parallel for large ranges, and returns the end of that prefix */
+    template <typename Predicate>
+    BuildEntry* partitionEntries(BuildContext& context, BuildEntry* begin, BuildEntry* end, Predicate pred);
+    
+    /* Prefetch helpers for the descent loops.  The first prefetches the
+     nodes up to distance levels below a node along with the coordinate each
+     of them splits on; the second prefetches all of a node's point */
+    void prefetchDescendants(const Node* currentNode, size_t distance) const;
+    void prefetchPoint(const Node* currentNode) const;
+    
+    /* Stands in for KDTreeQueryStats when no one is counting; every hook
+     is empty, so the counting in KNNValueSearch compiles away */
+    struct NoQueryStats {
+        void visitNode(size_t) {}
+        void computeDistance() {}
+        void exploreFarBranch() {}
+        void pruneFarBranch() {}
+    };
+
+    /* Helper function for the KNNValue function, reporting its progress to
+     stats.  The queue holds either nodes or pointers to values, as produced
+     by asCandidate */
+    template <typename Candidate, typename QueryStats>
+    void KNNValueSearch(const Point<N>&key, BoundedPQueue<Candidate>& nearestPQ, QueryStats& stats) const;
+    static Node* asCandidate(Node* currentNode, Node*) { return currentNode; }
+    static const ElemType* asCandidate(Node* currentNode, const ElemType*) {
+        return &static_cast<const ElemType&>(currentNode->value);
+    }
+    
+    /* Helper for the parallel kNNValue, which also prunes against and
+     tightens a bound shared with the other subtree searches */
+    void KNNValueSearchShared(const Point<N>&key, BoundedPQueue<Node*>& nearestPQ, Node* currentNode, atomic<double>& sharedWorst) const;
     
     /* A helper function that returns the most commonly occuring value
      stored in the Nodes of a Node* PQ */
-    ElemType FindMostCommonValueInPQ(BoundedPQueue<Node*> nearestPQ) const;
+    ElemType FindMostCommonValueInPQ(const BoundedPQueue<Node*>& nearestPQ) const;
+    
+    /* Helpers that write and read the nodes of a snapshot in preorder */
+    void saveNodes(BinaryWriter& out) const;
+    Node* loadNodes(BinaryReader& in, const string& path, size_t& nodeCount, size_t& erasedCount);
+    
+    /* The KDTreeView exporter reads the nodes directly */
+    template <size_t M, typename T>
+    friend void ExportKDTreeView(const KDTree<M, T>& kd, const string& path);
     
 };
 
+/**
+ * ElemType MostCommonValue(const BoundedPQueue<const ElemType*>& nearest);
+ * Usage: cout << MostCommonValue(nearest) << endl;
+ * ----------------------------------------------------
+ * Returns the most common of the values in a queue
+ * filled by kNearest, breaking ties the same way
+ * kNNValue does, or the default value of ElemType if
+ * the queue is empty.  Indexes made of several KDTrees
+ * use this to answer kNNValue from one shared queue.
+ */
+template <typename ElemType>
+ElemType MostCommonValue(const BoundedPQueue<const ElemType*>& nearest);
+
+/**
+ * void RemoveDuplicatePoints(vector< pair<PointType, ElemType> >& elems);
+ * Usage: RemoveDuplicatePoints(elems);
+ * ----------------------------------------------------
+ * Removes every element whose point appears again later
+ * in elems, so that the last value given for a point
+ * wins, just as it does when the points are inserted
+ * into a KDTree one at a time.  The remaining elements
+ * keep their order.  Trees built in one pass from a
+ * vector use this to match KDTree's handling of
+ * duplicates.
+ */
+template <typename PointType, typename ElemType>
+void RemoveDuplicatePoints(vector< pair<PointType, ElemType> >& elems);
+
 
 /////////////////////////////////////////
 // KDTree class implementation details //
 /////////////////////////////////////////
 
+#include <chrono>
+
+template <typename ElemType>
+KDTreeOutOfLineValue<ElemType>::KDTreeOutOfLineValue() : value(NULL) {}
+
+template <typename ElemType>
+KDTreeOutOfLineValue<ElemType>::KDTreeOutOfLineValue(const KDTreeOutOfLineValue& other) : value(NULL) {
+    if (other.value != NULL) value = new ElemType(*other.value);
+}
+
+template <typename ElemType>
+KDTreeOutOfLineValue<ElemType>::~KDTreeOutOfLineValue() {
+    delete value;
+}
+
+template <typename ElemType>
+KDTreeOutOfLineValue<ElemType>& KDTreeOutOfLineValue<ElemType>::operator=(const KDTreeOutOfLineValue& other) {
+    KDTreeOutOfLineValue copy(other);
+    swap(*this, copy);
+    return *this;
+}
+
+template <typename ElemType>
+KDTreeOutOfLineValue<ElemType>& KDTreeOutOfLineValue<ElemType>::operator=(const ElemType& newValue) {
+    if (value == NULL) value = new ElemType(newValue);
+    else *value = newValue;
+    return *this;
+}
+
+template <typename ElemType>
+KDTreeOutOfLineValue<ElemType>::operator ElemType&() {
+    if (value == NULL) value = new ElemType();
+    return *value;
+}
+
+/*
+ * A slot that has never held a value reads as the default value.
+ */
+template <typename ElemType>
+KDTreeOutOfLineValue<ElemType>::operator const ElemType&() const {
+    static const ElemType kDefaultValue = ElemType();
+    return value != NULL ? *value : kDefaultValue;
+}
+
+/*
+ * KDTreeQueryStats
+ * The hooks just bump counters; the search calls visitNode with the
+ * depth of each node it reaches.
+ */
+inline KDTreeQueryStats::KDTreeQueryStats() {
+    nodesVisited = 0;
+    distancesComputed = 0;
+    farBranchesExplored = 0;
+    farBranchesPruned = 0;
+    maxDepth = 0;
+    elapsedSeconds = 0.0;
+}
+
+inline void KDTreeQueryStats::visitNode(size_t depth) {
+    ++nodesVisited;
+    maxDepth = max(maxDepth, depth);
+}
+
+inline void KDTreeQueryStats::computeDistance() {
+    ++distancesComputed;
+}
+
+inline void KDTreeQueryStats::exploreFarBranch() {
+    ++farBranchesExplored;
+}
+
+inline void KDTreeQueryStats::pruneFarBranch() {
+    ++farBranchesPruned;
+}
+
+inline KDTreeShapeStats::KDTreeShapeStats() {
+    height = 0;
+    nodeCount = 0;
+    numElements = 0;
+    leafCount = 0;
+    averageLeafDepth = 0.0;
+    nodeOverheadBytes = 0;
+    coordinateBytes = 0;
+    valueBytes = 0;
+}
+
+inline size_t KDTreeShapeStats::totalBytes() const {
+    return nodeOverheadBytes + coordinateBytes + valueBytes;
+}
+
 /* 
  * Constructor 
  */
 template <size_t N, typename ElemType>
 KDTree<N, ElemType>::KDTree() {
     numElements = 0;
+    numErased = 0;
+    rebuildCredit = 0;
     root = NULL;
+    nodeArena = NULL;
+    nodeArenaSize = 0;
 }
 
 /* 
@@ -181,8 +713,7 @@ KDTree<N, ElemType>::KDTree() {
  */
 template <size_t N, typename ElemType>
 KDTree<N, ElemType>::~KDTree() {
-    deleteNode(root);
-    numElements = 0;
+    clearTree();
 }
 /* 
  * DeleteNode(currentNode)
@@ -191,12 +722,47 @@ KDTree<N, ElemType>::~KDTree() {
  */
 template <size_t N, typename ElemType>
 void KDTree<N, ElemType>::deleteNode(Node* currentNode) {
-    //Base Case
-    if (currentNode == NULL) return;
-    //Recursion
-    deleteNode(currentNode->rNodePtr);
-    deleteNode(currentNode->lNodePtr);
-    delete currentNode;
+    //Rotate left children up until there are none, so that deleting a
+    //deep tree needs neither recursion nor a stack
+    while (currentNode != NULL) {
+        Node* leftNode = currentNode->lNodePtr;
+        if (leftNode != NULL) {
+            currentNode->lNodePtr = leftNode->rNodePtr;
+            leftNode->rNodePtr = currentNode;
+            currentNode = leftNode;
+        } else {
+            Node* rightNode = currentNode->rNodePtr;
+            if (!isArenaNode(currentNode)) delete currentNode;
+            currentNode = rightNode;
+        }
+    }
+}
+
+/*
+ * clearTree()
+ * Deletes the individually allocated nodes, then the arena.
+ */
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::clearTree() {
+    deleteNode(root);
+    delete[] nodeArena;
+    root = NULL;
+    numElements = 0;
+    numErased = 0;
+    rebuildCredit = 0;
+    nodeArena = NULL;
+    nodeArenaSize = 0;
+}
+
+/*
+ * isArenaNode(currentNode)
+ * Checks whether the node's address falls within the arena.
+ */
+template <size_t N, typename ElemType>
+bool KDTree<N, ElemType>::isArenaNode(Node* currentNode) const {
+    return nodeArena != NULL &&
+           !less<Node*>()(currentNode, nodeArena) &&
+           less<Node*>()(currentNode, nodeArena + nodeArenaSize);
 }
 
 /* 
@@ -204,8 +770,12 @@ void KDTree<N, ElemType>::deleteNode(Node* currentNode) {
  */
 template <size_t N, typename ElemType>
 KDTree<N, ElemType>::KDTree(const KDTree& rhs) {
+    nodeArena = NULL;
+    nodeArenaSize = 0;
     root = copyTree(rhs.root);
     numElements = rhs.numElements;
+    numErased = rhs.numErased;
+    rebuildCredit = 0;
 }
 
 /*
@@ -216,33 +786,50 @@ KDTree<N, ElemType>::KDTree(const KDTree& rhs) {
 template <size_t N, typename ElemType>
 KDTree<N, ElemType>& KDTree<N, ElemType>::operator=(const KDTree& rhs) {
     if (this != &rhs) {
-        deleteNode(this->root);
+        clearTree();
         
         root = copyTree(rhs.root);
         numElements = rhs.numElements;
+        numErased = rhs.numErased;
     }
     return *this;
 }
 
 /*
  * copyTree(rootNode)
- * Private function to copy one tree from another. It uses a recursive method
- * subsequently copying sub trees fro each node in the overall tree. It then
- * returns the root node of the copy.
+ * Private function to copy one tree from another. It walks the tree with an
+ * explicit stack of nodes still to copy, each paired with the link in the
+ * copy that it belongs in, so that a degenerate tree can't overflow the
+ * call stack. It then returns the root node of the copy. Each copy is
+ * attached before its value is copied, so if that throws the partial copy
+ * can be freed.
  */
 template <size_t N, typename ElemType>
 typename KDTree<N, ElemType>::Node* KDTree<N, ElemType>::copyTree(Node* rootNode) {
-    if(rootNode == NULL) {
-        return NULL;
+    Node* rootNodeCopy = NULL;
+    try {
+        vector< pair<Node*, Node**> > pending;
+        if (rootNode != NULL) pending.push_back(make_pair(rootNode, &rootNodeCopy));
+        while (!pending.empty()) {
+            Node* currentNode = pending.back().first;
+            Node** link = pending.back().second;
+            pending.pop_back();
+            
+            Node* newNode = new Node;
+            newNode->lNodePtr = newNode->rNodePtr = NULL;
+            *link = newNode;
+            newNode->key = currentNode->key;
+            newNode->value = currentNode->value;
+            newNode->erased = currentNode->erased;
+            newNode->level = currentNode->level;
+            
+            if (currentNode->rNodePtr != NULL) pending.push_back(make_pair(currentNode->rNodePtr, &newNode->rNodePtr));
+            if (currentNode->lNodePtr != NULL) pending.push_back(make_pair(currentNode->lNodePtr, &newNode->lNodePtr));
+        }
+    } catch (...) {
+        deleteNode(rootNodeCopy);
+        throw;
     }
-    Node* rootNodeCopy = new Node;
-    rootNodeCopy->key = rootNode->key;
-    rootNodeCopy->value = rootNode->value;
-    rootNodeCopy->level = rootNode->level;
-    
-    rootNodeCopy->rNodePtr = copyTree(rootNode->rNodePtr);
-    rootNodeCopy->lNodePtr = copyTree(rootNode->lNodePtr);
-    
     return rootNodeCopy;
 }
 
@@ -281,7 +868,8 @@ template<size_t N, typename ElemType>
 bool KDTree<N, ElemType>::contains(const Point<N>& pt) const {
     Node* currentNode = root;
     while (currentNode != NULL) {
-        if(currentNode->key == pt) return true;
+        prefetchDescendants(currentNode, KDTREE_PREFETCH_DISTANCE);
+        if(currentNode->key == pt) return !currentNode->erased;
         
         /*Compares the correct parts of the pts to determine which of a node's
         subtrees to look in next. */
@@ -302,9 +890,14 @@ void KDTree<N, ElemType>::insert(const Point<N>& pt, const ElemType& value) {
     size_t level = 0;
     while (currentNode != NULL) {
         ++level;
-        //Edge Case: Duplicate Points
+        //Edge Case: Duplicate Points, which may bring an erased point back
         if (pt == currentNode->key) {
             currentNode->value = value;
+            if (currentNode->erased) {
+                currentNode->erased = false;
+                --numErased;
+                ++numElements;
+            }
             return;
         }
         
@@ -318,9 +911,8 @@ void KDTree<N, ElemType>::insert(const Point<N>& pt, const ElemType& value) {
             prevNode = currentNode;
             currentNode = currentNode->rNodePtr;
         } else {
-            //Should never get to this point in code
-            cout << "Error inserting elements into binary tree" << endl;
-            return;
+            //Only reachable with a NaN coordinate
+            throw runtime_error("Error inserting elements into binary tree");
         }
     }
     ++numElements;
@@ -328,6 +920,7 @@ void KDTree<N, ElemType>::insert(const Point<N>& pt, const ElemType& value) {
     Node* newNode = new Node;
     newNode->key = pt;
     newNode->value = value;
+    newNode->erased = false;
     newNode->level = level;
     newNode->rNodePtr = NULL;
     newNode->lNodePtr = NULL;
@@ -337,166 +930,892 @@ void KDTree<N, ElemType>::insert(const Point<N>& pt, const ElemType& value) {
     } else {
         pt[prevNode->level % N] >= prevNode->key[prevNode->level % N] ? prevNode->rNodePtr = newNode : prevNode->lNodePtr = newNode;
     }
-    
+    rebalanceAfterInsert(pt, level);
 }
 
 /*
- * operator[]
- * Returns a reference to the value associated with the Point key in the KDTree
- * If the key does not exist it is added to the KDTree using the ElemType default value.
+ * Once more than this fraction of the nodes belong to erased points,
+ * erase compacts the tree.
  */
-template<size_t N, typename Elemtype>
-Elemtype& KDTree<N, Elemtype>::operator[](const Point<N>& pt) {
+static const double kKDTreeMaxErasedFraction = 0.25;
+
+/*
+ * erase(pt)
+ * Finds the point's node and marks it as erased, releasing whatever the
+ * value held by resetting it to the default.
+ */
+template <size_t N, typename ElemType>
+bool KDTree<N, ElemType>::erase(const Point<N>& pt) {
     Node* currentNode = root;
-    Node* prevNode = NULL;
-    size_t level = 0;
-    while (currentNode != NULL) {
-        ++level;
-        //Edge Case: Duplicate Points
-        if (pt == currentNode->key) {
-            return currentNode->value;
-        }
-        
-        //Determine the level
+    while (currentNode != NULL && !(currentNode->key == pt)) {
         size_t keyIndex = currentNode->level % N;
-        //Compare the appropriate key indicies
-        if(pt[keyIndex] < currentNode->key[keyIndex]) {
-            prevNode = currentNode;
-            currentNode = currentNode->lNodePtr;
-        } else if (pt[keyIndex] >= currentNode->key[keyIndex]) {
-            prevNode = currentNode;
-            currentNode = currentNode->rNodePtr;
-        } else {
-            //Should never get to this point in code
-            cout << "Error inserting elements into binary tree" << endl;
-            return;
-        }
+        currentNode = pt[keyIndex] >= currentNode->key[keyIndex] ? currentNode->rNodePtr : currentNode->lNodePtr;
     }
-    ++numElements;
-    //Make the new node to insert into the KDTree
-    Node* newNode = new Node;
-    newNode->key = pt;
-    newNode->value = Elemtype();
-    newNode->level = level;
-    newNode->rNodePtr = NULL;
-    newNode->lNodePtr = NULL;
+    if (currentNode == NULL || currentNode->erased) return false;
     
-    if (currentNode == root) {
-        root = newNode;
-        return newNode->value;
-    } else {
-        pt[prevNode->level % N] >= prevNode->key[prevNode->level % N] ? prevNode->rNodePtr = newNode : prevNode->lNodePtr = newNode;
-        return newNode->value;
-    }
+    currentNode->erased = true;
+    currentNode->value = ElemType();
+    --numElements;
+    ++numErased;
+    if (numErased > kKDTreeMaxErasedFraction * (numElements + numErased))
+        compact();
+    return true;
 }
 
 /*
- * at(pt)
+ * compact()
+ * Unlinks every node into a list, frees the erased ones and rebuilds the
+ * rest with buildFromList.  Erased nodes in the arena can't be freed one
+ * at a time; they simply drop out of the tree until the arena goes.
  */
-
-template<size_t N, typename Elemtype>
-Elemtype& KDTree<N, Elemtype>::at(const Point<N>& pt) {
-    Node* currentNode = root;
-    while (currentNode != NULL) {
-        if(currentNode->key == pt) {
-            return currentNode->value;
-        }
-        //Find the keyIndex
-        size_t keyIndex = currentNode->level % N;
-        //Compare the appropriate key indicies
-        if(pt[keyIndex] < currentNode->key[keyIndex]) {
-            currentNode = currentNode->lNodePtr;
-        } else  {
-            currentNode = currentNode->rNodePtr;
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::compact() {
+    KDTREE_TRACE_SPAN("KDTree::compact");
+    Node* list = NULL;
+    flattenSubtree(root, list);
+    
+    Node* remaining = NULL;
+    size_t remainingCount = 0;
+    while (list != NULL) {
+        Node* next = list->lNodePtr;
+        if (list->erased) {
+            if (!isArenaNode(list)) delete list;
+        } else {
+            list->lNodePtr = remaining;
+            remaining = list;
+            ++remainingCount;
         }
+        list = next;
     }
-    throw out_of_range("That point does not exist");
+    
+    root = buildFromList(remaining, remainingCount, 0);
+    numErased = 0;
 }
 
 /*
- * at(pt)
- * Returns a reference to the value associated with the point
- * pt. If the point isn't in the tree it throws an exception.
+ * Ranges smaller than kKDTreeParallelBuildCutoff are built serially within
+ * a single task; ranges of at least kKDTreeParallelPartitionCutoff entries
+ * are partitioned in parallel around a sampled median.
  */
+static const size_t kKDTreeParallelBuildCutoff     = 8192;
+static const size_t kKDTreeParallelPartitionCutoff = 1 << 17;
+static const size_t kKDTreeMedianSampleSize        = 1023;
 
-template<size_t N, typename Elemtype>
-const Elemtype& KDTree<N, Elemtype>::at(const Point<N>& pt) const {
-    Node* currentNode = root;
-    while (currentNode != NULL) {
-        if(currentNode->key == pt) {
-            return currentNode->value;
-        }
-        //Find the keyIndex
-        size_t keyIndex = currentNode->level % N;
-        //Compare the appropriate key indicies
-        if(pt[keyIndex] < currentNode->key[keyIndex]) {
-            currentNode = currentNode->lNodePtr;
-        } else  {
-            currentNode = currentNode->rNodePtr;
-        }
-    }
-    throw out_of_range("That point does not exist");
+/*
+ * build(elems, layout)
+ * build(elems, pool, layout)
+ * Both versions forward to buildTree, which runs serially without a pool,
+ * and then lay out the result.
+ */
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::build(const vector< pair<Point<N>, ElemType> >& elems, KDTreeNodeLayout layout) {
+    buildTree(elems, NULL);
+    relayout(layout);
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::build(const vector< pair<Point<N>, ElemType> >& elems, WorkStealingPool& pool,
+                                KDTreeNodeLayout layout) {
+    buildTree(elems, &pool);
+    relayout(layout);
 }
 
 /*
- * kNNValue(pt, integer)
- * Given a point and integer, KNNValue finds the k points
- * in the KDTree nearest to v and returns the most common
- * value associated with those points. In a tie, one of the
- * most frequent will be chosen.
+ * buildTree(elems, pool)
+ * Allocates a node for every element, then splits the nodes into a
+ * balanced tree.  The old tree is only freed once the new one is done.
  */
-template<size_t N, typename ElemType>
-ElemType KDTree<N, ElemType>::kNNValue(const Point<N>& key, size_t k) const {
-    BoundedPQueue<Node*> nearestPQ(k);
-    KNNValueRecurse(key, nearestPQ, root);
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::buildTree(const vector< pair<Point<N>, ElemType> >& elems, WorkStealingPool* pool) {
+    KDTREE_TRACE_SPAN("KDTree::build");
+    vector<BuildEntry> entries(elems.size());
+    vector<BuildEntry> scratch(pool != NULL ? elems.size() : 0);
     
-    return FindMostCommonValueInPQ(nearestPQ);
+    WorkStealingPool::TaskGroup group;
+    BuildContext context;
+    context.pool = pool;
+    context.group = &group;
+    context.entries = entries.empty() ? NULL : &entries[0];
+    context.scratch = scratch.empty() ? NULL : &scratch[0];
+    context.duplicates = 0;
+    
+    /* Allocate the nodes, a block of elements per task. */
+    for (size_t blockStart = 0; blockStart < elems.size(); blockStart += kKDTreeParallelBuildCutoff) {
+        size_t blockEnd = min(elems.size(), blockStart + kKDTreeParallelBuildCutoff);
+        function<void()> allocate = [&elems, &entries, blockStart, blockEnd]() {
+            for (size_t i = blockStart; i < blockEnd; ++i) {
+                Node* newNode = new Node;
+                newNode->key = elems[i].first;
+                newNode->value = elems[i].second;
+                newNode->erased = false;
+                newNode->rNodePtr = NULL;
+                newNode->lNodePtr = NULL;
+                entries[i].node = newNode;
+                entries[i].order = i;
+            }
+        };
+        if (pool != NULL) pool->submit(group, allocate);
+        else allocate();
+    }
+    if (pool != NULL) pool->wait(group);
     
+    Node* newRoot = NULL;
+    if (!entries.empty()) {
+        buildSubtree(context, context.entries, context.entries + entries.size(), 0, &newRoot);
+        if (pool != NULL) pool->wait(group);
+    }
+    
+    clearTree();
+    root = newRoot;
+    numElements = entries.size() - context.duplicates;
 }
+
 /*
- * kNNValueRecurse(pt, bpq, currentNode)
- * A recursive helper function which builds a bounded
- * priority queue of the points nearest to the entered point in 
- * the KDTree
+ * buildSubtree(context, begin, end, level, slot)
+ * Picks the median entry along the splitting axis for this level and
+ * partitions the range into the entries strictly below it, the entries
+ * with exactly the same point, and everything else, matching the rule
+ * that ties go to the right.  The last of the equal entries becomes the
+ * node and the rest are freed.  Large ranges build their two subtrees
+ * as separate tasks.
  */
-template<size_t N, typename ElemType>
-void KDTree<N, ElemType>::KNNValueRecurse(const Point<N>&key, BoundedPQueue<Node*>& nearestPQ, Node* currentNode) const{
-    //Base case
-    if (currentNode == NULL) return;
-    //Execution
-    nearestPQ.enqueue(currentNode, Distance(currentNode->key, key));
-    //Recursion
-    size_t keyIndex = currentNode->level % N;
-    if(key[keyIndex] < currentNode->key[keyIndex]) {
-        KNNValueRecurse(key, nearestPQ, currentNode->lNodePtr);
-        //If the hypersphere crosses the splitting plane check the other subtree
-        if ( (nearestPQ.size() != nearestPQ.maxSize()) || fabs(currentNode->key[keyIndex] - key[keyIndex]) < nearestPQ.worst() ) {
-            KNNValueRecurse(key, nearestPQ, currentNode->rNodePtr);
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::buildSubtree(BuildContext& context, BuildEntry* begin, BuildEntry* end, size_t level, Node** slot) {
+    if (begin == end) {
+        *slot = NULL;
+        return;
+    }
+    
+    size_t keyIndex = level % N;
+    size_t count = end - begin;
+    
+    /* Choose the pivot.  Large ranges use the median of an evenly spaced
+     sample, which is much cheaper than an exact selection and still splits
+     the range nearly in half. */
+    Point<N> pivot;
+    if (context.pool != NULL && count >= kKDTreeParallelPartitionCutoff) {
+        vector<BuildEntry> sample(kKDTreeMedianSampleSize);
+        for (size_t i = 0; i < sample.size(); ++i)
+            sample[i] = begin[i * (count / sample.size())];
+        nth_element(sample.begin(), sample.begin() + sample.size() / 2, sample.end(), [keyIndex](const BuildEntry& one, const BuildEntry& two) {
+            return one.node->key[keyIndex] < two.node->key[keyIndex];
+        });
+        pivot = sample[sample.size() / 2].node->key;
+    } else {
+        nth_element(begin, begin + count / 2, end, [keyIndex](const BuildEntry& one, const BuildEntry& two) {
+            return one.node->key[keyIndex] < two.node->key[keyIndex];
+        });
+        pivot = begin[count / 2].node->key;
+    }
+    
+    BuildEntry* equalBegin = partitionEntries(context, begin, end, [keyIndex, &pivot](const BuildEntry& entry) {
+        return entry.node->key[keyIndex] < pivot[keyIndex];
+    });
+    BuildEntry* equalEnd = partitionEntries(context, equalBegin, end, [&pivot](const BuildEntry& entry) {
+        return entry.node->key == pivot;
+    });
+    
+    /* Keep the most recently inserted copy of the pivot point. */
+    BuildEntry* keep = equalBegin;
+    for (BuildEntry* entry = equalBegin + 1; entry != equalEnd; ++entry) {
+        if (entry->order > keep->order) keep = entry;
+    }
+    for (BuildEntry* entry = equalBegin; entry != equalEnd; ++entry) {
+        if (entry != keep) delete entry->node;
+    }
+    context.duplicates += (equalEnd - equalBegin) - 1;
+    
+    Node* newNode = keep->node;
+    newNode->level = level;
+    *slot = newNode;
+    
+    if (context.pool != NULL && count >= kKDTreeParallelBuildCutoff) {
+        BuildContext* shared = &context;
+        context.pool->submit(*context.group, [this, shared, begin, equalBegin, level, newNode]() {
+            buildSubtree(*shared, begin, equalBegin, level + 1, &newNode->lNodePtr);
+        });
+        buildSubtree(context, equalEnd, end, level + 1, &newNode->rNodePtr);
+    } else {
+        buildSubtree(context, begin, equalBegin, level + 1, &newNode->lNodePtr);
+        buildSubtree(context, equalEnd, end, level + 1, &newNode->rNodePtr);
+    }
+}
+
+/*
+ * partitionEntries(context, begin, end, pred)
+ * Small ranges use std::partition.  Large ones are cut into blocks that
+ * are partitioned concurrently; the blocks' halves are then copied into
+ * their final positions through the scratch buffer, also concurrently.
+ */
+template <size_t N, typename ElemType>
+template <typename Predicate>
+typename KDTree<N, ElemType>::BuildEntry* KDTree<N, ElemType>::partitionEntries(BuildContext& context, BuildEntry* begin, BuildEntry* end, Predicate pred) {
+    size_t count = end - begin;
+    if (context.pool == NULL || count < kKDTreeParallelPartitionCutoff)
+        return partition(begin, end, pred);
+    
+    size_t numBlocks = 4 * context.pool->numThreads();
+    size_t blockSize = (count + numBlocks - 1) / numBlocks;
+    numBlocks = (count + blockSize - 1) / blockSize;
+    vector<size_t> numTrue(numBlocks);
+    
+    WorkStealingPool::TaskGroup group;
+    for (size_t block = 0; block < numBlocks; ++block) {
+        context.pool->submit(group, [&, block]() {
+            BuildEntry* blockBegin = begin + block * blockSize;
+            BuildEntry* blockEnd = min(end, blockBegin + blockSize);
+            numTrue[block] = partition(blockBegin, blockEnd, pred) - blockBegin;
+        });
+    }
+    context.pool->wait(group);
+    
+    /* Work out where each block's two halves belong. */
+    vector<size_t> trueOffset(numBlocks), falseOffset(numBlocks);
+    size_t totalTrue = 0;
+    for (size_t block = 0; block < numBlocks; ++block) {
+        trueOffset[block] = totalTrue;
+        totalTrue += numTrue[block];
+    }
+    size_t totalFalse = totalTrue;
+    for (size_t block = 0; block < numBlocks; ++block) {
+        falseOffset[block] = totalFalse;
+        totalFalse += min(blockSize, count - block * blockSize) - numTrue[block];
+    }
+    
+    BuildEntry* scratch = context.scratch + (begin - context.entries);
+    for (size_t block = 0; block < numBlocks; ++block) {
+        context.pool->submit(group, [&, block]() {
+            BuildEntry* blockBegin = begin + block * blockSize;
+            BuildEntry* blockEnd = min(end, blockBegin + blockSize);
+            copy(blockBegin, blockBegin + numTrue[block], scratch + trueOffset[block]);
+            copy(blockBegin + numTrue[block], blockEnd, scratch + falseOffset[block]);
+        });
+    }
+    context.pool->wait(group);
+    
+    for (size_t block = 0; block < numBlocks; ++block) {
+        context.pool->submit(group, [&, block]() {
+            size_t blockStart = block * blockSize;
+            size_t blockEnd = min(count, blockStart + blockSize);
+            copy(scratch + blockStart, scratch + blockEnd, begin + blockStart);
+        });
+    }
+    context.pool->wait(group);
+    
+    return begin + totalTrue;
+}
+
+/*
+ * relayout(layout)
+ * Lists the nodes in the requested order, then moves them into a new
+ * arena.  Each old node is left holding a forwarding pointer to its new
+ * home in lNodePtr, which is then used to translate the child pointers.
+ */
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::relayout(KDTreeNodeLayout layout) {
+    if (layout == kKDTreeAllocationOrder || root == NULL) return;
+    KDTREE_TRACE_SPAN("KDTree::relayout");
+    
+    vector<Node*> order;
+    order.reserve(numElements);
+    if (layout == kKDTreeVanEmdeBoasOrder) {
+        vanEmdeBoasOrder(root, subtreeHeight(root), order);
+    } else {
+        order.push_back(root);
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (order[i]->lNodePtr != NULL) order.push_back(order[i]->lNodePtr);
+            if (order[i]->rNodePtr != NULL) order.push_back(order[i]->rNodePtr);
+        }
+    }
+    
+    Node* newArena = new Node[order.size()];
+    for (size_t i = 0; i < order.size(); ++i) {
+        Node& newNode = newArena[i];
+        newNode.key = order[i]->key;
+        swap(newNode.value, order[i]->value);
+        newNode.erased = order[i]->erased;
+        newNode.level = order[i]->level;
+        newNode.lNodePtr = order[i]->lNodePtr;
+        newNode.rNodePtr = order[i]->rNodePtr;
+        order[i]->lNodePtr = &newNode;
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        Node& newNode = newArena[i];
+        if (newNode.lNodePtr != NULL) newNode.lNodePtr = newNode.lNodePtr->lNodePtr;
+        if (newNode.rNodePtr != NULL) newNode.rNodePtr = newNode.rNodePtr->lNodePtr;
+    }
+    
+    /* The old nodes' pointers are no longer a tree, so free them from the list. */
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (!isArenaNode(order[i])) delete order[i];
+    }
+    delete[] nodeArena;
+    
+    nodeArena = newArena;
+    nodeArenaSize = order.size();
+    root = &newArena[0];
+}
+
+/*
+ * A subtree of size n may be at most log base 1/alpha of n levels tall
+ * before it counts as out of balance.  Each insert also earns the tree
+ * kKDTreeRebuildCreditPerLevel units of rebalancing work per level it may
+ * have, and both the search for an unbalanced subtree and its rebuild are
+ * paid for out of those credits.  This bounds the total work even when
+ * ties on the splitting axes keep a rebuilt subtree from getting any
+ * shorter.
+ */
+static const double kKDTreeScapegoatAlpha        = 0.75;
+static const size_t kKDTreeRebuildCreditPerLevel = 4;
+
+/*
+ * rebalanceAfterInsert(pt, depth)
+ * The tree keeps no parent pointers, so the descent to the new node
+ * reverses each link it follows to point back at the parent instead;
+ * climbing back up restores the links one by one.  On the way up the
+ * subtree sizes are added up until an ancestor turns out to be taller
+ * than its size allows, and that ancestor's subtree is rebuilt.  The
+ * climb is only started when the credit covers it, the search gives up
+ * once it has spent the available credit, and a rebuild the credit can't
+ * cover is left for a later insert.
+ */
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::rebalanceAfterInsert(const Point<N>& pt, size_t depth) {
+    size_t maxHeight = scapegoatHeight(numElements + numErased);
+    rebuildCredit += ptrdiff_t(kKDTreeRebuildCreditPerLevel * (maxHeight + 1));
+    if (depth <= maxHeight || rebuildCredit < ptrdiff_t(depth)) return;
+    rebuildCredit -= ptrdiff_t(depth);
+    
+    Node* parent = NULL;
+    Node* currentNode = root;
+    for (size_t i = 0; i < depth; ++i) {
+        size_t keyIndex = currentNode->level % N;
+        Node*& link = pt[keyIndex] >= currentNode->key[keyIndex] ? currentNode->rNodePtr : currentNode->lNodePtr;
+        Node* next = link;
+        link = parent;
+        parent = currentNode;
+        currentNode = next;
+    }
+    
+    bool searching = true;
+    size_t childSize = 1;
+    size_t ancestorDepth = depth;
+    while (parent != NULL) {
+        --ancestorDepth;
+        Node* ancestor = parent;
+        size_t keyIndex = ancestor->level % N;
+        bool wentRight = pt[keyIndex] >= ancestor->key[keyIndex];
+        Node*& link = wentRight ? ancestor->rNodePtr : ancestor->lNodePtr;
+        parent = link;
+        link = currentNode;
+        currentNode = ancestor;
+        if (!searching) continue;
+        
+        size_t siblingSize = subtreeSize(wentRight ? ancestor->lNodePtr : ancestor->rNodePtr);
+        size_t size = childSize + 1 + siblingSize;
+        rebuildCredit -= ptrdiff_t(siblingSize);
+        if (depth - ancestorDepth > scapegoatHeight(size)) {
+            searching = false;
+            if (rebuildCredit >= ptrdiff_t(size)) {
+                rebuildCredit -= ptrdiff_t(size);
+                Node* list = NULL;
+                flattenSubtree(ancestor, list);
+                currentNode = buildFromList(list, size, ancestor->level);
+            }
+        } else if (rebuildCredit <= 0) {
+            searching = false;
+        }
+        childSize = size;
+    }
+    root = currentNode;
+}
+
+template <size_t N, typename ElemType>
+size_t KDTree<N, ElemType>::scapegoatHeight(size_t size) {
+    return size_t(log(double(size)) / log(1.0 / kKDTreeScapegoatAlpha));
+}
+
+/*
+ * subtreeSize(currentNode)
+ * Counts the nodes of the subtree, erased or not, using an explicit stack.
+ */
+template <size_t N, typename ElemType>
+size_t KDTree<N, ElemType>::subtreeSize(Node* currentNode) const {
+    size_t size = 0;
+    vector<Node*> pending;
+    if (currentNode != NULL) pending.push_back(currentNode);
+    while (!pending.empty()) {
+        Node* node = pending.back();
+        pending.pop_back();
+        ++size;
+        if (node->lNodePtr != NULL) pending.push_back(node->lNodePtr);
+        if (node->rNodePtr != NULL) pending.push_back(node->rNodePtr);
+    }
+    return size;
+}
+
+/*
+ * flattenSubtree(currentNode, list)
+ * Pushes every node of the subtree onto a singly linked list threaded
+ * through lNodePtr.  The nodes are linked in preorder, right subtrees
+ * first, using an explicit stack; a node's children are stacked before
+ * its lNodePtr is overwritten.
+ */
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::flattenSubtree(Node* currentNode, Node*& list) {
+    Node* rest = list;
+    Node** tail = &list;
+    vector<Node*> pending;
+    if (currentNode != NULL) pending.push_back(currentNode);
+    while (!pending.empty()) {
+        Node* node = pending.back();
+        pending.pop_back();
+        if (node->lNodePtr != NULL) pending.push_back(node->lNodePtr);
+        if (node->rNodePtr != NULL) pending.push_back(node->rNodePtr);
+        *tail = node;
+        tail = &node->lNodePtr;
+    }
+    *tail = rest;
+}
+
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::moveList(Node* source, Node*& destination, size_t& destinationCount) {
+    while (source != NULL) {
+        Node* next = source->lNodePtr;
+        source->lNodePtr = destination;
+        destination = source;
+        ++destinationCount;
+        source = next;
+    }
+}
+
+/*
+ * buildFromList(list, count, level)
+ * The linked-list counterpart of buildSubtree, so that rebalancing an
+ * insert allocates nothing.  A quickselect finds the median coordinate
+ * along this level's axis, splitting the list around the coordinate of
+ * its middle node each round; the nodes ruled out on either side are set
+ * aside as they go.  As in buildSubtree, only points strictly below the
+ * median go left, matching the rule that ties go to the right.
+ */
+template <size_t N, typename ElemType>
+typename KDTree<N, ElemType>::Node* KDTree<N, ElemType>::buildFromList(Node* list, size_t count, size_t level) {
+    if (count == 0) return NULL;
+    
+    size_t keyIndex = level % N;
+    size_t rank = count / 2;
+    Node* lower = NULL;
+    size_t lowerCount = 0;
+    Node* upper = NULL;
+    size_t upperCount = 0;
+    Node* median = NULL;
+    
+    while (median == NULL) {
+        Node* middle = list;
+        for (size_t i = 0; i < count / 2; ++i) middle = middle->lNodePtr;
+        double pivot = middle->key[keyIndex];
+        
+        Node* below = NULL;
+        Node* equal = NULL;
+        Node* above = NULL;
+        size_t belowCount = 0, equalCount = 0, aboveCount = 0;
+        while (list != NULL) {
+            Node* next = list->lNodePtr;
+            Node*& destination = list->key[keyIndex] < pivot ? below : list->key[keyIndex] == pivot ? equal : above;
+            size_t& destinationCount = list->key[keyIndex] < pivot ? belowCount : list->key[keyIndex] == pivot ? equalCount : aboveCount;
+            list->lNodePtr = destination;
+            destination = list;
+            ++destinationCount;
+            list = next;
+        }
+        
+        if (rank < belowCount) {
+            moveList(equal, upper, upperCount);
+            moveList(above, upper, upperCount);
+            list = below;
+            count = belowCount;
+        } else if (rank < belowCount + equalCount) {
+            median = equal;
+            moveList(below, lower, lowerCount);
+            moveList(equal->lNodePtr, upper, upperCount);
+            moveList(above, upper, upperCount);
+        } else {
+            moveList(below, lower, lowerCount);
+            moveList(equal, lower, lowerCount);
+            rank -= belowCount + equalCount;
+            list = above;
+            count = aboveCount;
+        }
+    }
+    
+    median->level = level;
+    median->lNodePtr = buildFromList(lower, lowerCount, level + 1);
+    median->rNodePtr = buildFromList(upper, upperCount, level + 1);
+    return median;
+}
+
+/*
+ * subtreeHeight(currentNode)
+ * Returns the number of nodes on the longest path down from a node, found
+ * with an explicit stack of nodes and their depths.
+ */
+template <size_t N, typename ElemType>
+size_t KDTree<N, ElemType>::subtreeHeight(Node* currentNode) const {
+    size_t height = 0;
+    vector< pair<Node*, size_t> > pending;
+    if (currentNode != NULL) pending.push_back(make_pair(currentNode, size_t(1)));
+    while (!pending.empty()) {
+        Node* node = pending.back().first;
+        size_t depth = pending.back().second;
+        pending.pop_back();
+        height = max(height, depth);
+        if (node->lNodePtr != NULL) pending.push_back(make_pair(node->lNodePtr, depth + 1));
+        if (node->rNodePtr != NULL) pending.push_back(make_pair(node->rNodePtr, depth + 1));
+    }
+    return height;
+}
+
+/*
+ * vanEmdeBoasOrder(currentNode, height, order)
+ * Lists the nodes less than height levels below currentNode.  The top
+ * half of those levels is laid out first, recursively, followed by each
+ * of the subtrees hanging off the bottom of it, also recursively.
+ */
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::vanEmdeBoasOrder(Node* currentNode, size_t height, vector<Node*>& order) const {
+    if (currentNode == NULL || height == 0) return;
+    if (height == 1) {
+        order.push_back(currentNode);
+        return;
+    }
+    
+    size_t topHeight = height / 2;
+    vanEmdeBoasOrder(currentNode, topHeight, order);
+    
+    vector<Node*> bottomRoots;
+    collectAtDepth(currentNode, topHeight, bottomRoots);
+    for (size_t i = 0; i < bottomRoots.size(); ++i)
+        vanEmdeBoasOrder(bottomRoots[i], height - topHeight, order);
+}
+
+/*
+ * collectAtDepth(currentNode, depth, nodes)
+ * Lists the nodes exactly depth levels below currentNode, left to right.
+ * The stack holds each node with the number of levels left to descend;
+ * right children are stacked first so that left ones come off first.
+ */
+template <size_t N, typename ElemType>
+void KDTree<N, ElemType>::collectAtDepth(Node* currentNode, size_t depth, vector<Node*>& nodes) const {
+    vector< pair<Node*, size_t> > pending;
+    if (currentNode != NULL) pending.push_back(make_pair(currentNode, depth));
+    while (!pending.empty()) {
+        Node* node = pending.back().first;
+        size_t levelsLeft = pending.back().second;
+        pending.pop_back();
+        if (levelsLeft == 0) {
+            nodes.push_back(node);
+            continue;
+        }
+        if (node->rNodePtr != NULL) pending.push_back(make_pair(node->rNodePtr, levelsLeft - 1));
+        if (node->lNodePtr != NULL) pending.push_back(make_pair(node->lNodePtr, levelsLeft - 1));
+    }
+}
+
+/*
+ * operator[]
+ * Returns a reference to the value associated with the Point key in the KDTree
+ * If the key does not exist it is added to the KDTree using the ElemType default value.
+ */
+template<size_t N, typename Elemtype>
+Elemtype& KDTree<N, Elemtype>::operator[](const Point<N>& pt) {
+    Node* currentNode = root;
+    Node* prevNode = NULL;
+    size_t level = 0;
+    while (currentNode != NULL) {
+        ++level;
+        //Edge Case: Duplicate Points.  An erased point comes back with the
+        //default value, which erase left in its node
+        if (pt == currentNode->key) {
+            if (currentNode->erased) {
+                currentNode->erased = false;
+                --numErased;
+                ++numElements;
+            }
+            return currentNode->value;
         }
+        
+        //Determine the level
+        size_t keyIndex = currentNode->level % N;
+        //Compare the appropriate key indicies
+        if(pt[keyIndex] < currentNode->key[keyIndex]) {
+            prevNode = currentNode;
+            currentNode = currentNode->lNodePtr;
+        } else if (pt[keyIndex] >= currentNode->key[keyIndex]) {
+            prevNode = currentNode;
+            currentNode = currentNode->rNodePtr;
+        } else {
+            //Only reachable with a NaN coordinate
+            throw runtime_error("Error inserting elements into binary tree");
+        }
+    }
+    ++numElements;
+    //Make the new node to insert into the KDTree
+    Node* newNode = new Node;
+    newNode->key = pt;
+    newNode->value = Elemtype();
+    newNode->erased = false;
+    newNode->level = level;
+    newNode->rNodePtr = NULL;
+    newNode->lNodePtr = NULL;
+    
+    if (currentNode == root) {
+        root = newNode;
     } else {
-        KNNValueRecurse(key, nearestPQ, currentNode->rNodePtr);
-        //If the hypersphere crosses the splitting plane check the other subtree
-        if ( (nearestPQ.size() != nearestPQ.maxSize()) || fabs(currentNode->key[keyIndex] - key[keyIndex]) < nearestPQ.worst() ) {
-            KNNValueRecurse(key, nearestPQ, currentNode->lNodePtr);
+        pt[prevNode->level % N] >= prevNode->key[prevNode->level % N] ? prevNode->rNodePtr = newNode : prevNode->lNodePtr = newNode;
+    }
+    //Rebuilding relinks nodes without moving them, so the reference stays valid
+    rebalanceAfterInsert(pt, level);
+    return newNode->value;
+}
+
+/*
+ * at(pt)
+ */
+
+template<size_t N, typename Elemtype>
+Elemtype& KDTree<N, Elemtype>::at(const Point<N>& pt) {
+    Node* currentNode = root;
+    while (currentNode != NULL) {
+        prefetchDescendants(currentNode, KDTREE_PREFETCH_DISTANCE);
+        if(currentNode->key == pt) {
+            if (currentNode->erased) break;
+            return currentNode->value;
+        }
+        //Find the keyIndex
+        size_t keyIndex = currentNode->level % N;
+        //Compare the appropriate key indicies
+        if(pt[keyIndex] < currentNode->key[keyIndex]) {
+            currentNode = currentNode->lNodePtr;
+        } else  {
+            currentNode = currentNode->rNodePtr;
         }
     }
+    throw out_of_range("That point does not exist");
 }
 
 /*
- * FindMostCommonValueInPQ(bpq)
- * Takes in a bounded priority queue of Node*'s in the KDTree and
- * returns the most common value stored in the nodes.
+ * at(pt)
+ * Returns a reference to the value associated with the point
+ * pt. If the point isn't in the tree it throws an exception.
+ */
+
+template<size_t N, typename Elemtype>
+const Elemtype& KDTree<N, Elemtype>::at(const Point<N>& pt) const {
+    Node* currentNode = root;
+    while (currentNode != NULL) {
+        prefetchDescendants(currentNode, KDTREE_PREFETCH_DISTANCE);
+        if(currentNode->key == pt) {
+            if (currentNode->erased) break;
+            return currentNode->value;
+        }
+        //Find the keyIndex
+        size_t keyIndex = currentNode->level % N;
+        //Compare the appropriate key indicies
+        if(pt[keyIndex] < currentNode->key[keyIndex]) {
+            currentNode = currentNode->lNodePtr;
+        } else  {
+            currentNode = currentNode->rNodePtr;
+        }
+    }
+    throw out_of_range("That point does not exist");
+}
+
+/*
+ * Prefetches are issued a cache line at a time.
+ */
+static const size_t kKDTreeCacheLineSize = 64;
+
+/*
+ * prefetchDescendants(currentNode, distance)
+ * Every node's level is one more than its parent's, so the coordinate a
+ * child splits on is known before the child is read.  The node itself is
+ * prefetched too, since that line holds its level and child pointers.
  */
 template<size_t N, typename ElemType>
-ElemType KDTree<N, ElemType>::FindMostCommonValueInPQ(BoundedPQueue<Node*> nearestPQ) const{
-    multiset<ElemType> values;
-    while(!nearestPQ.empty()) {
-        values.insert((nearestPQ.dequeueMin())->value);
+void KDTree<N, ElemType>::prefetchDescendants(const Node* currentNode, size_t distance) const {
+    if (distance == 0) return;
+    
+    size_t childKeyIndex = (currentNode->level + 1) % N;
+    const Node* children[] = { currentNode->lNodePtr, currentNode->rNodePtr };
+    for (size_t i = 0; i < 2; ++i) {
+        if (children[i] == NULL) continue;
+        KDTREE_PREFETCH(children[i]);
+        KDTREE_PREFETCH(children[i]->key.begin() + childKeyIndex);
+        if (distance > 1) prefetchDescendants(children[i], distance - 1);
+    }
+}
+
+/*
+ * prefetchPoint(currentNode)
+ * Walks the node's coordinates a cache line at a time.
+ */
+template<size_t N, typename ElemType>
+void KDTree<N, ElemType>::prefetchPoint(const Node* currentNode) const {
+    if (KDTREE_PREFETCH_DISTANCE == 0 || currentNode == NULL) return;
+    
+    const char* begin = reinterpret_cast<const char*>(currentNode);
+    const char* end = reinterpret_cast<const char*>(&currentNode->key) + sizeof(currentNode->key);
+    for (const char* line = begin; line < end; line += kKDTreeCacheLineSize)
+        KDTREE_PREFETCH(line);
+}
+
+/*
+ * kNNValue(pt, integer)
+ * Given a point and integer, KNNValue finds the k points
+ * in the KDTree nearest to v and returns the most common
+ * value associated with those points. In a tie, one of the
+ * most frequent will be chosen.
+ */
+template<size_t N, typename ElemType>
+ElemType KDTree<N, ElemType>::kNNValue(const Point<N>& key, size_t k) const {
+    KDTREE_TRACE_SPAN("KDTree::kNNValue");
+    BoundedPQueue<Node*> nearestPQ(k);
+    NoQueryStats stats;
+    KNNValueSearch(key, nearestPQ, stats);
+
+    return FindMostCommonValueInPQ(nearestPQ);
+
+}
+
+/*
+ * kNNValue(pt, integer, stats)
+ * Runs the same search with real counters and times the whole query,
+ * including picking the most common value.
+ */
+template<size_t N, typename ElemType>
+ElemType KDTree<N, ElemType>::kNNValue(const Point<N>& key, size_t k, KDTreeQueryStats& stats) const {
+    stats = KDTreeQueryStats();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    BoundedPQueue<Node*> nearestPQ(k);
+    KNNValueSearch(key, nearestPQ, stats);
+    ElemType result = FindMostCommonValueInPQ(nearestPQ);
+
+    stats.elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+/*
+ * A search's stack holds at most one frame per level below the root, plus
+ * one.  The first kKDTreeSearchStackFrames frames live in place, well past
+ * the depth of a rebalanced tree, so searches allocate nothing for their
+ * stack unless the tree is degenerate, such as a chain loaded from a
+ * snapshot.
+ */
+static const size_t kKDTreeSearchStackFrames = 128;
+
+template <typename Frame>
+class KDTreeSearchStack {
+public:
+    KDTreeSearchStack() : numInline(0) {}
+    
+    bool empty() const { return numInline == 0; }
+    
+    void push(const Frame& frame) {
+        if (numInline < kKDTreeSearchStackFrames) inlineFrames[numInline++] = frame;
+        else overflow.push_back(frame);
+    }
+    
+    Frame pop() {
+        if (!overflow.empty()) {
+            Frame frame = overflow.back();
+            overflow.pop_back();
+            return frame;
+        }
+        return inlineFrames[--numInline];
+    }
+    
+private:
+    Frame inlineFrames[kKDTreeSearchStackFrames];
+    size_t numInline;
+    vector<Frame> overflow;
+};
+
+/*
+ * kNNValueSearch(pt, bpq, stats)
+ * A helper function which builds a bounded priority queue of
+ * the points nearest to the entered point in the KDTree.  It
+ * keeps an explicit stack, so a degenerate tree can't overflow
+ * the call stack: a far child is pushed beneath its sibling with
+ * the distance to its splitting plane, and only searched if that
+ * distance still beats the k-th best once the near side is done.
+ */
+template<size_t N, typename ElemType>
+template <typename Candidate, typename QueryStats>
+void KDTree<N, ElemType>::KNNValueSearch(const Point<N>&key, BoundedPQueue<Candidate>& nearestPQ, QueryStats& stats) const{
+    struct Frame {
+        Node* node;
+        double planeDistance;
+        bool checkPlane;
+        size_t depth;
+    };
+    KDTreeSearchStack<Frame> stack;
+    if (root != NULL) {
+        Frame frame = { root, 0.0, false, 1 };
+        stack.push(frame);
     }
     
-    ElemType best;
+    while (!stack.empty()) {
+        Frame frame = stack.pop();
+        //If the hypersphere crosses the splitting plane check the other subtree
+        if (frame.checkPlane) {
+            if (nearestPQ.size() != nearestPQ.maxSize() || frame.planeDistance < nearestPQ.worst()) {
+                stats.exploreFarBranch();
+            } else {
+                stats.pruneFarBranch();
+                continue;
+            }
+        }
+        
+        Node* currentNode = frame.node;
+        stats.visitNode(frame.depth);
+        //Prefetch where we're headed while the distance is computed
+        size_t keyIndex = currentNode->level % N;
+        prefetchDescendants(currentNode, KDTREE_PREFETCH_DISTANCE);
+        prefetchPoint(key[keyIndex] < currentNode->key[keyIndex] ? currentNode->lNodePtr : currentNode->rNodePtr);
+        //Execution
+        if (!currentNode->erased) {
+            stats.computeDistance();
+            nearestPQ.enqueue(asCandidate(currentNode, Candidate()), Distance(currentNode->key, key));
+        }
+        //Descend into the near child first, leaving the far one beneath it
+        Node* nearChild = currentNode->lNodePtr;
+        Node* farChild  = currentNode->rNodePtr;
+        if (key[keyIndex] >= currentNode->key[keyIndex])
+            swap(nearChild, farChild);
+        
+        if (farChild != NULL) {
+            Frame far = { farChild, fabs(currentNode->key[keyIndex] - key[keyIndex]), true, frame.depth + 1 };
+            stack.push(far);
+        }
+        if (nearChild != NULL) {
+            Frame near = { nearChild, 0.0, false, frame.depth + 1 };
+            stack.push(near);
+        }
+    }
+}
+
+/*
+ * MostCommonValueIn(values)
+ * The k-NN vote shared by every tree: the value with the most copies in
+ * the multiset, the smallest of them in a tie, or the default value of
+ * ElemType if the multiset is empty.
+ */
+template <typename ElemType>
+ElemType MostCommonValueIn(const multiset<ElemType>& values) {
+    ElemType best = ElemType();
     size_t bestFrequency = 0;
-    for(typename multiset<ElemType>::iterator it = values.begin(); it !=values.end(); ++it) {
+    for (typename multiset<ElemType>::const_iterator it = values.begin(); it != values.end(); ++it) {
         if (values.count(*it) > bestFrequency) {
             best = *it;
             bestFrequency = values.count(*it);
@@ -505,5 +1824,606 @@ ElemType KDTree<N, ElemType>::FindMostCommonValueInPQ(BoundedPQueue<Node*> neare
     return best;
 }
 
+template <typename ElemType>
+ElemType MostCommonValue(const BoundedPQueue<const ElemType*>& nearest) {
+    multiset<ElemType> values;
+    for (typename BoundedPQueue<const ElemType*>::const_iterator it = nearest.begin(); it != nearest.end(); ++it) {
+        values.insert(*it->second);
+    }
+    return MostCommonValueIn(values);
+}
+
+/*
+ * RemoveDuplicatePoints(elems)
+ * The indices are sorted by point, with equal points in input order, so
+ * every copy of a point but the last is followed by another copy.
+ */
+template <typename PointType, typename ElemType>
+void RemoveDuplicatePoints(vector< pair<PointType, ElemType> >& elems) {
+    vector<size_t> order(elems.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    sort(order.begin(), order.end(), [&elems](size_t one, size_t two) {
+        const PointType& first = elems[one].first;
+        const PointType& second = elems[two].first;
+        for (size_t i = 0; i < first.size(); ++i) {
+            if (first[i] != second[i]) return first[i] < second[i];
+        }
+        return one < two;
+    });
+
+    vector<char> superseded(elems.size(), 0);
+    for (size_t i = 0; i + 1 < order.size(); ++i) {
+        if (elems[order[i]].first == elems[order[i + 1]].first)
+            superseded[order[i]] = 1;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < elems.size(); ++i) {
+        if (superseded[i]) continue;
+        if (kept != i) elems[kept] = move(elems[i]);
+        ++kept;
+    }
+    elems.erase(elems.begin() + kept, elems.end());
+}
+
+/*
+ * kNearest(pt, bpq)
+ * Runs the ordinary search straight into the caller's queue.
+ */
+template<size_t N, typename ElemType>
+void KDTree<N, ElemType>::kNearest(const Point<N>& key, BoundedPQueue<const ElemType*>& nearest) const {
+    NoQueryStats stats;
+    KNNValueSearch(key, nearest, stats);
+}
+
+/*
+ * elements()
+ * Walks the tree with an explicit stack, so that a degenerate tree can't
+ * overflow the call stack.
+ */
+template<size_t N, typename ElemType>
+vector< pair<Point<N>, ElemType> > KDTree<N, ElemType>::elements() const {
+    vector< pair<Point<N>, ElemType> > result;
+    result.reserve(numElements);
+    
+    vector<Node*> stack;
+    if (root != NULL) stack.push_back(root);
+    while (!stack.empty()) {
+        Node* currentNode = stack.back();
+        stack.pop_back();
+        if (!currentNode->erased)
+            result.push_back(make_pair(currentNode->key, currentNode->value));
+        if (currentNode->lNodePtr != NULL) stack.push_back(currentNode->lNodePtr);
+        if (currentNode->rNodePtr != NULL) stack.push_back(currentNode->rNodePtr);
+    }
+    return result;
+}
+
+/*
+ * The parallel kNNValue stops expanding the top of the tree at this depth
+ * even if it hasn't found enough subtrees, so that a lopsided tree isn't
+ * mostly searched serially.
+ */
+static const size_t kKDTreeParallelQueryMaxDepth = 32;
+
+/*
+ * kNNValue(pt, integer, pool)
+ * Expands the top of the tree breadth-first until there are a few
+ * subtrees per worker, scoring each ancestor along the way.  Each subtree
+ * is then searched as a task with its own bounded queue, nearest subtrees
+ * first, and the queues are merged at the end.  A subtree is skipped
+ * outright if a splitting plane already puts it beyond the shared bound.
+ */
+template<size_t N, typename ElemType>
+ElemType KDTree<N, ElemType>::kNNValue(const Point<N>& key, size_t k, WorkStealingPool& pool) const {
+    if (k == 0 || pool.numThreads() == 1) return kNNValue(key, k);
+    KDTREE_TRACE_SPAN("KDTree::kNNValue (parallel)");
+    
+    /* A subtree waiting to be searched, with a lower bound on the distance
+     from the key to any point in it. */
+    struct Subtree {
+        Node* node;
+        double bound;
+        bool operator<(const Subtree& other) const { return bound < other.bound; }
+    };
+    
+    BoundedPQueue<Node*> nearestPQ(k);
+    vector<Subtree> frontier;
+    if (root != NULL) {
+        Subtree whole = { root, 0.0 };
+        frontier.push_back(whole);
+    }
+    
+    const size_t targetSubtrees = 4 * pool.numThreads();
+    bool expanded = true;
+    for (size_t depth = 0; expanded && frontier.size() < targetSubtrees && depth < kKDTreeParallelQueryMaxDepth; ++depth) {
+        expanded = false;
+        vector<Subtree> next;
+        for (size_t i = 0; i < frontier.size(); ++i) {
+            Node* currentNode = frontier[i].node;
+            if (!currentNode->erased)
+                nearestPQ.enqueue(currentNode, Distance(currentNode->key, key));
+            
+            size_t keyIndex = currentNode->level % N;
+            double planeDistance = fabs(currentNode->key[keyIndex] - key[keyIndex]);
+            bool goesLeft = key[keyIndex] < currentNode->key[keyIndex];
+            
+            Subtree left  = { currentNode->lNodePtr, goesLeft ? frontier[i].bound : max(frontier[i].bound, planeDistance) };
+            Subtree right = { currentNode->rNodePtr, goesLeft ? max(frontier[i].bound, planeDistance) : frontier[i].bound };
+            if (left.node != NULL)  next.push_back(left);
+            if (right.node != NULL) next.push_back(right);
+            expanded = true;
+        }
+        frontier.swap(next);
+    }
+    sort(frontier.begin(), frontier.end());
+    
+    atomic<double> sharedWorst(nearestPQ.size() == k ? nearestPQ.worst() : numeric_limits<double>::infinity());
+    vector< BoundedPQueue<Node*> > results(frontier.size(), BoundedPQueue<Node*>(k));
+    
+    WorkStealingPool::TaskGroup group;
+    for (size_t i = 0; i < frontier.size(); ++i) {
+        pool.submit(group, [this, &key, &frontier, &results, &sharedWorst, i]() {
+            if (frontier[i].bound >= sharedWorst.load()) return;
+            KNNValueSearchShared(key, results[i], frontier[i].node, sharedWorst);
+        });
+    }
+    pool.wait(group);
+    
+    for (size_t i = 0; i < results.size(); ++i) {
+        while (!results[i].empty()) {
+            double distance = results[i].best();
+            nearestPQ.enqueue(results[i].dequeueMin(), distance);
+        }
+    }
+    return FindMostCommonValueInPQ(nearestPQ);
+}
+
+/*
+ * kNNValueSearchShared(pt, bpq, currentNode, sharedWorst)
+ * Like KNNValueSearch, except that a far subtree is only searched if the
+ * splitting plane is closer than both this search's own k-th best and the
+ * best k-th distance any search has reported.  Whenever this search's
+ * queue is full, its k-th distance is offered as the new shared bound.
+ */
+template<size_t N, typename ElemType>
+void KDTree<N, ElemType>::KNNValueSearchShared(const Point<N>&key, BoundedPQueue<Node*>& nearestPQ, Node* currentNode, atomic<double>& sharedWorst) const {
+    /* A subtree still to search; far subtrees carry the distance to their
+     splitting plane, checked once they come off the stack. */
+    struct Frame {
+        Node* node;
+        double planeDistance;
+        bool checkPlane;
+    };
+    vector<Frame> stack;
+    if (currentNode != NULL) {
+        Frame frame = { currentNode, 0.0, false };
+        stack.push_back(frame);
+    }
+    
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        stack.pop_back();
+        if (frame.checkPlane) {
+            double bound = sharedWorst.load();
+            if (nearestPQ.size() == nearestPQ.maxSize())
+                bound = min(bound, nearestPQ.worst());
+            if (!(frame.planeDistance < bound)) continue;
+        }
+        
+        Node* node = frame.node;
+        if (!node->erased)
+            nearestPQ.enqueue(node, Distance(node->key, key));
+        if (nearestPQ.size() == nearestPQ.maxSize()) {
+            double worst = nearestPQ.worst();
+            double current = sharedWorst.load();
+            while (worst < current && !sharedWorst.compare_exchange_weak(current, worst)) {}
+        }
+        
+        size_t keyIndex = node->level % N;
+        Node* nearChild = node->lNodePtr;
+        Node* farChild  = node->rNodePtr;
+        if (key[keyIndex] >= node->key[keyIndex])
+            swap(nearChild, farChild);
+        
+        if (farChild != NULL) {
+            Frame far = { farChild, fabs(node->key[keyIndex] - key[keyIndex]), true };
+            stack.push_back(far);
+        }
+        if (nearChild != NULL) {
+            Frame near = { nearChild, 0.0, false };
+            stack.push_back(near);
+        }
+    }
+}
+
+/*
+ * kNNValues(keys, integer, inFlight)
+ * Each search in flight keeps its own stack, as KNNValueSearch does.  A far
+ * child is pushed beneath its sibling along with the distance to its
+ * splitting plane, and is only visited if that distance still beats the
+ * k-th best distance when it comes off the stack, which is exactly the
+ * order and pruning of the ordinary search.  After each node
+ * visit the search prefetches the next node on its stack and yields to the
+ * next search in the rotation.
+ */
+template<size_t N, typename ElemType>
+vector<ElemType> KDTree<N, ElemType>::kNNValues(const vector< Point<N> >& keys, size_t k, size_t inFlight) const {
+    KDTREE_TRACE_SPAN("KDTree::kNNValues");
+    struct Frame {
+        Node* node;
+        double planeDistance;
+        bool checkPlane;
+    };
+    struct Search {
+        size_t keyIndex;
+        BoundedPQueue<Node*> nearestPQ;
+        vector<Frame> stack;
+    };
+    
+    vector<ElemType> results(keys.size());
+    vector<Search> searches;
+    size_t nextKey = 0;
+    
+    /* Starts the next pending search in the specified slot, returning false
+     if there are none left. */
+    auto startSearch = [&](Search& search) {
+        if (nextKey == keys.size()) return false;
+        search.keyIndex = nextKey++;
+        search.nearestPQ = BoundedPQueue<Node*>(k);
+        search.stack.clear();
+        if (root != NULL) {
+            Frame frame = { root, 0.0, false };
+            search.stack.push_back(frame);
+            KDTREE_PREFETCH(root);
+        }
+        return true;
+    };
+    
+    for (size_t i = 0; i < max(inFlight, size_t(1)) && nextKey < keys.size(); ++i) {
+        Search search = { 0, BoundedPQueue<Node*>(k), vector<Frame>() };
+        searches.push_back(search);
+        startSearch(searches.back());
+    }
+    
+    size_t active = searches.size();
+    while (active != 0) {
+        for (size_t i = 0; i < active; ) {
+            Search& search = searches[i];
+            const Point<N>& key = keys[search.keyIndex];
+            
+            /* Pop frames until one needs a node visited. */
+            Node* currentNode = NULL;
+            while (currentNode == NULL && !search.stack.empty()) {
+                Frame frame = search.stack.back();
+                search.stack.pop_back();
+                if (!frame.checkPlane || search.nearestPQ.size() != search.nearestPQ.maxSize() ||
+                    frame.planeDistance < search.nearestPQ.worst())
+                    currentNode = frame.node;
+            }
+            
+            if (currentNode == NULL) {
+                /* This search is done; replace it with a new one, or retire
+                 the slot by swapping in the last active search. */
+                results[search.keyIndex] = FindMostCommonValueInPQ(search.nearestPQ);
+                if (!startSearch(search)) {
+                    swap(searches[i], searches[active - 1]);
+                    --active;
+                }
+                continue;
+            }
+            
+            if (!currentNode->erased)
+                search.nearestPQ.enqueue(currentNode, Distance(currentNode->key, key));
+            
+            size_t keyIndex = currentNode->level % N;
+            Node* nearChild = currentNode->lNodePtr;
+            Node* farChild  = currentNode->rNodePtr;
+            if (key[keyIndex] >= currentNode->key[keyIndex])
+                swap(nearChild, farChild);
+            
+            if (farChild != NULL) {
+                Frame frame = { farChild, fabs(currentNode->key[keyIndex] - key[keyIndex]), true };
+                search.stack.push_back(frame);
+            }
+            if (nearChild != NULL) {
+                Frame frame = { nearChild, 0.0, false };
+                search.stack.push_back(frame);
+            }
+            if (!search.stack.empty())
+                prefetchPoint(search.stack.back().node);
+            ++i;
+        }
+    }
+    return results;
+}
+
+/*
+ * FindMostCommonValueInPQ(bpq)
+ * Takes in a bounded priority queue of Node*'s in the KDTree and
+ * returns the most common value stored in the nodes, voting the same
+ * way as MostCommonValue.  A search of a tree whose points have all been
+ * erased leaves the queue empty, which gives the default value.
+ */
+template<size_t N, typename ElemType>
+ElemType KDTree<N, ElemType>::FindMostCommonValueInPQ(const BoundedPQueue<Node*>& nearestPQ) const{
+    multiset<ElemType> values;
+    for (typename BoundedPQueue<Node*>::const_iterator it = nearestPQ.begin(); it != nearestPQ.end(); ++it) {
+        values.insert(static_cast<const ElemType&>(it->second->value));
+    }
+    return MostCommonValueIn(values);
+}
+
+/*
+ * stats()
+ * Lists the nodes in preorder with an explicit stack, so that even a
+ * degenerate chain can't overflow the call stack, remembering where each
+ * node's children ended up in the list.  Walking the list backwards then
+ * visits every child before its parent, which gives the subtree sizes
+ * needed for the imbalance of each node.
+ */
+template<size_t N, typename ElemType>
+KDTreeShapeStats KDTree<N, ElemType>::stats() const {
+    struct Entry {
+        Node* node;
+        size_t depth;
+        size_t leftIndex;
+        size_t rightIndex;
+        size_t subtreeSize;
+    };
+    const size_t kNoChild = size_t(-1);
+
+    vector<Entry> entries;
+    vector<size_t> stack;
+    if (root != NULL) {
+        Entry rootEntry = { root, 0, kNoChild, kNoChild, 0 };
+        entries.push_back(rootEntry);
+        stack.push_back(0);
+    }
+    while (!stack.empty()) {
+        size_t index = stack.back();
+        stack.pop_back();
+        Node* children[] = { entries[index].node->lNodePtr, entries[index].node->rNodePtr };
+        for (size_t i = 0; i < 2; ++i) {
+            if (children[i] == NULL) continue;
+            Entry child = { children[i], entries[index].depth + 1, kNoChild, kNoChild, 0 };
+            (i == 0 ? entries[index].leftIndex : entries[index].rightIndex) = entries.size();
+            stack.push_back(entries.size());
+            entries.push_back(child);
+        }
+    }
+
+    KDTreeShapeStats result;
+    result.nodeCount = entries.size();
+    result.numElements = numElements;
+
+    vector<size_t> parentsAtDepth;
+    size_t totalLeafDepth = 0;
+    for (size_t i = entries.size(); i-- > 0; ) {
+        Entry& entry = entries[i];
+        size_t leftSize  = entry.leftIndex  == kNoChild ? 0 : entries[entry.leftIndex].subtreeSize;
+        size_t rightSize = entry.rightIndex == kNoChild ? 0 : entries[entry.rightIndex].subtreeSize;
+        entry.subtreeSize = 1 + leftSize + rightSize;
+
+        if (entry.depth >= result.nodesAtDepth.size()) {
+            result.nodesAtDepth.resize(entry.depth + 1, 0);
+            result.imbalanceAtDepth.resize(entry.depth + 1, 0.0);
+            parentsAtDepth.resize(entry.depth + 1, 0);
+        }
+        ++result.nodesAtDepth[entry.depth];
+
+        if (leftSize + rightSize == 0) {
+            ++result.leafCount;
+            totalLeafDepth += entry.depth;
+        } else {
+            result.imbalanceAtDepth[entry.depth] += double(max(leftSize, rightSize)) / (leftSize + rightSize);
+            ++parentsAtDepth[entry.depth];
+        }
+    }
+
+    /* Turn the per-level sums into averages; a level of only leaves reports 0. */
+    for (size_t depth = 0; depth < parentsAtDepth.size(); ++depth) {
+        if (parentsAtDepth[depth] != 0)
+            result.imbalanceAtDepth[depth] /= parentsAtDepth[depth];
+    }
+    result.height = result.nodesAtDepth.size();
+    if (result.leafCount != 0)
+        result.averageLeafDepth = double(totalLeafDepth) / result.leafCount;
+
+    result.coordinateBytes   = result.nodeCount * sizeof(Point<N>);
+    result.valueBytes        = result.nodeCount * sizeof(ElemType);
+    result.nodeOverheadBytes = result.nodeCount * (sizeof(Node) - sizeof(Point<N>) -
+                                                   (KDTreeValuesOutOfLine<ElemType>::value ? 0 : sizeof(ElemType)));
+    return result;
+}
+
+/*
+ * Snapshot file format.  All integers and doubles are little-endian.
+ *
+ *   header:  magic "KDTR", uint32 version, uint32 dimension,
+ *            uint64 source fingerprint, uint64 number of nodes
+ *   nodes:   in preorder, each as a uint8 of flags, a uint64 level,
+ *            the N coordinates as doubles, and the value as encoded
+ *            by ValueSerializer<ElemType>
+ *
+ * The flags say which children follow and whether the node's point has
+ * been erased.  An empty tree is stored as a header with no nodes.
+ */
+static const char kKDTreeSnapshotMagic[4] = { 'K', 'D', 'T', 'R' };
+static const uint32_t kKDTreeSnapshotVersion = 1;
+
+static const uint8_t kKDTreeSnapshotHasLeft  = 0x1;
+static const uint8_t kKDTreeSnapshotHasRight = 0x2;
+static const uint8_t kKDTreeSnapshotErased   = 0x4;
+
+/*
+ * save(path)
+ * Encodes the header and then every node in preorder, writing the whole
+ * snapshot to disk at once.
+ */
+template<size_t N, typename ElemType>
+void KDTree<N, ElemType>::save(const string& path, uint64_t sourceFingerprint) const {
+    KDTREE_TRACE_SPAN("KDTree::save");
+    BinaryWriter out;
+    out.writeBytes(kKDTreeSnapshotMagic, sizeof(kKDTreeSnapshotMagic));
+    out.writeUInt32(kKDTreeSnapshotVersion);
+    out.writeUInt32(uint32_t(N));
+    out.writeUInt64(sourceFingerprint);
+    out.writeUInt64(numElements + numErased);
+    
+    saveNodes(out);
+    out.saveToFile(path);
+}
+
+/*
+ * saveNodes(out)
+ * Writes every node, each followed by its left and right subtrees.  An
+ * explicit stack stands in for recursion, so the depth of the tree is
+ * never limited by the call stack.
+ */
+template<size_t N, typename ElemType>
+void KDTree<N, ElemType>::saveNodes(BinaryWriter& out) const {
+    vector<Node*> pending;
+    if (root != NULL) pending.push_back(root);
+    while (!pending.empty()) {
+        Node* currentNode = pending.back();
+        pending.pop_back();
+        
+        uint8_t flags = 0;
+        if (currentNode->lNodePtr != NULL) flags |= kKDTreeSnapshotHasLeft;
+        if (currentNode->rNodePtr != NULL) flags |= kKDTreeSnapshotHasRight;
+        if (currentNode->erased) flags |= kKDTreeSnapshotErased;
+        out.writeUInt8(flags);
+        out.writeUInt64(currentNode->level);
+        for (size_t i = 0; i < N; ++i)
+            out.writeDouble(currentNode->key[i]);
+        ValueSerializer<ElemType>::write(out, currentNode->value);
+        
+        if (currentNode->rNodePtr != NULL) pending.push_back(currentNode->rNodePtr);
+        if (currentNode->lNodePtr != NULL) pending.push_back(currentNode->lNodePtr);
+    }
+}
+
+/*
+ * load(path)
+ * Validates the header and rebuilds the nodes into a new tree.  The old
+ * tree is only replaced once the whole snapshot has been read.
+ */
+template<size_t N, typename ElemType>
+void KDTree<N, ElemType>::load(const string& path, uint64_t sourceFingerprint) {
+    KDTREE_TRACE_SPAN("KDTree::load");
+    BinaryReader in(path);
+    
+    char magic[sizeof(kKDTreeSnapshotMagic)];
+    in.readBytes(magic, sizeof(magic));
+    if (memcmp(magic, kKDTreeSnapshotMagic, sizeof(magic)) != 0)
+        throw runtime_error(path + " is not a KDTree snapshot");
+    if (in.readUInt32() != kKDTreeSnapshotVersion)
+        throw runtime_error(path + " has an unsupported snapshot version");
+    if (in.readUInt32() != N)
+        throw runtime_error(path + " stores points of a different dimension");
+    if (in.readUInt64() != sourceFingerprint)
+        throw runtime_error(path + " was built from different data");
+    uint64_t expectedNodeCount = in.readUInt64();
+    
+    Node* newRoot = NULL;
+    size_t nodeCount = 0, erasedCount = 0;
+    if (!in.atEnd())
+        newRoot = loadNodes(in, path, nodeCount, erasedCount);
+    if (!in.atEnd() || nodeCount != expectedNodeCount) {
+        deleteNode(newRoot);
+        throw runtime_error(path + " is a corrupt KDTree snapshot");
+    }
+    
+    clearTree();
+    root = newRoot;
+    numElements = nodeCount - erasedCount;
+    numErased = erasedCount;
+}
+
+/*
+ * loadNodes(in, path, nodeCount, erasedCount)
+ * Reads the nodes in preorder, counting the nodes read and how many of
+ * them are erased.  The stack holds the child links still to be filled,
+ * with the depth of the node that belongs there and the box its point
+ * must fall in.  Searches rely on the level to pick the splitting axis
+ * and on every point below a node lying on the side of it that the point
+ * would be inserted on, so a node whose level isn't its depth, or whose
+ * point is outside its box, marks the snapshot as corrupt.  Each lower
+ * bound is inclusive and each upper bound exclusive; an upper bound of
+ * NaN stands for none, since no coordinate compares >= NaN, and a NaN
+ * coordinate fails every check, just as insert refuses one.  Each node is
+ * attached as soon as it is allocated, so if anything goes wrong the
+ * partially-read tree can be freed before the exception propagates.
+ */
+template<size_t N, typename ElemType>
+typename KDTree<N, ElemType>::Node* KDTree<N, ElemType>::loadNodes(BinaryReader& in, const string& path,
+                                                                   size_t& nodeCount, size_t& erasedCount) {
+    struct PendingLink {
+        Node** link;
+        size_t depth;
+        Point<N> lower;
+        Point<N> upper;
+    };
+    
+    Node* newRoot = NULL;
+    try {
+        vector<PendingLink> pending;
+        PendingLink rootLink;
+        rootLink.link = &newRoot;
+        rootLink.depth = 0;
+        for (size_t i = 0; i < N; ++i) {
+            rootLink.lower[i] = -numeric_limits<double>::infinity();
+            rootLink.upper[i] = numeric_limits<double>::quiet_NaN();
+        }
+        pending.push_back(rootLink);
+        while (!pending.empty()) {
+            PendingLink current = pending.back();
+            Node** link = current.link;
+            size_t depth = current.depth;
+            pending.pop_back();
+            
+            Node* newNode = new Node;
+            newNode->lNodePtr = newNode->rNodePtr = NULL;
+            newNode->erased = false;
+            *link = newNode;
+            
+            uint8_t flags = in.readUInt8();
+            newNode->erased = (flags & kKDTreeSnapshotErased) != 0;
+            newNode->level = size_t(in.readUInt64());
+            if (newNode->level != depth)
+                throw runtime_error(path + " is a corrupt KDTree snapshot");
+            for (size_t i = 0; i < N; ++i) {
+                newNode->key[i] = in.readDouble();
+                if (!(newNode->key[i] >= current.lower[i]) || newNode->key[i] >= current.upper[i])
+                    throw runtime_error(path + " is a corrupt KDTree snapshot");
+            }
+            ValueSerializer<ElemType>::read(in, newNode->value);
+            ++nodeCount;
+            if (newNode->erased) ++erasedCount;
+            
+            size_t keyIndex = depth % N;
+            if (flags & kKDTreeSnapshotHasRight) {
+                PendingLink right = current;
+                right.link = &newNode->rNodePtr;
+                right.depth = depth + 1;
+                right.lower[keyIndex] = newNode->key[keyIndex];
+                pending.push_back(right);
+            }
+            if (flags & kKDTreeSnapshotHasLeft) {
+                PendingLink left = current;
+                left.link = &newNode->lNodePtr;
+                left.depth = depth + 1;
+                left.upper[keyIndex] = newNode->key[keyIndex];
+                pending.push_back(left);
+            }
+        }
+    } catch (...) {
+        deleteNode(newRoot);
+        throw;
+    }
+    return newRoot;
+}
 
 #endif // KDTREE_INCLUDED
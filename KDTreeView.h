@@ -0,0 +1,401 @@
+/********************************************************************
+ * File: KDTreeView.h
+ *
+ * A read-only kd-tree that answers queries directly out of a
+ * memory-mapped index file.  The index is written from an
+ * ordinary KDTree using ExportKDTreeView:
+ *
+ * KDTree<3, int> kd;
+ * ...
+ * ExportKDTreeView(kd, "colors.kdv");
+ *
+ * and can then be opened, in this or any other process, with
+ *
+ * KDTreeView<3, int> view("colors.kdv");
+ * int value = view.kNNValue(pt, 3);
+ *
+ * Opening a view does not copy, parse or even read the node
+ * records; it only checks the header.  The operating system
+ * pages nodes in as they are touched, and every process
+ * viewing the same file shares one copy of those pages.
+ * Nodes refer to one another by index rather than by
+ * address, so the file is valid wherever it is mapped.
+ *
+ * Because values are read in place, ElemType must be trivially
+ * copyable.  The index is stored in the byte order of the
+ * machine that wrote it, and opening an index written with a
+ * different byte order, dimension or value type throws a
+ * runtime_error.
+ */
+
+#ifndef KDTREE_VIEW_INCLUDED
+#define KDTREE_VIEW_INCLUDED
+
+#include "KDTree.h"
+#include "MappedFile.h"
+#include <type_traits>
+#include <fstream>
+
+template <size_t N, typename ElemType>
+class KDTreeView {
+public:
+    /**
+     * Constructor: KDTreeView(const string& path);
+     * Usage: KDTreeView<3, int> view("colors.kdv");
+     * ----------------------------------------------------
+     * Maps the index file written by ExportKDTreeView.
+     * Throws runtime_error if the file is missing, corrupt,
+     * or was not written for a KDTree<N, ElemType>.
+     */
+    explicit KDTreeView(const string& path);
+
+    /**
+     * size_t dimension() const;
+     * size_t size() const;
+     * bool empty() const;
+     * Usage: if (view.empty()) { ... }
+     * ----------------------------------------------------
+     * Same as the corresponding KDTree functions.
+     */
+    size_t dimension() const;
+    size_t size() const;
+    bool empty() const;
+
+    /**
+     * bool contains(const Point<N>& pt) const;
+     * const ElemType& at(const Point<N>& pt) const;
+     * ElemType kNNValue(const Point<N>& key, size_t k) const;
+     * Usage: cout << view.kNNValue(v, 3) << endl;
+     * ----------------------------------------------------
+     * Same as the corresponding KDTree functions, including
+     * at throwing out_of_range for missing points.  The
+     * reference returned by at points into the mapping.
+     * All three throw runtime_error if the search follows a
+     * child link that doesn't lead to a node further along
+     * the file.
+     */
+    bool contains(const Point<N>& pt) const;
+    const ElemType& at(const Point<N>& pt) const;
+    ElemType kNNValue(const Point<N>& key, size_t k) const;
+
+private:
+  /******************************************
+   *        Implementation details.         *
+   ******************************************/
+    static_assert(is_trivially_copyable<ElemType>::value,
+                  "KDTreeView can only store trivially copyable values");
+
+    /* The on-disk node record.  Children are node indices, with
+     * kNoChild marking a missing child.
+     */
+    struct Node {
+        double key[N];
+        uint64_t lNodeIndex;
+        uint64_t rNodeIndex;
+        uint64_t level;
+        ElemType value;
+    };
+
+    /* The header at the start of every index file. */
+    struct Header {
+        char magic[4];
+        uint32_t byteOrderMark;
+        uint32_t version;
+        uint32_t dimension;
+        uint64_t nodeSize;
+        uint64_t valueSize;
+        uint64_t nodeCount;
+        uint64_t nodesOffset;
+    };
+
+    static const uint64_t kNoChild = ~uint64_t(0);
+
+    MappedFile file;
+    const Node* nodes;
+    size_t numElements;
+
+    /* Returns the child of parent with the specified index, or NULL for
+     * kNoChild, throwing runtime_error if the link is corrupt */
+    const Node* childOf(const Node* parent, uint64_t index) const;
+
+    /* Descends to the node holding pt, returning NULL if there is none */
+    const Node* find(const Point<N>& pt) const;
+
+    /* Helper function for kNNValue */
+    void KNNValueSearch(const Point<N>& key, BoundedPQueue<const ElemType*>& nearestPQ) const;
+
+    template <size_t M, typename T>
+    friend void ExportKDTreeView(const KDTree<M, T>& kd, const string& path);
+};
+
+/**
+ * void ExportKDTreeView(const KDTree<N, ElemType>& kd, const string& path);
+ * Usage: ExportKDTreeView(kd, "colors.kdv");
+ * ----------------------------------------------------
+ * Writes kd to an index file that can be opened with a
+ * KDTreeView<N, ElemType>.  Throws runtime_error if the
+ * file cannot be written.
+ */
+template <size_t N, typename ElemType>
+void ExportKDTreeView(const KDTree<N, ElemType>& kd, const string& path);
+
+
+/////////////////////////////////////////////
+// KDTreeView class implementation details //
+/////////////////////////////////////////////
+
+static const char kKDTreeViewMagic[4] = { 'K', 'D', 'T', 'V' };
+static const uint32_t kKDTreeViewByteOrderMark = 0x01020304;
+static const uint32_t kKDTreeViewVersion = 1;
+
+/*
+ * Constructor maps the file and checks that its header describes exactly
+ * the node type this view was instantiated with.  None of the node
+ * records are read, so opening an index touches only its first page;
+ * child links are checked as searches follow them.
+ */
+template <size_t N, typename ElemType>
+KDTreeView<N, ElemType>::KDTreeView(const string& path) : file(path) {
+    if (file.size() < sizeof(Header))
+        throw runtime_error(path + " is not a KDTree index");
+
+    Header header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, kKDTreeViewMagic, sizeof(header.magic)) != 0)
+        throw runtime_error(path + " is not a KDTree index");
+    if (header.byteOrderMark != kKDTreeViewByteOrderMark)
+        throw runtime_error(path + " was written with a different byte order");
+    if (header.version != kKDTreeViewVersion)
+        throw runtime_error(path + " has an unsupported index version");
+    if (header.dimension != N || header.nodeSize != sizeof(Node) || header.valueSize != sizeof(ElemType))
+        throw runtime_error(path + " was written for a different kind of KDTree");
+    if (header.nodesOffset % alignof(Node) != 0 || header.nodesOffset > file.size() ||
+        (file.size() - header.nodesOffset) / sizeof(Node) < header.nodeCount)
+        throw runtime_error(path + " is a corrupt KDTree index");
+
+    nodes = reinterpret_cast<const Node*>(file.data() + header.nodesOffset);
+    numElements = size_t(header.nodeCount);
+}
+
+template <size_t N, typename ElemType>
+size_t KDTreeView<N, ElemType>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename ElemType>
+size_t KDTreeView<N, ElemType>::size() const {
+    return numElements;
+}
+
+template <size_t N, typename ElemType>
+bool KDTreeView<N, ElemType>::empty() const {
+    return size() == 0;
+}
+
+/*
+ * childOf(parent, index)
+ * Translates a child index into an address within the mapping.  A child
+ * must come after its parent and within the node array, so a corrupt
+ * link can neither leave the mapping nor lead back up the tree into a
+ * loop.  Exported files always qualify, since they list every subtree
+ * after its root.
+ */
+template <size_t N, typename ElemType>
+const typename KDTreeView<N, ElemType>::Node* KDTreeView<N, ElemType>::childOf(const Node* parent, uint64_t index) const {
+    if (index == kNoChild) return NULL;
+    if (index <= uint64_t(parent - nodes) || index >= numElements)
+        throw runtime_error("KDTree index has a corrupt child link");
+    return nodes + index;
+}
+
+/*
+ * find(pt)
+ * Walks down from the root the same way KDTree::contains does.
+ */
+template <size_t N, typename ElemType>
+const typename KDTreeView<N, ElemType>::Node* KDTreeView<N, ElemType>::find(const Point<N>& pt) const {
+    const Node* currentNode = empty() ? NULL : nodes;
+    while (currentNode != NULL) {
+        if (equal(pt.begin(), pt.end(), currentNode->key)) return currentNode;
+
+        size_t keyIndex = currentNode->level % N;
+        if (pt[keyIndex] < currentNode->key[keyIndex]) {
+            currentNode = childOf(currentNode, currentNode->lNodeIndex);
+        } else {
+            currentNode = childOf(currentNode, currentNode->rNodeIndex);
+        }
+    }
+    return NULL;
+}
+
+template <size_t N, typename ElemType>
+bool KDTreeView<N, ElemType>::contains(const Point<N>& pt) const {
+    return find(pt) != NULL;
+}
+
+template <size_t N, typename ElemType>
+const ElemType& KDTreeView<N, ElemType>::at(const Point<N>& pt) const {
+    const Node* node = find(pt);
+    if (node == NULL) throw out_of_range("That point does not exist");
+    return node->value;
+}
+
+/*
+ * kNNValue(key, k)
+ * Identical to KDTree::kNNValue, except that the search runs over the
+ * mapped node records.
+ */
+template <size_t N, typename ElemType>
+ElemType KDTreeView<N, ElemType>::kNNValue(const Point<N>& key, size_t k) const {
+    BoundedPQueue<const ElemType*> nearestPQ(k);
+    KNNValueSearch(key, nearestPQ);
+    return MostCommonValue(nearestPQ);
+}
+
+/*
+ * KNNValueSearch(key, nearestPQ)
+ * Keeps an explicit stack, as KDTree::KNNValueSearch does, so that an
+ * exported chain can't overflow the call stack.  A far child waits
+ * beneath its sibling with the distance to its splitting plane.
+ */
+template <size_t N, typename ElemType>
+void KDTreeView<N, ElemType>::KNNValueSearch(const Point<N>& key, BoundedPQueue<const ElemType*>& nearestPQ) const {
+    struct Frame {
+        const Node* node;
+        double planeDistance;
+        bool checkPlane;
+    };
+    KDTreeSearchStack<Frame> stack;
+    if (!empty()) {
+        Frame frame = { nodes, 0.0, false };
+        stack.push(frame);
+    }
+
+    while (!stack.empty()) {
+        Frame frame = stack.pop();
+        //If the hypersphere crosses the splitting plane check the other subtree
+        if (frame.checkPlane && nearestPQ.size() == nearestPQ.maxSize() && !(frame.planeDistance < nearestPQ.worst()))
+            continue;
+
+        const Node* currentNode = frame.node;
+        double distance = 0.0;
+        for (size_t i = 0; i < N; ++i)
+            distance += (currentNode->key[i] - key[i]) * (currentNode->key[i] - key[i]);
+        nearestPQ.enqueue(&currentNode->value, sqrt(distance));
+
+        size_t keyIndex = currentNode->level % N;
+        const Node* nearChild = childOf(currentNode, currentNode->lNodeIndex);
+        const Node* farChild  = childOf(currentNode, currentNode->rNodeIndex);
+        if (key[keyIndex] >= currentNode->key[keyIndex])
+            swap(nearChild, farChild);
+
+        if (farChild != NULL) {
+            Frame far = { farChild, fabs(currentNode->key[keyIndex] - key[keyIndex]), true };
+            stack.push(far);
+        }
+        if (nearChild != NULL) {
+            Frame near = { nearChild, 0.0, false };
+            stack.push(near);
+        }
+    }
+}
+
+/*
+ * ExportKDTreeView(kd, path)
+ * Writes the node records in preorder, so that every left child
+ * immediately follows its parent, straight to the file.  A right child's
+ * index isn't known until its parent's whole left subtree has been
+ * numbered, so a first walk over the tree records just those indices,
+ * and the second writes each record with its links already filled in.
+ * The view has no notion of erased points, so a tree with any is
+ * exported from a compacted copy.
+ */
+template <size_t N, typename ElemType>
+void ExportKDTreeView(const KDTree<N, ElemType>& kd, const string& path) {
+    if (kd.numErased != 0) {
+        KDTree<N, ElemType> compacted(kd);
+        compacted.compact();
+        ExportKDTreeView(compacted, path);
+        return;
+    }
+
+    typedef typename KDTreeView<N, ElemType>::Node ViewNode;
+    typedef typename KDTreeView<N, ElemType>::Header ViewHeader;
+    typedef typename KDTree<N, ElemType>::Node TreeNode;
+    const uint64_t kNoChild = KDTreeView<N, ElemType>::kNoChild;
+
+    /* Nodes waiting to be numbered, along with the index of the parent
+     * whose right link should point at them, if any.
+     */
+    struct PendingNode {
+        const TreeNode* node;
+        uint64_t rightOf;
+    };
+
+    /* First walk: the index of every node's right child, by preorder index. */
+    vector<uint64_t> rightChildren(kd.size(), kNoChild);
+    vector<PendingNode> stack;
+    uint64_t nodeCount = 0;
+    if (kd.root != NULL) {
+        PendingNode rootEntry = { kd.root, kNoChild };
+        stack.push_back(rootEntry);
+    }
+    while (!stack.empty()) {
+        PendingNode entry = stack.back();
+        stack.pop_back();
+
+        uint64_t index = nodeCount++;
+        if (entry.rightOf != kNoChild)
+            rightChildren[entry.rightOf] = index;
+
+        /* Push the right child first so that the left is numbered next. */
+        if (entry.node->rNodePtr != NULL) {
+            PendingNode right = { entry.node->rNodePtr, index };
+            stack.push_back(right);
+        }
+        if (entry.node->lNodePtr != NULL) {
+            PendingNode left = { entry.node->lNodePtr, kNoChild };
+            stack.push_back(left);
+        }
+    }
+
+    ViewHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kKDTreeViewMagic, sizeof(header.magic));
+    header.byteOrderMark = kKDTreeViewByteOrderMark;
+    header.version = kKDTreeViewVersion;
+    header.dimension = uint32_t(N);
+    header.nodeSize = sizeof(ViewNode);
+    header.valueSize = sizeof(ElemType);
+    header.nodeCount = nodeCount;
+    header.nodesOffset = sizeof(ViewHeader);
+
+    ofstream output(path.c_str(), ios::binary | ios::trunc);
+    if (!output)
+        throw runtime_error("Couldn't open " + path + " for writing");
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    /* Second walk: the same preorder, writing each record as it comes. */
+    vector<const TreeNode*> pending;
+    if (kd.root != NULL) pending.push_back(kd.root);
+    for (uint64_t index = 0; !pending.empty() && output; ++index) {
+        const TreeNode* node = pending.back();
+        pending.pop_back();
+
+        ViewNode record;
+        memset(&record, 0, sizeof(record)); // Keep padding bytes deterministic
+        copy(node->key.begin(), node->key.end(), record.key);
+        record.lNodeIndex = node->lNodePtr != NULL ? index + 1 : kNoChild;
+        record.rNodeIndex = rightChildren[index];
+        record.level = node->level;
+        record.value = node->value;
+        output.write(reinterpret_cast<const char*>(&record), sizeof(record));
+
+        if (node->rNodePtr != NULL) pending.push_back(node->rNodePtr);
+        if (node->lNodePtr != NULL) pending.push_back(node->lNodePtr);
+    }
+    if (!output)
+        throw runtime_error("Couldn't write to " + path);
+}
+
+#endif // KDTREE_VIEW_INCLUDED
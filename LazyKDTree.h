@@ -0,0 +1,684 @@
+/**************************************************************
+ * File: LazyKDTree.h
+ *
+ * A static kd-tree that builds itself on demand.  Building
+ * one only partitions the points for the top few levels of
+ * the tree; every subtree below is left as an unsorted block
+ * of points, which is split the first time a query descends
+ * into it:
+ *
+ * LazyKDTree<3, string> kd;
+ * kd.build(elems);                 // Splits the top levels only.
+ * cout << kd.kNNValue(v, 3) << endl;  // Splits what it visits.
+ *
+ * The first queries can then be answered almost as soon as
+ * the points are loaded, and the rest of the build is only
+ * ever paid for in the regions of space that are queried.
+ *
+ * The tree is implicit: the points live in one array, and the
+ * subtree covering a range of the array keeps its splitting
+ * point at the middle of the range, with the two halves on
+ * either side.  The coordinates are stored one dimension at a
+ * time rather than one point at a time, so splitting a block
+ * and scanning a leaf both read each dimension as a single
+ * contiguous run, and the distance loops vectorize across the
+ * points of a leaf.
+ * Queries may run on several threads at once; the splits they
+ * trigger take a lock, but searching parts of the tree that
+ * are already split never does.
+ *
+ * Like KDTree, a LazyKDTree answers for each point once: when
+ * a point appears more than once in the elements it is built
+ * from, the last value given for it wins.  The repeats are
+ * found lazily too, as the blocks holding them are split.
+ */
+
+#ifndef LAZY_KDTREE_INCLUDED
+#define LAZY_KDTREE_INCLUDED
+
+#include "Point.h"
+#include "BoundedPQueue.h"
+#include "BinarySerialization.h"
+#include "KDTree.h"
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+using namespace std;
+
+/* Blocks of at most this many points are scanned rather than split. */
+static const size_t kLazyKDTreeLeafSize = 8;
+
+/* The number of levels build splits by default. */
+static const size_t kLazyKDTreeEagerLevels = 6;
+
+template <size_t N, typename ElemType>
+class LazyKDTree {
+public:
+    /**
+     * Constructor: LazyKDTree();
+     * Usage: LazyKDTree<3, int> myTree;
+     * ----------------------------------------------------
+     * Constructs an empty LazyKDTree.
+     */
+    LazyKDTree();
+
+    /**
+     * void build(vector< pair<Point<N>, ElemType> > elems,
+     *            size_t eagerLevels = kLazyKDTreeEagerLevels);
+     * Usage: kd.build(move(elems));
+     * ----------------------------------------------------
+     * Replaces the contents of the tree with the specified
+     * points and values, splitting only the top eagerLevels
+     * levels of the tree right away.  If a point appears
+     * more than once, the last value given for it wins, as
+     * with insert on a KDTree; the earlier copies are set
+     * aside as the blocks holding them are split.  Moving
+     * the elements in lets them be freed as soon as their
+     * coordinates have been copied into the tree.
+     */
+    void build(vector< pair<Point<N>, ElemType> > elems,
+               size_t eagerLevels = kLazyKDTreeEagerLevels);
+
+    /**
+     * void splitAll();
+     * Usage: kd.splitAll();
+     * ----------------------------------------------------
+     * Splits every block that hasn't been split yet,
+     * finishing the build.  Queries never need this; it is
+     * for paying the whole cost up front, say on a
+     * background thread once the first queries are done.
+     */
+    void splitAll();
+
+    /**
+     * size_t dimension() const;
+     * size_t size() const;
+     * bool empty() const;
+     * Usage: if (kd.empty())
+     * ----------------------------------------------------
+     * Returns the dimension of the points, the number of
+     * elements in the tree and whether it is empty.  Until
+     * every block holding a repeated point has been split,
+     * size counts the copies not yet set aside; after
+     * splitAll it counts each point once.
+     */
+    size_t dimension() const;
+    size_t size() const;
+    bool empty() const;
+
+    /**
+     * size_t splitCount() const;
+     * Usage: cout << kd.splitCount() << " blocks split" << endl;
+     * ----------------------------------------------------
+     * Returns how many blocks have been split so far, by
+     * build or by queries.
+     */
+    size_t splitCount() const;
+
+    /**
+     * bool contains(const Point<N>& pt) const;
+     * const ElemType& at(const Point<N>& pt) const;
+     * Usage: if (kd.contains(v)) cout << kd.at(v) << endl;
+     * ----------------------------------------------------
+     * Returns whether the point is in the tree, or the value
+     * associated with it.  at throws out_of_range if the
+     * point is not in the tree.
+     */
+    bool contains(const Point<N>& pt) const;
+    const ElemType& at(const Point<N>& pt) const;
+
+    /**
+     * ElemType kNNValue(const Point<N>& key, size_t k) const
+     * Usage: cout << kd.kNNValue(v, 3) << endl;
+     * ----------------------------------------------------
+     * Given a point v and an integer k, finds the k points
+     * in the tree nearest to v and returns the most common
+     * value associated with those points.  In the event of
+     * a tie, one of the most frequent value will be chosen.
+     */
+    ElemType kNNValue(const Point<N>& key, size_t k) const;
+
+    /**
+     * void save(const string& path, uint64_t sourceFingerprint = 0) const;
+     * void load(const string& path, uint64_t sourceFingerprint = 0);
+     * Usage: kd.save("places.kdl", FileFingerprint("places.txt"));
+     *        kd.load("places.kdl", FileFingerprint("places.txt"));
+     * ----------------------------------------------------
+     * Writes the tree to a file, or replaces the contents
+     * of this tree with the contents of a file.  The blocks
+     * split so far stay split.  The fingerprint of the data
+     * the tree was built from is stored in the file, and
+     * load rejects a file stored with a different one, so a
+     * snapshot is never used once its data has changed.
+     * Both throw runtime_error on failure; if load fails,
+     * this tree is left unchanged.
+     */
+    void save(const string& path, uint64_t sourceFingerprint = 0) const;
+    void load(const string& path, uint64_t sourceFingerprint = 0);
+
+private:
+    /* The elements in tree order, stored as structure of arrays: the
+     coordinates of dimension j are coords[j * size() + i] for i in
+     [0, size()), and values[i] is the value of element i.  Splitting a
+     block rearranges the elements inside it, so both are mutable. */
+    mutable vector<double> coords;
+    mutable vector<ElemType> values;
+
+    /* superseded[i] is set once element i is known to repeat a point given
+     again later in the elements, and searches skip it.  It moves with the
+     element.  numSuperseded counts the elements set aside so far. */
+    mutable vector<char> superseded;
+    mutable atomic<size_t> numSuperseded;
+
+    /* splitFlags[mid] is set once the block whose middle index is mid has
+     been split; no two blocks share a middle index. */
+    mutable vector< atomic<bool> > splitFlags;
+    mutable atomic<size_t> numSplits;
+    mutable mutex splitLock;
+
+    const double* column(size_t dim) const;
+    bool pointEquals(size_t index, const Point<N>& pt) const;
+    int compareElements(size_t one, size_t two, size_t keyIndex) const;
+    double distanceTo(size_t index, const Point<N>& key) const;
+    void leafDistances(const Point<N>& key, size_t begin, size_t end, double* distances) const;
+    void assign(vector<double>& newCoords, vector<ElemType>& newValues);
+    void resetFlags(size_t count);
+    void permuteBlock(size_t begin, vector<size_t>& permutation) const;
+    void ensureSplit(size_t begin, size_t end, size_t depth) const;
+    void supersedeRepeats(size_t begin, size_t end) const;
+    bool findIndex(const Point<N>& pt, size_t begin, size_t end, size_t depth, size_t& index) const;
+    void searchRange(const Point<N>& key, BoundedPQueue<const ElemType*>& nearest,
+                     size_t begin, size_t end, size_t depth) const;
+    void splitRange(size_t begin, size_t end, size_t depth, size_t levels) const;
+
+    LazyKDTree(const LazyKDTree&);
+    LazyKDTree& operator=(const LazyKDTree&);
+};
+
+
+/////////////////////////////////////////////
+// LazyKDTree class implementation details //
+/////////////////////////////////////////////
+
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+#include <stdexcept>
+
+template <size_t N, typename ElemType>
+LazyKDTree<N, ElemType>::LazyKDTree() : numSuperseded(0), numSplits(0) {}
+
+template <size_t N, typename ElemType>
+const double* LazyKDTree<N, ElemType>::column(size_t dim) const {
+    return coords.data() + dim * values.size();
+}
+
+template <size_t N, typename ElemType>
+bool LazyKDTree<N, ElemType>::pointEquals(size_t index, const Point<N>& pt) const {
+    for (size_t j = 0; j < N; ++j) {
+        if (column(j)[index] != pt[j]) return false;
+    }
+    return true;
+}
+
+/*
+ * compareElements(one, two, keyIndex)
+ * Orders elements by their coordinate along keyIndex, breaking ties by
+ * the rest of the point, and returns a negative, zero or positive result.
+ * Only copies of the same point compare equal.
+ */
+template <size_t N, typename ElemType>
+int LazyKDTree<N, ElemType>::compareElements(size_t one, size_t two, size_t keyIndex) const {
+    const double* keys = column(keyIndex);
+    if (keys[one] != keys[two]) return keys[one] < keys[two] ? -1 : 1;
+    for (size_t j = 0; j < N; ++j) {
+        const double* coordinates = column(j);
+        if (coordinates[one] != coordinates[two]) return coordinates[one] < coordinates[two] ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * The squared distances below are summed in the same order as Distance, so
+ * the results match it exactly.
+ */
+template <size_t N, typename ElemType>
+double LazyKDTree<N, ElemType>::distanceTo(size_t index, const Point<N>& key) const {
+    double result = 0.0;
+    for (size_t j = 0; j < N; ++j) {
+        double diff = column(j)[index] - key[j];
+        result += diff * diff;
+    }
+    return sqrt(result);
+}
+
+/*
+ * leafDistances(key, begin, end, distances)
+ * Computes the squared distances from key to the elements in [begin, end),
+ * a leaf of at most kLazyKDTreeLeafSize elements.  Each column of the leaf
+ * is copied into a zero-padded buffer of kLazyKDTreeLeafSize lanes, so the
+ * inner loop has a fixed length the compiler can vectorize without a
+ * remainder loop, yet never reads outside the leaf.  The caller ignores
+ * the lanes past end - begin.
+ */
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::leafDistances(const Point<N>& key, size_t begin, size_t end,
+                                            double* __restrict distances) const {
+    const size_t count = end - begin;
+    double coordinates[kLazyKDTreeLeafSize] = {};
+    for (size_t i = 0; i < kLazyKDTreeLeafSize; ++i)
+        distances[i] = 0.0;
+    for (size_t j = 0; j < N; ++j) {
+        copy(column(j) + begin, column(j) + begin + count, coordinates);
+        double coordinate = key[j];
+        for (size_t i = 0; i < kLazyKDTreeLeafSize; ++i) {
+            double diff = coordinates[i] - coordinate;
+            distances[i] += diff * diff;
+        }
+    }
+}
+
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::assign(vector<double>& newCoords, vector<ElemType>& newValues) {
+    coords.swap(newCoords);
+    values.swap(newValues);
+    resetFlags(values.size());
+}
+
+/*
+ * A vector of atomics can't be resized, so a fresh one is swapped in.
+ */
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::resetFlags(size_t count) {
+    vector< atomic<bool> > flags(count);
+    for (size_t i = 0; i < count; ++i)
+        flags[i].store(false, memory_order_relaxed);
+    splitFlags.swap(flags);
+    numSplits = 0;
+    vector<char>(count, 0).swap(superseded);
+    numSuperseded = 0;
+}
+
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::build(vector< pair<Point<N>, ElemType> > newElems, size_t eagerLevels) {
+    KDTREE_TRACE_SPAN("LazyKDTree::build");
+    size_t count = newElems.size();
+    {
+        KDTREE_TRACE_SPAN("Copy elements into columns");
+        vector<double> newCoords(count * N);
+        vector<ElemType> newValues;
+        newValues.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t j = 0; j < N; ++j)
+                newCoords[j * count + i] = newElems[i].first[j];
+            newValues.push_back(move(newElems[i].second));
+        }
+        newElems.clear();
+        newElems.shrink_to_fit();
+        assign(newCoords, newValues);
+    }
+
+    KDTREE_TRACE_SPAN("Split top levels");
+    if (count <= kLazyKDTreeLeafSize) supersedeRepeats(0, count);
+    splitRange(0, count, 0, eagerLevels);
+}
+
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::splitAll() {
+    splitRange(0, values.size(), 0, size_t(-1));
+}
+
+/*
+ * splitRange(begin, end, depth, levels)
+ * Splits the block and its descendants down to the specified number of
+ * levels below it.
+ */
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::splitRange(size_t begin, size_t end, size_t depth, size_t levels) const {
+    if (levels == 0 || end - begin <= kLazyKDTreeLeafSize) return;
+    ensureSplit(begin, end, depth);
+    size_t mid = begin + (end - begin) / 2;
+    splitRange(begin, mid, depth + 1, levels - 1);
+    splitRange(mid + 1, end, depth + 1, levels - 1);
+}
+
+/*
+ * ensureSplit(begin, end, depth)
+ * Once a block's flag is set its middle element never moves again, and
+ * splitting a block only rearranges the elements inside it, so readers
+ * that see the flag set can use the middle element without the lock.
+ *
+ * nth_element only finds the middle point; the block is then partitioned
+ * around it stably, so the elements on either side keep the order they
+ * were given in.  Copies of one point therefore stay in input order and,
+ * unless they are copies of the middle point, all go to the same side.
+ * Copies of the middle point are folded here the way KDTree's build folds
+ * them: the last one given is moved to the middle and the rest are set
+ * aside.  Copies that never meet a middle point end up in the same leaf,
+ * and are set aside when the split creating the leaf is made.
+ */
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::ensureSplit(size_t begin, size_t end, size_t depth) const {
+    size_t mid = begin + (end - begin) / 2;
+    if (splitFlags[mid].load(memory_order_acquire)) return;
+
+    lock_guard<mutex> guard(splitLock);
+    if (splitFlags[mid].load(memory_order_relaxed)) return;
+
+    size_t keyIndex = depth % N;
+    const double* keys = column(keyIndex);
+    vector<size_t> permutation(end - begin);
+    iota(permutation.begin(), permutation.end(), begin);
+    nth_element(permutation.begin(), permutation.begin() + (mid - begin), permutation.end(),
+                [this, keys, keyIndex](size_t one, size_t two) {
+        if (keys[one] != keys[two]) return keys[one] < keys[two];
+        return compareElements(one, two, keyIndex) < 0;
+    });
+    size_t median = permutation[mid - begin];
+
+    vector<signed char> sides(end - begin);
+    size_t numBelow = 0, numEqual = 0;
+    for (size_t i = begin; i < end; ++i) {
+        int side = compareElements(i, median, keyIndex);
+        sides[i - begin] = side < 0 ? -1 : side > 0 ? 1 : 0;
+        if (side < 0) ++numBelow;
+        else if (side == 0) ++numEqual;
+    }
+    size_t below = 0, equal = numBelow, above = numBelow + numEqual;
+    for (size_t i = 0; i < end - begin; ++i) {
+        size_t& next = sides[i] < 0 ? below : sides[i] == 0 ? equal : above;
+        permutation[next++] = i;
+    }
+    swap(permutation[mid - begin], permutation[numBelow + numEqual - 1]);
+    permuteBlock(begin, permutation);
+
+    if (!superseded[mid]) {
+        for (size_t i = begin + numBelow; i < begin + numBelow + numEqual; ++i) {
+            if (i != mid && !superseded[i]) {
+                superseded[i] = 1;
+                ++numSuperseded;
+            }
+        }
+    }
+    if (mid - begin <= kLazyKDTreeLeafSize) supersedeRepeats(begin, mid);
+    if (end - mid - 1 <= kLazyKDTreeLeafSize) supersedeRepeats(mid + 1, end);
+    ++numSplits;
+    splitFlags[mid].store(true, memory_order_release);
+}
+
+/*
+ * supersedeRepeats(begin, end)
+ * Sets aside every element of a leaf that is followed by a copy of its
+ * point.  The elements of a block are in the order they were given, so
+ * the copy that survives is the last one given.
+ */
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::supersedeRepeats(size_t begin, size_t end) const {
+    for (size_t i = begin; i < end; ++i) {
+        if (superseded[i]) continue;
+        for (size_t later = i + 1; later < end; ++later) {
+            if (!superseded[later] && compareElements(i, later, 0) == 0) {
+                superseded[i] = 1;
+                ++numSuperseded;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * permuteBlock(begin, permutation)
+ * Moves element begin + permutation[i] to begin + i.  The coordinates and
+ * superseded flags are gathered one column at a time into a scratch
+ * buffer and copied back, which streams through each column instead of
+ * hopping between them.  The values are moved along the cycles of the
+ * permutation, which uses it up.
+ */
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::permuteBlock(size_t begin, vector<size_t>& permutation) const {
+    size_t count = permutation.size();
+    vector<double> scratch(count);
+    for (size_t j = 0; j < N; ++j) {
+        double* coordinates = coords.data() + j * values.size() + begin;
+        for (size_t i = 0; i < count; ++i)
+            scratch[i] = coordinates[permutation[i]];
+        copy(scratch.begin(), scratch.end(), coordinates);
+    }
+    vector<char> flags(count);
+    for (size_t i = 0; i < count; ++i)
+        flags[i] = superseded[begin + permutation[i]];
+    copy(flags.begin(), flags.end(), superseded.begin() + begin);
+
+    ElemType* block = values.data() + begin;
+    for (size_t start = 0; start < count; ++start) {
+        if (permutation[start] == start) continue;
+        ElemType held = move(block[start]);
+        size_t current = start;
+        while (permutation[current] != start) {
+            size_t next = permutation[current];
+            block[current] = move(block[next]);
+            permutation[current] = current;
+            current = next;
+        }
+        block[current] = move(held);
+        permutation[current] = current;
+    }
+}
+
+template <size_t N, typename ElemType>
+size_t LazyKDTree<N, ElemType>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename ElemType>
+size_t LazyKDTree<N, ElemType>::size() const {
+    return values.size() - numSuperseded;
+}
+
+template <size_t N, typename ElemType>
+bool LazyKDTree<N, ElemType>::empty() const {
+    return values.empty();
+}
+
+template <size_t N, typename ElemType>
+size_t LazyKDTree<N, ElemType>::splitCount() const {
+    return numSplits;
+}
+
+/*
+ * findIndex(pt, begin, end, depth, index)
+ * Points with the same coordinate as the middle point may lie on either
+ * side of it, so a point on the splitting plane is looked for in both
+ * halves.  Superseded copies are passed over; the copy that replaced one
+ * is always found first.
+ */
+template <size_t N, typename ElemType>
+bool LazyKDTree<N, ElemType>::findIndex(const Point<N>& pt, size_t begin, size_t end, size_t depth, size_t& index) const {
+    while (end - begin > kLazyKDTreeLeafSize) {
+        ensureSplit(begin, end, depth);
+        size_t mid = begin + (end - begin) / 2;
+        if (!superseded[mid] && pointEquals(mid, pt)) {
+            index = mid;
+            return true;
+        }
+
+        size_t keyIndex = depth % N;
+        double split = column(keyIndex)[mid];
+        if (pt[keyIndex] == split && findIndex(pt, begin, mid, depth + 1, index))
+            return true;
+        if (pt[keyIndex] < split) {
+            end = mid;
+        } else {
+            begin = mid + 1;
+        }
+        ++depth;
+    }
+    for (size_t i = begin; i < end; ++i) {
+        if (!superseded[i] && pointEquals(i, pt)) {
+            index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+template <size_t N, typename ElemType>
+bool LazyKDTree<N, ElemType>::contains(const Point<N>& pt) const {
+    size_t index;
+    return findIndex(pt, 0, values.size(), 0, index);
+}
+
+template <size_t N, typename ElemType>
+const ElemType& LazyKDTree<N, ElemType>::at(const Point<N>& pt) const {
+    size_t index;
+    if (!findIndex(pt, 0, values.size(), 0, index))
+        throw out_of_range("That point does not exist");
+    return values[index];
+}
+
+/*
+ * searchRange(key, nearest, begin, end, depth)
+ * The usual k-NN descent, except that blocks are split on the way down
+ * and small blocks are scanned.  Points on the far side of a splitting
+ * plane, including any that share the middle point's coordinate, are
+ * never closer than the plane itself, so pruning on the plane distance is
+ * safe.
+ */
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::searchRange(const Point<N>& key, BoundedPQueue<const ElemType*>& nearest,
+                                          size_t begin, size_t end, size_t depth) const {
+    if (end - begin <= kLazyKDTreeLeafSize) {
+        double distances[kLazyKDTreeLeafSize];
+        leafDistances(key, begin, end, distances);
+        for (size_t i = begin; i < end; ++i) {
+            if (!superseded[i]) nearest.enqueue(&values[i], sqrt(distances[i - begin]));
+        }
+        return;
+    }
+
+    ensureSplit(begin, end, depth);
+    size_t mid = begin + (end - begin) / 2;
+    if (!superseded[mid]) nearest.enqueue(&values[mid], distanceTo(mid, key));
+
+    size_t keyIndex = depth % N;
+    double split = column(keyIndex)[mid];
+    bool goesLeft = key[keyIndex] < split;
+    if (goesLeft) {
+        searchRange(key, nearest, begin, mid, depth + 1);
+    } else {
+        searchRange(key, nearest, mid + 1, end, depth + 1);
+    }
+
+    if (nearest.size() != nearest.maxSize() || fabs(split - key[keyIndex]) < nearest.worst()) {
+        if (goesLeft) {
+            searchRange(key, nearest, mid + 1, end, depth + 1);
+        } else {
+            searchRange(key, nearest, begin, mid, depth + 1);
+        }
+    }
+}
+
+template <size_t N, typename ElemType>
+ElemType LazyKDTree<N, ElemType>::kNNValue(const Point<N>& key, size_t k) const {
+    if (k == 0) return ElemType();
+    BoundedPQueue<const ElemType*> nearest(k);
+    searchRange(key, nearest, 0, values.size(), 0);
+    return MostCommonValue(nearest);
+}
+
+/*
+ * File format.  All integers and doubles are little-endian.
+ *
+ *   header:    magic "KDTL", uint32 version, uint32 dimension,
+ *              uint64 source fingerprint, uint64 number of elements
+ *   elements:  in tree order, each as a uint8 of flags, the N
+ *              coordinates as doubles, and the value as encoded by
+ *              ValueSerializer<ElemType>
+ *
+ * The flags mark whether the block whose middle index this is has been
+ * split, and whether the element has been superseded by a later copy of
+ * its point.
+ */
+static const char kLazyKDTreeMagic[4] = { 'K', 'D', 'T', 'L' };
+static const uint32_t kLazyKDTreeVersion = 1;
+
+static const uint8_t kLazyKDTreeSplit      = 0x1;
+static const uint8_t kLazyKDTreeSuperseded = 0x2;
+
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::save(const string& path, uint64_t sourceFingerprint) const {
+    KDTREE_TRACE_SPAN("LazyKDTree::save");
+    lock_guard<mutex> guard(splitLock);
+    BinaryWriter out;
+    out.writeBytes(kLazyKDTreeMagic, sizeof(kLazyKDTreeMagic));
+    out.writeUInt32(kLazyKDTreeVersion);
+    out.writeUInt32(uint32_t(N));
+    out.writeUInt64(sourceFingerprint);
+    out.writeUInt64(values.size());
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        uint8_t flags = 0;
+        if (splitFlags[i].load(memory_order_relaxed)) flags |= kLazyKDTreeSplit;
+        if (superseded[i]) flags |= kLazyKDTreeSuperseded;
+        out.writeUInt8(flags);
+        for (size_t j = 0; j < N; ++j)
+            out.writeDouble(column(j)[i]);
+        ValueSerializer<ElemType>::write(out, values[i]);
+    }
+    out.saveToFile(path);
+}
+
+/*
+ * load(path)
+ * The file lists the elements in tree order, which is the order they are
+ * stored in, so each coordinate goes straight into its column.
+ */
+template <size_t N, typename ElemType>
+void LazyKDTree<N, ElemType>::load(const string& path, uint64_t sourceFingerprint) {
+    KDTREE_TRACE_SPAN("LazyKDTree::load");
+    BinaryReader in(path);
+
+    char magic[sizeof(kLazyKDTreeMagic)];
+    in.readBytes(magic, sizeof(magic));
+    if (memcmp(magic, kLazyKDTreeMagic, sizeof(magic)) != 0)
+        throw runtime_error(path + " is not a LazyKDTree file");
+    if (in.readUInt32() != kLazyKDTreeVersion)
+        throw runtime_error(path + " has an unsupported version");
+    if (in.readUInt32() != N)
+        throw runtime_error(path + " stores points of a different dimension");
+    if (in.readUInt64() != sourceFingerprint)
+        throw runtime_error(path + " was built from different data");
+    uint64_t count = in.readUInt64();
+
+    /* Every element takes at least one byte per coordinate, which catches
+     absurd counts before they are used to allocate anything. */
+    if (count > in.bytesRemaining() / (1 + N))
+        throw runtime_error(path + " is a corrupt LazyKDTree file");
+
+    vector<double> newCoords(count * N);
+    vector<ElemType> newValues(count);
+    vector<uint8_t> flags(count);
+    for (size_t i = 0; i < count; ++i) {
+        flags[i] = in.readUInt8();
+        for (size_t j = 0; j < N; ++j)
+            newCoords[j * count + i] = in.readDouble();
+        ValueSerializer<ElemType>::read(in, newValues[i]);
+    }
+    if (!in.atEnd())
+        throw runtime_error(path + " is a corrupt LazyKDTree file");
+
+    assign(newCoords, newValues);
+    for (size_t i = 0; i < count; ++i) {
+        if (flags[i] & kLazyKDTreeSplit) {
+            splitFlags[i].store(true, memory_order_relaxed);
+            ++numSplits;
+        }
+        if (flags[i] & kLazyKDTreeSuperseded) {
+            superseded[i] = 1;
+            ++numSuperseded;
+        }
+    }
+}
+
+#endif // LAZY_KDTREE_INCLUDED
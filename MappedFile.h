@@ -0,0 +1,159 @@
+/**************************************************************
+ * File: MappedFile.h
+ *
+ * A read-only, memory-mapped view of a file.  The contents of
+ * the file are mapped directly into the address space of the
+ * process, so nothing is read from disk until a page is first
+ * touched, and pages are shared through the operating system's
+ * page cache with every other process mapping the same file.
+ *
+ * MappedFile file("index.kdv");
+ * const char* bytes = file.data();
+ * size_t length = file.size();
+ *
+ * The mapping lives exactly as long as the MappedFile object.
+ * The constructor throws a runtime_error if the file cannot be
+ * opened or mapped.
+ *
+ * FileFingerprint summarizes a file's size and modification
+ * time in one number, which snapshots built from the file
+ * store so that they can tell when it has changed.
+ */
+
+#ifndef MAPPED_FILE_INCLUDED
+#define MAPPED_FILE_INCLUDED
+
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+#include <stdint.h>
+
+using namespace std;
+
+class MappedFile {
+public:
+    /**
+     * Constructor: MappedFile(const string& path);
+     * Usage: MappedFile file("index.kdv");
+     * --------------------------------------------------
+     * Maps the named file read-only.  Throws runtime_error
+     * if the file cannot be mapped.
+     */
+    explicit MappedFile(const string& path);
+
+    /**
+     * Destructor: ~MappedFile();
+     * Usage: (implicit)
+     * --------------------------------------------------
+     * Unmaps the file.
+     */
+    ~MappedFile();
+
+    /**
+     * const char* data() const;
+     * size_t size() const;
+     * Usage: for (size_t i = 0; i < file.size(); ++i) ...
+     * --------------------------------------------------
+     * Returns the address and length of the mapped bytes.
+     * An empty file has size zero and a NULL address.
+     */
+    const char* data() const;
+    size_t size() const;
+
+private:
+    const char* mappedData;
+    size_t mappedSize;
+
+    /* Mappings can't be shared between objects, so copying is disallowed. */
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+/**
+ * uint64_t FileFingerprint(const string& path);
+ * Usage: kd.load("places.kdl", FileFingerprint("places.txt"));
+ * --------------------------------------------------
+ * Returns a number computed from the size and last
+ * modification time of the named file, which changes
+ * whenever the file is rewritten.  Throws runtime_error
+ * if the file cannot be examined.
+ */
+uint64_t FileFingerprint(const string& path);
+
+
+/////////////////////////////////////////////
+// MappedFile class implementation details //
+/////////////////////////////////////////////
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * The constructor maps the whole file.  The descriptor is closed right
+ * away since the mapping keeps the file alive on its own.
+ */
+inline MappedFile::MappedFile(const string& path) {
+    mappedData = NULL;
+    mappedSize = 0;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Couldn't open " + path);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw runtime_error("Couldn't determine the size of " + path);
+    }
+
+    mappedSize = size_t(info.st_size);
+    if (mappedSize != 0) {
+        void* mapping = mmap(NULL, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("Couldn't map " + path);
+        }
+        mappedData = static_cast<const char*>(mapping);
+    }
+    close(fd);
+}
+
+inline MappedFile::~MappedFile() {
+    if (mappedData != NULL)
+        munmap(const_cast<char*>(mappedData), mappedSize);
+}
+
+inline const char* MappedFile::data() const {
+    return mappedData;
+}
+
+inline size_t MappedFile::size() const {
+    return mappedSize;
+}
+
+/*
+ * The modification time is taken to the nanosecond where the file system
+ * records it, so a rewrite of the same size within the same second still
+ * changes the fingerprint.  Each part is mixed in with a multiply so that
+ * no part can cancel out a change in another.  Zero is left for snapshots
+ * saved without a fingerprint.
+ */
+inline uint64_t FileFingerprint(const string& path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        throw runtime_error("Couldn't examine " + path);
+#ifdef __APPLE__
+    uint64_t nanoseconds = uint64_t(info.st_mtimespec.tv_nsec);
+#else
+    uint64_t nanoseconds = uint64_t(info.st_mtim.tv_nsec);
+#endif
+    const uint64_t kMultiplier = 0x9E3779B97F4A7C15ULL;
+    uint64_t result = uint64_t(info.st_size);
+    result = (result * kMultiplier) ^ uint64_t(info.st_mtime);
+    result = (result * kMultiplier) ^ nanoseconds;
+    return result != 0 ? result : 1;
+}
+
+#endif // MAPPED_FILE_INCLUDED
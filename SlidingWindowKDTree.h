@@ -0,0 +1,250 @@
+/**************************************************************
+ * File: SlidingWindowKDTree.h
+ *
+ * An index over a stream of timestamped points that only keeps
+ * the points from a recent window of time.  The stream is cut
+ * into fixed-length intervals, each with its own KDTree, so
+ * that old points expire a whole partition at a time instead
+ * of one by one:
+ *
+ * SlidingWindowKDTree<2, string> window(600.0, 60.0);
+ * window.insert(v, "Some value", now);
+ * cout << window.kNNValue(v, 3) << endl;
+ *
+ * Here every point is kept for at least ten minutes, in
+ * one-minute partitions.  A partition is dropped once all of
+ * its interval has fallen out of the window, so a point may
+ * stay for up to one partition length longer than the window.
+ * Timestamps are plain numbers in whatever unit the window and
+ * partition lengths use.
+ *
+ * Every point inserted is a separate observation: the same
+ * point inserted at two different times is stored twice, and
+ * both copies take part in k-NN searches until they expire.
+ * k-NN searches share one queue across the partitions, so each
+ * partition is pruned by the best candidates already found in
+ * the others.
+ */
+
+#ifndef SLIDING_WINDOW_KDTREE_INCLUDED
+#define SLIDING_WINDOW_KDTREE_INCLUDED
+
+#include "KDTree.h"
+#include <deque>
+#include <stdint.h>
+
+using namespace std;
+
+template <size_t N, typename ElemType>
+class SlidingWindowKDTree {
+public:
+    /**
+     * Constructor: SlidingWindowKDTree(double windowLength, double partitionLength);
+     * Usage: SlidingWindowKDTree<3, int> window(600.0, 60.0);
+     * ----------------------------------------------------
+     * Constructs an empty index that keeps the points from
+     * the last windowLength time units, in partitions each
+     * covering partitionLength time units.  Throws
+     * invalid_argument unless both lengths are positive.
+     */
+    SlidingWindowKDTree(double windowLength, double partitionLength);
+
+    /**
+     * size_t dimension() const;
+     * Usage: size_t dim = window.dimension();
+     * ----------------------------------------------------
+     * Returns the dimension of the points stored in this
+     * index.
+     */
+    size_t dimension() const;
+
+    /**
+     * size_t size() const;
+     * bool empty() const;
+     * size_t numPartitions() const;
+     * Usage: if (window.empty())
+     * ----------------------------------------------------
+     * Returns the number of points in the live partitions,
+     * whether there are none, and how many live partitions
+     * there are.
+     */
+    size_t size() const;
+    bool empty() const;
+    size_t numPartitions() const;
+
+    /**
+     * void insert(const Point<N>& pt, const ElemType& value, double timestamp);
+     * Usage: window.insert(v, "Some value", now);
+     * ----------------------------------------------------
+     * Adds an observation of pt with the specified value at
+     * the specified time, first advancing the window to that
+     * time.  Timestamps may arrive out of order; a point
+     * whose time has already left the window is ignored.
+     * If the same point was already observed in the same
+     * partition, its value is overwritten.
+     */
+    void insert(const Point<N>& pt, const ElemType& value, double timestamp);
+
+    /**
+     * void advanceTo(double now);
+     * Usage: window.advanceTo(now);
+     * ----------------------------------------------------
+     * Moves the window forward to the specified time,
+     * dropping every partition whose interval ended more
+     * than windowLength before it.  Moving the window
+     * backward does nothing.
+     */
+    void advanceTo(double now);
+
+    /**
+     * bool contains(const Point<N>& pt) const;
+     * Usage: if (window.contains(pt))
+     * ----------------------------------------------------
+     * Returns whether the specified point was observed in
+     * any live partition.
+     */
+    bool contains(const Point<N>& pt) const;
+
+    /**
+     * ElemType kNNValue(const Point<N>& key, size_t k) const
+     * Usage: cout << window.kNNValue(v, 3) << endl;
+     * ----------------------------------------------------
+     * Given a point v and an integer k, finds the k live
+     * observations nearest to v and returns the most common
+     * value associated with them.  In the event of a tie,
+     * one of the most frequent value will be chosen.
+     */
+    ElemType kNNValue(const Point<N>& key, size_t k) const;
+
+private:
+    /* The points observed during one interval of partitionLength time
+     units, namely the interval starting at interval * partitionLength. */
+    struct Partition {
+        int64_t interval;
+        KDTree<N, ElemType> tree;
+    };
+
+    /* Live partitions, oldest first. */
+    deque<Partition> partitions;
+    double windowLength;
+    double partitionLength;
+    double now;
+    size_t numElements;
+
+    int64_t intervalOf(double timestamp) const;
+    bool isExpired(int64_t interval) const;
+};
+
+
+//////////////////////////////////////////////////////
+// SlidingWindowKDTree class implementation details //
+//////////////////////////////////////////////////////
+
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+
+template <size_t N, typename ElemType>
+SlidingWindowKDTree<N, ElemType>::SlidingWindowKDTree(double windowLength, double partitionLength)
+    : windowLength(windowLength), partitionLength(partitionLength), now(-numeric_limits<double>::infinity()),
+      numElements(0) {
+    if (!(windowLength > 0.0) || !(partitionLength > 0.0))
+        throw invalid_argument("Window and partition lengths must be positive");
+}
+
+template <size_t N, typename ElemType>
+size_t SlidingWindowKDTree<N, ElemType>::dimension() const {
+    return N;
+}
+
+template <size_t N, typename ElemType>
+size_t SlidingWindowKDTree<N, ElemType>::size() const {
+    return numElements;
+}
+
+template <size_t N, typename ElemType>
+bool SlidingWindowKDTree<N, ElemType>::empty() const {
+    return numElements == 0;
+}
+
+template <size_t N, typename ElemType>
+size_t SlidingWindowKDTree<N, ElemType>::numPartitions() const {
+    return partitions.size();
+}
+
+template <size_t N, typename ElemType>
+int64_t SlidingWindowKDTree<N, ElemType>::intervalOf(double timestamp) const {
+    return int64_t(floor(timestamp / partitionLength));
+}
+
+/*
+ * A partition expires once the end of its interval is more than
+ * windowLength in the past.
+ */
+template <size_t N, typename ElemType>
+bool SlidingWindowKDTree<N, ElemType>::isExpired(int64_t interval) const {
+    return double(interval + 1) * partitionLength <= now - windowLength;
+}
+
+/*
+ * insert(pt, value, timestamp)
+ * Points almost always belong to the newest partition, so the search for
+ * the right one starts from the back.  Starting a new newest partition
+ * means the one before it has most likely seen its last point, so that
+ * one is relaid out for faster searches.
+ */
+template <size_t N, typename ElemType>
+void SlidingWindowKDTree<N, ElemType>::insert(const Point<N>& pt, const ElemType& value, double timestamp) {
+    advanceTo(timestamp);
+    int64_t interval = intervalOf(timestamp);
+    if (isExpired(interval)) return;
+
+    typename deque<Partition>::iterator position = partitions.end();
+    while (position != partitions.begin() && (position - 1)->interval > interval) --position;
+    if (position == partitions.begin() || (position - 1)->interval != interval) {
+        Partition partition;
+        partition.interval = interval;
+        position = partitions.insert(position, partition) + 1;
+        if (position == partitions.end() && partitions.size() > 1)
+            (position - 2)->tree.relayout();
+    }
+
+    KDTree<N, ElemType>& tree = (position - 1)->tree;
+    size_t oldSize = tree.size();
+    tree.insert(pt, value);
+    numElements += tree.size() - oldSize;
+}
+
+template <size_t N, typename ElemType>
+void SlidingWindowKDTree<N, ElemType>::advanceTo(double now) {
+    if (now <= this->now) return;
+    this->now = now;
+    while (!partitions.empty() && isExpired(partitions.front().interval)) {
+        numElements -= partitions.front().tree.size();
+        partitions.pop_front();
+    }
+}
+
+template <size_t N, typename ElemType>
+bool SlidingWindowKDTree<N, ElemType>::contains(const Point<N>& pt) const {
+    for (size_t i = 0; i < partitions.size(); ++i) {
+        if (partitions[i].tree.contains(pt)) return true;
+    }
+    return false;
+}
+
+/*
+ * kNNValue(key, k)
+ * Every partition is searched with the same queue, newest first.
+ */
+template <size_t N, typename ElemType>
+ElemType SlidingWindowKDTree<N, ElemType>::kNNValue(const Point<N>& key, size_t k) const {
+    if (k == 0) return ElemType();
+    BoundedPQueue<const ElemType*> nearest(k);
+    for (size_t i = partitions.size(); i > 0; --i) {
+        partitions[i - 1].tree.kNearest(key, nearest);
+    }
+    return MostCommonValue(nearest);
+}
+
+#endif // SLIDING_WINDOW_KDTREE_INCLUDED
@@ -0,0 +1,120 @@
+/**************************************************************
+ * File: TextRecordParser.h
+ *
+ * Fast parsing for text files of labeled points, one record
+ * per line: N numbers followed by a label, separated by
+ * spaces or tabs.  The file may start with a line giving the
+ * number of records:
+ *
+ * MappedFile file("place-data.txt");
+ * const char* pos = file.data();
+ * const char* end = pos + file.size();
+ * size_t count = ParseRecordCount(pos, end);
+ * vector< pair<Point<2>, string> > records;
+ * ParseTextRecords(pos, end, records);
+ *
+ * Numbers are read with from_chars, which doesn't depend on
+ * the locale and never allocates, so parsing runs at close to
+ * memory speed.  A block of text can be parsed independently
+ * of the rest as long as it starts at the beginning of a
+ * line, so the functions work equally well on chunks handed
+ * out by the ingestion pipeline.  Both throw runtime_error on
+ * malformed input.
+ */
+
+#ifndef TEXT_RECORD_PARSER_INCLUDED
+#define TEXT_RECORD_PARSER_INCLUDED
+
+#include "Point.h"
+#include <string>
+#include <vector>
+#include <charconv>
+#include <stdexcept>
+#include <stdint.h>
+
+using namespace std;
+
+/**
+ * size_t ParseRecordCount(const char*& pos, const char* end);
+ * Usage: size_t count = ParseRecordCount(pos, end);
+ * ----------------------------------------------------
+ * Reads the record count from the start of the text and
+ * advances pos past it.
+ */
+inline size_t ParseRecordCount(const char*& pos, const char* end);
+
+/**
+ * void ParseTextRecords(const char* begin, const char* end,
+ *                       vector< pair<Point<N>, string> >& records);
+ * Usage: ParseTextRecords(chunk.data(), chunk.data() + chunk.size(), records);
+ * ----------------------------------------------------
+ * Appends every record in the text to records.  The text
+ * must start at the beginning of a line; blank lines are
+ * skipped.
+ */
+template <size_t N>
+void ParseTextRecords(const char* begin, const char* end, vector< pair<Point<N>, string> >& records);
+
+
+/////////////////////////////////////////////
+// TextRecordParser implementation details //
+/////////////////////////////////////////////
+
+/* Skips spaces and tabs, but not line breaks. */
+inline const char* SkipRecordBlanks(const char* pos, const char* end) {
+    while (pos != end && (*pos == ' ' || *pos == '\t')) ++pos;
+    return pos;
+}
+
+inline bool IsRecordSpace(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+inline size_t ParseRecordCount(const char*& pos, const char* end) {
+    while (pos != end && IsRecordSpace(*pos)) ++pos;
+
+    uint64_t count;
+    from_chars_result result = from_chars(pos, end, count);
+    if (result.ec != errc() || (result.ptr != end && !IsRecordSpace(*result.ptr)))
+        throw runtime_error("Malformed record count");
+    pos = result.ptr;
+    return size_t(count);
+}
+
+/*
+ * ParseTextRecords(begin, end, records)
+ * Each line must hold exactly N numbers and one label; anything else on
+ * the line is an error rather than the start of the next record.
+ */
+template <size_t N>
+void ParseTextRecords(const char* begin, const char* end, vector< pair<Point<N>, string> >& records) {
+    const char* pos = begin;
+    while (true) {
+        while (pos != end && IsRecordSpace(*pos)) ++pos;
+        if (pos == end) return;
+
+        records.push_back(pair<Point<N>, string>());
+        pair<Point<N>, string>& record = records.back();
+        for (size_t i = 0; i < N; ++i) {
+            pos = SkipRecordBlanks(pos, end);
+            from_chars_result result = from_chars(pos, end, record.first[i]);
+            if (result.ec != errc() || (result.ptr != end && !IsRecordSpace(*result.ptr)))
+                throw runtime_error("Malformed number in text record");
+            pos = result.ptr;
+        }
+
+        pos = SkipRecordBlanks(pos, end);
+        const char* label = pos;
+        while (pos != end && !IsRecordSpace(*pos)) ++pos;
+        if (pos == label)
+            throw runtime_error("Text record is missing its label");
+        record.second.assign(label, pos);
+
+        pos = SkipRecordBlanks(pos, end);
+        if (pos != end && *pos == '\r') ++pos;
+        if (pos != end && *pos != '\n')
+            throw runtime_error("Unexpected text after record label");
+    }
+}
+
+#endif // TEXT_RECORD_PARSER_INCLUDED
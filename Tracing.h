@@ -0,0 +1,292 @@
+/**************************************************************
+ * File: Tracing.h
+ *
+ * Lightweight tracing of where time goes.  Code marks regions
+ * of interest with scoped spans:
+ *
+ * void Load() {
+ *     KDTREE_TRACE_SPAN("Parse place data");
+ *     ...
+ * }
+ *
+ * and, once the interesting work is done, the recorded spans
+ * are written out as a Chrome trace-event JSON file, which can
+ * be opened in chrome://tracing or ui.perfetto.dev to see each
+ * thread's spans on a timeline:
+ *
+ * KDTREE_TRACE_THREAD_NAME("Loading thread");
+ * ...
+ * KDTREE_TRACE_DUMP("kdtree-trace.json");
+ *
+ * Tracing is compiled out unless KDTREE_ENABLE_TRACING is
+ * defined; without it, the three macros expand to nothing at
+ * all.  With tracing enabled, a span costs two clock reads
+ * and an append to a buffer owned by the calling thread.
+ * Each thread keeps only its most recent kTraceEventsPerThread
+ * spans, so tracing a long session of queries takes bounded
+ * memory.
+ *
+ * Span names must be string literals, or otherwise outlive
+ * the dump, since only the pointer is recorded.
+ */
+
+#ifndef TRACING_INCLUDED
+#define TRACING_INCLUDED
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+using namespace std;
+
+/* How many of its most recent spans each thread keeps. */
+static const size_t kTraceEventsPerThread = 1 << 16;
+
+class TraceRecorder {
+public:
+    /**
+     * static TraceRecorder& instance();
+     * Usage: TraceRecorder::instance().save("trace.json");
+     * --------------------------------------------------
+     * Returns the process-wide recorder.
+     */
+    static TraceRecorder& instance();
+
+    /**
+     * double now() const;
+     * Usage: double start = recorder.now();
+     * --------------------------------------------------
+     * Returns the number of microseconds since the recorder
+     * was created, the time base of every event.
+     */
+    double now() const;
+
+    /**
+     * void record(const char* name, double start, double duration);
+     * Usage: recorder.record("Parse", start, recorder.now() - start);
+     * --------------------------------------------------
+     * Records a completed span on the calling thread.
+     * Times are in microseconds, as returned by now().
+     */
+    void record(const char* name, double start, double duration);
+
+    /**
+     * void nameThread(const string& name);
+     * Usage: recorder.nameThread("Loading thread");
+     * --------------------------------------------------
+     * Labels the calling thread's row in the trace.
+     */
+    void nameThread(const string& name);
+
+    /**
+     * void save(const string& path) const;
+     * Usage: recorder.save("trace.json");
+     * --------------------------------------------------
+     * Writes every span recorded so far, on every thread,
+     * to the specified file as Chrome trace-event JSON.
+     * Throws runtime_error if the file can't be written.
+     */
+    void save(const string& path) const;
+
+private:
+    struct Event {
+        const char* name;
+        double start;
+        double duration;
+    };
+
+    /* Each thread appends to its own buffer.  Once the buffer holds
+     * kTraceEventsPerThread events it becomes a ring, and each new event
+     * overwrites the oldest, which is at index next.  The lock is only ever
+     * contended while a dump is reading the buffer.
+     */
+    struct ThreadBuffer {
+        size_t threadId;
+        string threadName;
+        mutex lock;
+        vector<Event> events;
+        size_t next;
+    };
+
+    chrono::steady_clock::time_point origin;
+
+    mutable mutex registryLock;
+    vector< unique_ptr<ThreadBuffer> > buffers;
+
+    TraceRecorder();
+    ThreadBuffer& currentBuffer();
+
+    TraceRecorder(const TraceRecorder&);
+    TraceRecorder& operator=(const TraceRecorder&);
+};
+
+/**
+ * Class: TraceSpan
+ * Usage: TraceSpan span("Build tree");
+ * --------------------------------------------------
+ * Records a span covering its own lifetime.  Code should
+ * normally use KDTREE_TRACE_SPAN instead, so that the
+ * span disappears when tracing is compiled out.
+ */
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name);
+    ~TraceSpan();
+
+private:
+    const char* name;
+    double start;
+
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+};
+
+#define KDTREE_TRACE_CONCAT_(a, b) a##b
+#define KDTREE_TRACE_CONCAT(a, b) KDTREE_TRACE_CONCAT_(a, b)
+
+#ifdef KDTREE_ENABLE_TRACING
+#include <iostream>
+#define KDTREE_TRACE_SPAN(name) TraceSpan KDTREE_TRACE_CONCAT(kdtreeTraceSpan, __LINE__)(name)
+#define KDTREE_TRACE_THREAD_NAME(name) TraceRecorder::instance().nameThread(name)
+#define KDTREE_TRACE_DUMP(path)                                         \
+    do {                                                                \
+        try {                                                           \
+            TraceRecorder::instance().save(path);                       \
+        } catch (const exception& traceError) {                         \
+            cerr << "Couldn't save trace: " << traceError.what() << endl; \
+        }                                                               \
+    } while (0)
+#else
+#define KDTREE_TRACE_SPAN(name) ((void)0)
+#define KDTREE_TRACE_THREAD_NAME(name) ((void)0)
+#define KDTREE_TRACE_DUMP(path) ((void)0)
+#endif
+
+
+////////////////////////////////////////////////
+// TraceRecorder class implementation details //
+////////////////////////////////////////////////
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+inline TraceRecorder::TraceRecorder() {
+    origin = chrono::steady_clock::now();
+}
+
+inline TraceRecorder& TraceRecorder::instance() {
+    static TraceRecorder recorder;
+    return recorder;
+}
+
+inline double TraceRecorder::now() const {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count();
+}
+
+/*
+ * A thread registers its buffer the first time it records anything.  The
+ * recorder owns the buffers, so spans survive the threads that made them.
+ */
+inline TraceRecorder::ThreadBuffer& TraceRecorder::currentBuffer() {
+    static thread_local ThreadBuffer* buffer = NULL;
+    if (buffer == NULL) {
+        lock_guard<mutex> guard(registryLock);
+        buffers.push_back(unique_ptr<ThreadBuffer>(new ThreadBuffer));
+        buffer = buffers.back().get();
+        buffer->threadId = buffers.size();
+        buffer->next = 0;
+    }
+    return *buffer;
+}
+
+inline void TraceRecorder::record(const char* name, double start, double duration) {
+    ThreadBuffer& buffer = currentBuffer();
+    Event event = { name, start, duration };
+    lock_guard<mutex> guard(buffer.lock);
+    if (buffer.events.size() < kTraceEventsPerThread) {
+        buffer.events.push_back(event);
+    } else {
+        buffer.events[buffer.next] = event;
+        buffer.next = (buffer.next + 1) % kTraceEventsPerThread;
+    }
+}
+
+inline void TraceRecorder::nameThread(const string& name) {
+    ThreadBuffer& buffer = currentBuffer();
+    lock_guard<mutex> guard(buffer.lock);
+    buffer.threadName = name;
+}
+
+/*
+ * Writes a string as a JSON string literal.
+ */
+inline void WriteTraceString(ostream& out, const string& text) {
+    out << '"';
+    for (size_t i = 0; i < text.size(); ++i) {
+        unsigned char ch = text[i];
+        if (ch == '"' || ch == '\\') {
+            out << '\\' << ch;
+        } else if (ch < 0x20) {
+            const char* hex = "0123456789abcdef";
+            out << "\\u00" << hex[ch >> 4] << hex[ch & 0xF];
+        } else {
+            out << ch;
+        }
+    }
+    out << '"';
+}
+
+/*
+ * Spans become complete ("X") events, oldest first; named threads also get
+ * a metadata ("M") event so the viewer shows their names.
+ */
+inline void TraceRecorder::save(const string& path) const {
+    ostringstream out;
+    out.precision(3);
+    out << fixed << "{\"traceEvents\":[";
+
+    bool first = true;
+    lock_guard<mutex> registryGuard(registryLock);
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        ThreadBuffer& buffer = *buffers[i];
+        lock_guard<mutex> guard(buffer.lock);
+
+        if (!buffer.threadName.empty()) {
+            out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+                << buffer.threadId << ",\"args\":{\"name\":";
+            WriteTraceString(out, buffer.threadName);
+            out << "}}";
+            first = false;
+        }
+        for (size_t j = 0; j < buffer.events.size(); ++j) {
+            const Event& event = buffer.events[(buffer.next + j) % buffer.events.size()];
+            out << (first ? "\n" : ",\n") << "{\"name\":";
+            WriteTraceString(out, event.name);
+            out << ",\"cat\":\"kdtree\",\"ph\":\"X\",\"ts\":" << event.start << ",\"dur\":" << event.duration
+                << ",\"pid\":1,\"tid\":" << buffer.threadId << "}";
+            first = false;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    ofstream file(path.c_str());
+    if (!file)
+        throw runtime_error("Couldn't open " + path + " for writing");
+    file << out.str();
+    if (!file)
+        throw runtime_error("Couldn't write to " + path);
+}
+
+inline TraceSpan::TraceSpan(const char* name) : name(name) {
+    start = TraceRecorder::instance().now();
+}
+
+inline TraceSpan::~TraceSpan() {
+    TraceRecorder& recorder = TraceRecorder::instance();
+    recorder.record(name, start, recorder.now() - start);
+}
+
+#endif // TRACING_INCLUDED
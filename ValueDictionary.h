@@ -0,0 +1,216 @@
+/**************************************************************
+ * File: ValueDictionary.h
+ *
+ * A dictionary that interns values, handing each distinct
+ * value a small integer ID.  Data sets that attach one of a
+ * few thousand labels to millions of points can then store a
+ * four-byte ID per point instead of a full copy of its label:
+ *
+ * ValueDictionary<string> codes;
+ * uint32_t id = codes.intern("US06");
+ * cout << codes.value(id) << endl;   // Prints US06
+ *
+ * IDs are assigned in the order values are first interned,
+ * starting from zero, and never change.  Values must support
+ * operator<.
+ */
+
+#ifndef VALUE_DICTIONARY_INCLUDED
+#define VALUE_DICTIONARY_INCLUDED
+
+#include "BinarySerialization.h"
+#include <map>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+
+using namespace std;
+
+template <typename ElemType>
+class ValueDictionary {
+public:
+    /**
+     * uint32_t intern(const ElemType& value);
+     * Usage: uint32_t id = dictionary.intern(label);
+     * --------------------------------------------------
+     * Returns the ID of the specified value, adding it to
+     * the dictionary first if it isn't there yet.
+     */
+    uint32_t intern(const ElemType& value);
+
+    /**
+     * bool find(const ElemType& value, uint32_t& id) const;
+     * Usage: if (dictionary.find(label, id)) ...
+     * --------------------------------------------------
+     * Looks up the ID of a value without adding it,
+     * returning whether the value was found.
+     */
+    bool find(const ElemType& value, uint32_t& id) const;
+
+    /**
+     * const ElemType& value(uint32_t id) const;
+     * Usage: cout << dictionary.value(id) << endl;
+     * --------------------------------------------------
+     * Returns the value with the specified ID.  Throws
+     * out_of_range if no value has that ID.
+     */
+    const ElemType& value(uint32_t id) const;
+
+    /**
+     * size_t size() const;
+     * bool empty() const;
+     * Usage: cout << dictionary.size() << " labels" << endl;
+     * --------------------------------------------------
+     * Returns the number of distinct values interned.
+     */
+    size_t size() const;
+    bool empty() const;
+
+    /**
+     * uint64_t fingerprint() const;
+     * Usage: if (dictionary.fingerprint() != expected) ...
+     * --------------------------------------------------
+     * Returns a checksum of the values and their IDs.  Two
+     * dictionaries with the same fingerprint almost
+     * certainly map the same IDs to the same values, so a
+     * file of IDs can record it to detect being paired
+     * with the wrong dictionary.
+     */
+    uint64_t fingerprint() const;
+
+    /**
+     * void save(const string& path) const;
+     * void load(const string& path);
+     * Usage: dictionary.save("labels.kdd");
+     * --------------------------------------------------
+     * Writes the dictionary to a file, or replaces it with
+     * the contents of one.  IDs are preserved.  Both throw
+     * runtime_error on failure; if load fails, this
+     * dictionary is left unchanged.
+     */
+    void save(const string& path) const;
+    void load(const string& path);
+
+private:
+    vector<ElemType> values;
+    map<ElemType, uint32_t> ids;
+};
+
+
+//////////////////////////////////////////////////
+// ValueDictionary class implementation details //
+//////////////////////////////////////////////////
+
+template <typename ElemType>
+uint32_t ValueDictionary<ElemType>::intern(const ElemType& value) {
+    typename map<ElemType, uint32_t>::iterator itr = ids.lower_bound(value);
+    if (itr != ids.end() && !(value < itr->first)) return itr->second;
+
+    if (values.size() == size_t(uint32_t(-1)))
+        throw length_error("Too many distinct values to intern");
+    uint32_t id = uint32_t(values.size());
+    values.push_back(value);
+    ids.insert(itr, make_pair(value, id));
+    return id;
+}
+
+template <typename ElemType>
+bool ValueDictionary<ElemType>::find(const ElemType& value, uint32_t& id) const {
+    typename map<ElemType, uint32_t>::const_iterator itr = ids.find(value);
+    if (itr == ids.end()) return false;
+    id = itr->second;
+    return true;
+}
+
+template <typename ElemType>
+const ElemType& ValueDictionary<ElemType>::value(uint32_t id) const {
+    if (id >= values.size())
+        throw out_of_range("No value has that ID");
+    return values[id];
+}
+
+template <typename ElemType>
+size_t ValueDictionary<ElemType>::size() const {
+    return values.size();
+}
+
+template <typename ElemType>
+bool ValueDictionary<ElemType>::empty() const {
+    return values.empty();
+}
+
+/*
+ * fingerprint()
+ * An FNV-1a hash of the values as they are saved, in ID order, preceded
+ * by their count.
+ */
+template <typename ElemType>
+uint64_t ValueDictionary<ElemType>::fingerprint() const {
+    BinaryWriter out;
+    out.writeUInt64(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        ValueSerializer<ElemType>::write(out, values[i]);
+
+    uint64_t result = 14695981039346656037ULL;
+    const string& bytes = out.bytes();
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        result ^= uint8_t(bytes[i]);
+        result *= 1099511628211ULL;
+    }
+    return result;
+}
+
+/*
+ * File format.  All integers are little-endian.
+ *
+ *   header:  magic "KDVD", uint32 version, uint64 number of values
+ *   values:  in ID order, each as encoded by ValueSerializer<ElemType>
+ */
+static const char kValueDictionaryMagic[4] = { 'K', 'D', 'V', 'D' };
+static const uint32_t kValueDictionaryVersion = 1;
+
+template <typename ElemType>
+void ValueDictionary<ElemType>::save(const string& path) const {
+    BinaryWriter out;
+    out.writeBytes(kValueDictionaryMagic, sizeof(kValueDictionaryMagic));
+    out.writeUInt32(kValueDictionaryVersion);
+    out.writeUInt64(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        ValueSerializer<ElemType>::write(out, values[i]);
+    out.saveToFile(path);
+}
+
+/*
+ * load(path)
+ * A value that appears twice would leave one ID unreachable from intern,
+ * so duplicates mark the file as corrupt.
+ */
+template <typename ElemType>
+void ValueDictionary<ElemType>::load(const string& path) {
+    BinaryReader in(path);
+
+    char magic[sizeof(kValueDictionaryMagic)];
+    in.readBytes(magic, sizeof(magic));
+    if (memcmp(magic, kValueDictionaryMagic, sizeof(magic)) != 0)
+        throw runtime_error(path + " is not a value dictionary file");
+    if (in.readUInt32() != kValueDictionaryVersion)
+        throw runtime_error(path + " has an unsupported version");
+    uint64_t count = in.readUInt64();
+    if (count > in.bytesRemaining())
+        throw runtime_error(path + " is a corrupt value dictionary file");
+
+    ValueDictionary loaded;
+    for (uint64_t i = 0; i < count; ++i) {
+        ElemType value;
+        ValueSerializer<ElemType>::read(in, value);
+        if (loaded.intern(value) != i)
+            throw runtime_error(path + " is a corrupt value dictionary file");
+    }
+    if (!in.atEnd())
+        throw runtime_error(path + " is a corrupt value dictionary file");
+
+    values.swap(loaded.values);
+    ids.swap(loaded.ids);
+}
+
+#endif // VALUE_DICTIONARY_INCLUDED
@@ -0,0 +1,322 @@
+/**************************************************************
+ * File: WorkStealingPool.h
+ *
+ * A fixed-size pool of worker threads that run tasks grouped
+ * into TaskGroups.  Each worker keeps its own deque of tasks:
+ * tasks spawned from inside a worker go onto that worker's
+ * deque and are run most-recent-first, which keeps recursive
+ * divide-and-conquer work local to one core, while idle
+ * workers steal the oldest (and so typically largest) tasks
+ * from the other end of someone else's deque.
+ *
+ * WorkStealingPool pool;          // One worker per core.
+ * WorkStealingPool::TaskGroup group;
+ * pool.submit(group, someFunction);
+ * pool.submit(group, someOtherFunction);
+ * pool.wait(group);               // Runs tasks until both finish.
+ *
+ * Tasks may submit further tasks to any group, including their
+ * own, and may wait on other groups; a thread that waits keeps
+ * running queued tasks rather than blocking, so nested waits
+ * cannot starve the pool.  If a task throws, the first
+ * exception raised in a group is rethrown from wait.
+ */
+
+#ifndef WORK_STEALING_POOL_INCLUDED
+#define WORK_STEALING_POOL_INCLUDED
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+using namespace std;
+
+class WorkStealingPool {
+public:
+    /**
+     * Class: TaskGroup
+     * Usage: WorkStealingPool::TaskGroup group;
+     * --------------------------------------------------
+     * A set of tasks that can be waited on together.  A
+     * group must outlive every task submitted to it.
+     */
+    class TaskGroup {
+    public:
+        TaskGroup();
+
+    private:
+        atomic<size_t> pending;
+        mutex errorLock;
+        exception_ptr error;
+
+        TaskGroup(const TaskGroup&);
+        TaskGroup& operator=(const TaskGroup&);
+
+        friend class WorkStealingPool;
+    };
+
+    /**
+     * Constructor: WorkStealingPool(size_t numThreads = 0);
+     * Usage: WorkStealingPool pool(8);
+     * --------------------------------------------------
+     * Starts the specified number of workers, or one per
+     * hardware thread if numThreads is zero.
+     */
+    explicit WorkStealingPool(size_t numThreads = 0);
+
+    /**
+     * Destructor: ~WorkStealingPool();
+     * Usage: (implicit)
+     * --------------------------------------------------
+     * Stops and joins every worker.  All groups should be
+     * waited on before the pool is destroyed.
+     */
+    ~WorkStealingPool();
+
+    /**
+     * size_t numThreads() const;
+     * Usage: size_t workers = pool.numThreads();
+     * --------------------------------------------------
+     * Returns the number of worker threads in the pool.
+     */
+    size_t numThreads() const;
+
+    /**
+     * void submit(TaskGroup& group, const function<void()>& task);
+     * Usage: pool.submit(group, task);
+     * --------------------------------------------------
+     * Queues a task as part of the specified group.
+     */
+    void submit(TaskGroup& group, const function<void()>& task);
+
+    /**
+     * void wait(TaskGroup& group);
+     * Usage: pool.wait(group);
+     * --------------------------------------------------
+     * Runs queued tasks on the calling thread until every
+     * task in the group has finished, then rethrows the
+     * first exception any of them raised.
+     */
+    void wait(TaskGroup& group);
+
+private:
+    struct Task {
+        function<void()> run;
+        TaskGroup* group;
+    };
+
+    /* Each worker's deque.  The owner pushes and pops at the back;
+     * thieves take from the front.
+     */
+    struct WorkerQueue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<thread> workers;
+    vector<WorkerQueue*> queues;
+
+    /* Tasks submitted from outside the pool land here. */
+    WorkerQueue injectionQueue;
+
+    /* Idle workers sleep on this until a task is queued. */
+    mutex sleepLock;
+    condition_variable wakeUp;
+    atomic<size_t> queuedTasks;
+    bool shuttingDown;
+
+    /* The worker loop for the worker with the specified index */
+    void workerLoop(size_t index);
+
+    /* Finds and runs one queued task, returning whether there was one */
+    bool runOneTask();
+
+    /* Removes a task from the calling worker's queue or steals one */
+    bool takeTask(Task& task);
+
+    /* Index of the calling thread if it is a worker of this pool */
+    size_t currentWorkerIndex() const;
+
+    WorkStealingPool(const WorkStealingPool&);
+    WorkStealingPool& operator=(const WorkStealingPool&);
+};
+
+
+//////////////////////////////////////////////////////
+// WorkStealingPool class implementation details    //
+//////////////////////////////////////////////////////
+
+/*
+ * Each thread remembers which pool it works for and where, so that tasks
+ * it spawns go onto its own deque.
+ */
+struct WorkStealingPoolThreadInfo {
+    const WorkStealingPool* pool;
+    size_t index;
+};
+
+inline WorkStealingPoolThreadInfo& CurrentWorkStealingPoolThread() {
+    static thread_local WorkStealingPoolThreadInfo info = { NULL, 0 };
+    return info;
+}
+
+inline WorkStealingPool::TaskGroup::TaskGroup() : pending(0) {
+    // Handled in initializer list
+}
+
+inline WorkStealingPool::WorkStealingPool(size_t numThreads) : queuedTasks(0) {
+    shuttingDown = false;
+    if (numThreads == 0)
+        numThreads = max(1u, thread::hardware_concurrency());
+
+    for (size_t i = 0; i < numThreads; ++i)
+        queues.push_back(new WorkerQueue);
+    for (size_t i = 0; i < numThreads; ++i)
+        workers.push_back(thread(&WorkStealingPool::workerLoop, this, i));
+}
+
+inline WorkStealingPool::~WorkStealingPool() {
+    {
+        lock_guard<mutex> guard(sleepLock);
+        shuttingDown = true;
+    }
+    wakeUp.notify_all();
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    for (size_t i = 0; i < queues.size(); ++i)
+        delete queues[i];
+}
+
+inline size_t WorkStealingPool::numThreads() const {
+    return workers.size();
+}
+
+inline size_t WorkStealingPool::currentWorkerIndex() const {
+    const WorkStealingPoolThreadInfo& info = CurrentWorkStealingPoolThread();
+    return info.pool == this ? info.index : workers.size();
+}
+
+/*
+ * submit pushes onto the caller's own deque if it is one of our workers,
+ * or onto the shared injection queue otherwise, then wakes a sleeper.
+ */
+inline void WorkStealingPool::submit(TaskGroup& group, const function<void()>& task) {
+    Task entry;
+    entry.run = task;
+    entry.group = &group;
+    group.pending.fetch_add(1);
+
+    size_t index = currentWorkerIndex();
+    WorkerQueue& target = index < queues.size() ? *queues[index] : injectionQueue;
+    {
+        lock_guard<mutex> guard(target.lock);
+        target.tasks.push_back(entry);
+    }
+
+    {
+        lock_guard<mutex> guard(sleepLock);
+        queuedTasks.fetch_add(1);
+    }
+    wakeUp.notify_one();
+}
+
+/*
+ * takeTask looks in the caller's own deque first (newest task), then the
+ * injection queue, then steals the oldest task of each other worker in
+ * turn, starting just after the caller to spread out contention.
+ */
+inline bool WorkStealingPool::takeTask(Task& task) {
+    size_t index = currentWorkerIndex();
+    if (index < queues.size()) {
+        lock_guard<mutex> guard(queues[index]->lock);
+        if (!queues[index]->tasks.empty()) {
+            task = queues[index]->tasks.back();
+            queues[index]->tasks.pop_back();
+            return true;
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(injectionQueue.lock);
+        if (!injectionQueue.tasks.empty()) {
+            task = injectionQueue.tasks.front();
+            injectionQueue.tasks.pop_front();
+            return true;
+        }
+    }
+
+    for (size_t offset = 1; offset <= queues.size(); ++offset) {
+        WorkerQueue& victim = *queues[(index + offset) % queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * runOneTask runs a task and marks it finished in its group, capturing
+ * rather than propagating any exception it throws.
+ */
+inline bool WorkStealingPool::runOneTask() {
+    Task task;
+    if (!takeTask(task)) return false;
+    queuedTasks.fetch_sub(1);
+
+    try {
+        task.run();
+    } catch (...) {
+        lock_guard<mutex> guard(task.group->errorLock);
+        if (!task.group->error)
+            task.group->error = current_exception();
+    }
+    task.group->pending.fetch_sub(1);
+    return true;
+}
+
+/*
+ * Workers run tasks until there are none left, then sleep until more
+ * are queued or the pool shuts down.
+ */
+inline void WorkStealingPool::workerLoop(size_t index) {
+    WorkStealingPoolThreadInfo& info = CurrentWorkStealingPoolThread();
+    info.pool = this;
+    info.index = index;
+
+    while (true) {
+        if (runOneTask()) continue;
+
+        unique_lock<mutex> guard(sleepLock);
+        while (!shuttingDown && queuedTasks.load() == 0)
+            wakeUp.wait(guard);
+        if (shuttingDown) return;
+    }
+}
+
+/*
+ * wait keeps the calling thread busy with queued tasks while the group
+ * is unfinished, yielding when there is nothing it can run.
+ */
+inline void WorkStealingPool::wait(TaskGroup& group) {
+    while (group.pending.load() != 0) {
+        if (!runOneTask())
+            this_thread::yield();
+    }
+
+    lock_guard<mutex> guard(group.errorLock);
+    if (group.error) {
+        exception_ptr error = group.error;
+        group.error = exception_ptr();
+        rethrow_exception(error);
+    }
+}
+
+#endif // WORK_STEALING_POOL_INCLUDED
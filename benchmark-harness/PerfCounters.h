@@ -0,0 +1,253 @@
+/**************************************************************
+ * File: PerfCounters.h
+ *
+ * A small wrapper around the Linux perf_event_open interface
+ * that counts hardware events (cycles, instructions, cache,
+ * branch and TLB misses) over a region of code run by the
+ * calling thread:
+ *
+ * PerfCounters counters;
+ * counters.start();
+ * ... code to measure ...
+ * counters.stop();
+ * double misses = counters.value(PerfCounters::kBranchMisses);
+ *
+ * Counters the kernel or the processor won't provide (for
+ * example under a restrictive perf_event_paranoid setting, in
+ * a virtual machine, or on another operating system) are
+ * simply unavailable, and their values are NaN; nothing else
+ * about the measurement changes.  When the kernel has to share
+ * the hardware counters between more events than it has, the
+ * counts are scaled up by the fraction of time each event was
+ * actually counted.
+ */
+
+#ifndef PERF_COUNTERS_INCLUDED
+#define PERF_COUNTERS_INCLUDED
+
+#include <cmath>
+#include <cstddef>
+
+class PerfCounters {
+public:
+    /* The events counted, in the order they are reported. */
+    enum Event {
+        kCycles,
+        kInstructions,
+        kL1DataMisses,
+        kLastLevelCacheMisses,
+        kBranchMisses,
+        kDataTLBMisses,
+        kNumEvents
+    };
+
+    /**
+     * Constructor: PerfCounters();
+     * Usage: PerfCounters counters;
+     * --------------------------------------------------
+     * Opens a counter for each event that is available to
+     * the calling thread.  The counters start out stopped.
+     */
+    PerfCounters();
+
+    /**
+     * Destructor: ~PerfCounters();
+     * Usage: (implicit)
+     * --------------------------------------------------
+     * Closes the counters.
+     */
+    ~PerfCounters();
+
+    /**
+     * bool available(Event event) const;
+     * bool anyAvailable() const;
+     * Usage: if (!counters.anyAvailable()) cerr << "No counters" << endl;
+     * --------------------------------------------------
+     * Returns whether the specified event, or any event,
+     * can be counted.
+     */
+    bool available(Event event) const;
+    bool anyAvailable() const;
+
+    /**
+     * static const char* name(Event event);
+     * Usage: cout << PerfCounters::name(event) << endl;
+     * --------------------------------------------------
+     * Returns a short name for the event, suitable as a
+     * column heading.
+     */
+    static const char* name(Event event);
+
+    /**
+     * void start();
+     * void stop();
+     * Usage: counters.start(); work(); counters.stop();
+     * --------------------------------------------------
+     * Resets and starts every available counter, or stops
+     * them and records their values.
+     */
+    void start();
+    void stop();
+
+    /**
+     * double value(Event event) const;
+     * Usage: double cycles = counters.value(PerfCounters::kCycles);
+     * --------------------------------------------------
+     * Returns the count of the event between the last
+     * calls to start and stop, or NaN if the event isn't
+     * available.
+     */
+    double value(Event event) const;
+
+private:
+    int fds[kNumEvents];
+    double values[kNumEvents];
+
+    PerfCounters(const PerfCounters&);
+    PerfCounters& operator=(const PerfCounters&);
+};
+
+
+///////////////////////////////////////////////
+// PerfCounters class implementation details //
+///////////////////////////////////////////////
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdint.h>
+
+/*
+ * Returns the perf_event_open type and config for an event.  Cache events
+ * are encoded as cache id | operation << 8 | result << 16.
+ */
+inline void PerfCountersEventConfig(PerfCounters::Event event, uint32_t& type, uint64_t& config) {
+    const uint64_t readMiss = (uint64_t(PERF_COUNT_HW_CACHE_OP_READ) << 8) |
+                              (uint64_t(PERF_COUNT_HW_CACHE_RESULT_MISS) << 16);
+    switch (event) {
+    case PerfCounters::kCycles:
+        type = PERF_TYPE_HARDWARE;
+        config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PerfCounters::kInstructions:
+        type = PERF_TYPE_HARDWARE;
+        config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PerfCounters::kL1DataMisses:
+        type = PERF_TYPE_HW_CACHE;
+        config = PERF_COUNT_HW_CACHE_L1D | readMiss;
+        break;
+    case PerfCounters::kLastLevelCacheMisses:
+        type = PERF_TYPE_HW_CACHE;
+        config = PERF_COUNT_HW_CACHE_LL | readMiss;
+        break;
+    case PerfCounters::kBranchMisses:
+        type = PERF_TYPE_HARDWARE;
+        config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    default:
+        type = PERF_TYPE_HW_CACHE;
+        config = PERF_COUNT_HW_CACHE_DTLB | readMiss;
+        break;
+    }
+}
+
+/*
+ * Each event gets its own counter rather than joining a group, so that one
+ * unsupported event doesn't take the others down with it.  Only user-space
+ * work of the calling thread is counted.
+ */
+inline PerfCounters::PerfCounters() {
+    for (size_t i = 0; i < kNumEvents; ++i) {
+        values[i] = nan("");
+
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        uint32_t type;
+        uint64_t config;
+        PerfCountersEventConfig(Event(i), type, config);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        fds[i] = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+}
+
+inline PerfCounters::~PerfCounters() {
+    for (size_t i = 0; i < kNumEvents; ++i)
+        if (fds[i] >= 0) close(fds[i]);
+}
+
+inline void PerfCounters::start() {
+    for (size_t i = 0; i < kNumEvents; ++i) {
+        if (fds[i] < 0) continue;
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/*
+ * A counter that was never scheduled onto the hardware reports NaN rather
+ * than zero.
+ */
+inline void PerfCounters::stop() {
+    for (size_t i = 0; i < kNumEvents; ++i) {
+        if (fds[i] >= 0) ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (size_t i = 0; i < kNumEvents; ++i) {
+        values[i] = nan("");
+        if (fds[i] < 0) continue;
+
+        uint64_t reading[3];  // value, time enabled, time running
+        if (read(fds[i], reading, sizeof(reading)) != ssize_t(sizeof(reading)) || reading[2] == 0)
+            continue;
+        values[i] = double(reading[0]) * (double(reading[1]) / double(reading[2]));
+    }
+}
+
+#else
+
+/* Without perf_event_open nothing is ever available. */
+inline PerfCounters::PerfCounters() {
+    for (size_t i = 0; i < kNumEvents; ++i) {
+        fds[i] = -1;
+        values[i] = nan("");
+    }
+}
+
+inline PerfCounters::~PerfCounters() {}
+inline void PerfCounters::start() {}
+inline void PerfCounters::stop() {}
+
+#endif
+
+inline bool PerfCounters::available(Event event) const {
+    return fds[event] >= 0;
+}
+
+inline bool PerfCounters::anyAvailable() const {
+    for (size_t i = 0; i < kNumEvents; ++i)
+        if (available(Event(i))) return true;
+    return false;
+}
+
+inline const char* PerfCounters::name(Event event) {
+    static const char* const kNames[kNumEvents] = {
+        "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses"
+    };
+    return kNames[event];
+}
+
+inline double PerfCounters::value(Event event) const {
+    return values[event];
+}
+
+#endif // PERF_COUNTERS_INCLUDED
@@ -0,0 +1,557 @@
+/*************************************************
+ * File: benchmark-harness.cpp
+ *
+ * Measures the build and query performance of the
+ * KDTree across a grid of synthetic datasets,
+ * dimensions and tree sizes, and writes one
+ * machine-readable row per measurement so that runs
+ * can be compared for regressions.
+ *
+ * For every combination of dataset, dimension and
+ * size the suite times:
+ *
+ *   insert     inserting every point one at a time
+ *   build      a bulk build of the same points
+ *   copy       copying the built tree
+ *   contains   lookups, half hits and half misses
+ *   at         lookups of points in the tree
+ *   kNNValue   searches for several values of k
+ *
+ * Queries run against the bulk-built tree, after
+ * laying it out as requested by --layout.  Each
+ * insert and query is timed on its own to give the
+ * 50th and 99th percentile latencies; throughput is
+ * the number of operations over their total time.
+ * Each operation stops early once it has used up its
+ * time budget, so slow combinations (sorted inserts,
+ * high-dimensional searches) don't stall the run;
+ * the count column says how many were measured.
+ *
+ * Usage:
+ *
+ *   g++ -O2 -std=c++11 -pthread benchmark-harness.cpp -o benchmark
+ *   ./benchmark --format=csv --output=results.csv
+ *
+ * The prefetch distance is fixed at compile time, so
+ * measuring what prefetching buys takes a second
+ * build with it turned off, run with the same
+ * options.  The prefetch_distance column tells the
+ * two reports apart.  Prefetching helps most when
+ * the nodes aren't packed into a cache-friendly
+ * order, so compare with --layout=allocation too:
+ *
+ *   g++ -O2 -std=c++11 -pthread -DKDTREE_PREFETCH_DISTANCE=0 \
+ *       benchmark-harness.cpp -o benchmark-no-prefetch
+ *   ./benchmark --layout=allocation --output=prefetch.csv
+ *   ./benchmark-no-prefetch --layout=allocation --output=no-prefetch.csv
+ *
+ * Options, all optional:
+ *
+ *   --datasets=uniform,clustered,sorted,duplicates
+ *   --dims=1,2,3,16,784
+ *   --sizes=1000,10000,100000,1000000,10000000
+ *   --queries=10000        queries per operation
+ *   --budget=2             seconds per operation
+ *   --memory-limit=4096    skip sizes needing more MB
+ *   --layout=veb|bfs|allocation
+ *   --format=csv|json
+ *   --output=file          instead of standard output
+ *   --counters             count hardware events too
+ *
+ * With --counters, each measured region is also run
+ * under the Linux perf_event_open counters (cycles,
+ * instructions, L1 data, last-level cache, branch and
+ * data TLB misses), reported per operation next to
+ * the timings.  Events the system won't count are
+ * left blank.  The counters include the timing code
+ * around each operation, so compare them between
+ * runs rather than reading them as absolute costs.
+ * Progress is written to standard error.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include "../KDTree.h"
+#include "PerfCounters.h"
+using namespace std;
+
+/* Defaults for the command-line options. */
+static const size_t kDefaultSizes[]      = { 1000, 10000, 100000, 1000000, 10000000 };
+static const size_t kDefaultDimensions[] = { 1, 2, 3, 16, 784 };
+static const char*  kDefaultDatasets[]   = { "uniform", "clustered", "sorted", "duplicates" };
+static const size_t kDefaultNumQueries   = 10000;
+static const double kDefaultBudget       = 2.0;
+static const size_t kDefaultMemoryLimit  = 4096;
+
+/* Values of k for the kNNValue measurements. */
+static const size_t kKValues[] = { 1, 4, 16 };
+
+/* Inserts get this many times the per-operation budget, since they also
+ * produce the tree the insert-order numbers describe.
+ */
+static const double kInsertBudgetFactor = 10.0;
+
+/* A budget is only checked every so many operations, and at least this
+ * many operations are measured whatever the budget.
+ */
+static const size_t kBudgetCheckInterval = 64;
+static const size_t kMinOperations = 100;
+
+/* Clustered datasets draw from this many Gaussian blobs of this spread. */
+static const size_t kNumClusters = 32;
+static const double kClusterSpread = 0.01;
+
+/* Duplicate-heavy datasets have this many copies of each distinct point
+ * on average.
+ */
+static const size_t kCopiesPerPoint = 100;
+
+/* Settings parsed from the command line. */
+struct Options {
+  vector<string> datasets;
+  vector<size_t> dimensions;
+  vector<size_t> sizes;
+  size_t numQueries;
+  double budget;
+  size_t memoryLimit;
+  KDTreeNodeLayout layout;
+  string layoutName;
+  string format;
+  string output;
+  PerfCounters* counters;  // NULL unless counting hardware events
+};
+
+/* One row of the report. */
+struct Result {
+  string dataset;
+  size_t dimension;
+  size_t size;
+  string operation;
+  size_t k;
+  size_t count;
+  double seconds;
+  double p50;  // Nanoseconds; NaN when the operation isn't timed per item
+  double p99;
+  double events[PerfCounters::kNumEvents];  // Totals over all the operations, or NaN
+};
+
+/* Collects per-operation latencies and turns them into a Result. */
+class LatencyRecorder {
+public:
+  LatencyRecorder(double budget) : budget(budget) {
+    start = chrono::steady_clock::now();
+  }
+
+  /* Records one operation's latency in nanoseconds. */
+  void add(double nanoseconds) {
+    latencies.push_back(nanoseconds);
+  }
+
+  /* Returns whether the budget has run out, checking the clock only now
+   * and then.
+   */
+  bool outOfTime() const {
+    if (latencies.size() < kMinOperations || latencies.size() % kBudgetCheckInterval != 0)
+      return false;
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count() > budget;
+  }
+
+  /* Fills in the count, total time and percentiles of a result. */
+  void finish(Result& result) {
+    result.count = latencies.size();
+    result.seconds = 0.0;
+    for (size_t i = 0; i < latencies.size(); ++i)
+      result.seconds += latencies[i] / 1e9;
+    result.p50 = Percentile(0.50);
+    result.p99 = Percentile(0.99);
+  }
+
+private:
+  double budget;
+  chrono::steady_clock::time_point start;
+  vector<double> latencies;
+
+  double Percentile(double fraction) {
+    if (latencies.empty()) return nan("");
+    size_t index = min(latencies.size() - 1, size_t(fraction * latencies.size()));
+    nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+    return latencies[index];
+  }
+};
+
+/* Starts counting hardware events for a measured region, if enabled. */
+void StartCounters(const Options& options) {
+  if (options.counters != NULL) options.counters->start();
+}
+
+/* Stops counting and stores the totals in a result; without counters the
+ * totals are all NaN.
+ */
+void StopCounters(const Options& options, Result& result) {
+  if (options.counters != NULL) options.counters->stop();
+  for (size_t i = 0; i < PerfCounters::kNumEvents; ++i)
+    result.events[i] = options.counters != NULL ? options.counters->value(PerfCounters::Event(i)) : nan("");
+}
+
+/* Times a single call of a function, in nanoseconds. */
+template <typename Function>
+double TimeNanoseconds(Function fn) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  fn();
+  return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+/* Returns a point drawn uniformly from the unit cube. */
+template <size_t N>
+Point<N> UniformPoint(mt19937_64& generator) {
+  uniform_real_distribution<double> coordinate(0.0, 1.0);
+  Point<N> result;
+  for (size_t i = 0; i < N; ++i)
+    result[i] = coordinate(generator);
+  return result;
+}
+
+/* Generates count points from the named distribution.  The same seed always
+ * gives the same points, so that runs are comparable.
+ */
+template <size_t N>
+vector< Point<N> > GeneratePoints(const string& dataset, size_t count, unsigned seed) {
+  mt19937_64 generator(seed);
+  vector< Point<N> > points;
+  points.reserve(count);
+
+  if (dataset == "uniform" || dataset == "sorted") {
+    for (size_t i = 0; i < count; ++i)
+      points.push_back(UniformPoint<N>(generator));
+    if (dataset == "sorted")
+      sort(points.begin(), points.end(), [](const Point<N>& one, const Point<N>& two) {
+        return lexicographical_compare(one.begin(), one.end(), two.begin(), two.end());
+      });
+  } else if (dataset == "clustered") {
+    vector< Point<N> > centers;
+    for (size_t i = 0; i < kNumClusters; ++i)
+      centers.push_back(UniformPoint<N>(generator));
+    normal_distribution<double> offset(0.0, kClusterSpread);
+    for (size_t i = 0; i < count; ++i) {
+      Point<N> pt = centers[generator() % centers.size()];
+      for (size_t j = 0; j < N; ++j)
+        pt[j] += offset(generator);
+      points.push_back(pt);
+    }
+  } else if (dataset == "duplicates") {
+    vector< Point<N> > distinct;
+    for (size_t i = 0; i < max(size_t(1), count / kCopiesPerPoint); ++i)
+      distinct.push_back(UniformPoint<N>(generator));
+    for (size_t i = 0; i < count; ++i)
+      points.push_back(distinct[generator() % distinct.size()]);
+  } else {
+    throw invalid_argument("Unknown dataset " + dataset);
+  }
+  return points;
+}
+
+/* Reports a result on standard error as soon as it is measured. */
+void ReportProgress(const Result& result) {
+  cerr << setw(10) << left << result.dataset << " N=" << setw(4) << result.dimension
+       << " size=" << setw(9) << result.size << ' ' << setw(9) << result.operation;
+  if (result.k != 0) cerr << " k=" << setw(3) << result.k;
+  else cerr << "      ";
+  cerr << right << fixed << setprecision(1) << setw(12)
+       << (result.count == 0 ? 0.0 : result.seconds * 1e9 / result.count) << " ns/op";
+  if (!std::isnan(result.p50))
+    cerr << "  p50 " << setw(10) << result.p50 << "  p99 " << setw(10) << result.p99;
+  if (!std::isnan(result.events[PerfCounters::kCycles]) && result.count != 0)
+    cerr << "  " << setw(10) << result.events[PerfCounters::kCycles] / result.count << " cycles/op";
+  cerr << endl;
+}
+
+/* Runs every measurement for one dataset, dimension and size. */
+template <size_t N>
+void BenchmarkConfiguration(const Options& options, const string& dataset, size_t size,
+                            vector<Result>& results) {
+  vector< Point<N> > points = GeneratePoints<N>(dataset, size, 137);
+  vector< pair<Point<N>, size_t> > elems;
+  elems.reserve(size);
+  for (size_t i = 0; i < points.size(); ++i)
+    elems.push_back(make_pair(points[i], i));
+
+  Result base = { dataset, N, size, "", 0, 0, 0.0, nan(""), nan(""), {} };
+  size_t checksum = 0;
+
+  /* Inserts, one at a time in dataset order. */
+  {
+    Result result = base;
+    result.operation = "insert";
+    LatencyRecorder recorder(options.budget * kInsertBudgetFactor);
+    KDTree<N, size_t> inserted;
+    StartCounters(options);
+    for (size_t i = 0; i < elems.size() && !recorder.outOfTime(); ++i)
+      recorder.add(TimeNanoseconds([&]() { inserted.insert(elems[i].first, elems[i].second); }));
+    StopCounters(options, result);
+    recorder.finish(result);
+    results.push_back(result);
+    ReportProgress(result);
+  }
+
+  /* Bulk build and copy aren't split into items, so only their totals count. */
+  KDTree<N, size_t> kd;
+  {
+    Result result = base;
+    result.operation = "build";
+    result.count = size;
+    StartCounters(options);
+    result.seconds = TimeNanoseconds([&]() { kd.build(elems, options.layout); }) / 1e9;
+    StopCounters(options, result);
+    results.push_back(result);
+    ReportProgress(result);
+  }
+  {
+    Result result = base;
+    result.operation = "copy";
+    result.count = kd.size();
+    StartCounters(options);
+    result.seconds = TimeNanoseconds([&]() { KDTree<N, size_t> copy = kd; checksum += copy.size(); }) / 1e9;
+    StopCounters(options, result);
+    results.push_back(result);
+    ReportProgress(result);
+  }
+
+  /* Lookups mix points from the tree with fresh ones; searches use fresh
+   * points from the same distribution, in random order.
+   */
+  mt19937_64 generator(1001);
+  vector< Point<N> > fresh = GeneratePoints<N>(dataset == "sorted" ? "uniform" : dataset, options.numQueries, 7919);
+  vector< Point<N> > lookups, hits;
+  for (size_t i = 0; i < options.numQueries; ++i) {
+    lookups.push_back(i % 2 == 0 ? points[generator() % points.size()] : fresh[i]);
+    hits.push_back(points[generator() % points.size()]);
+  }
+
+  {
+    Result result = base;
+    result.operation = "contains";
+    LatencyRecorder recorder(options.budget);
+    StartCounters(options);
+    for (size_t i = 0; i < lookups.size() && !recorder.outOfTime(); ++i)
+      recorder.add(TimeNanoseconds([&]() { checksum += kd.contains(lookups[i]); }));
+    StopCounters(options, result);
+    recorder.finish(result);
+    results.push_back(result);
+    ReportProgress(result);
+  }
+  {
+    Result result = base;
+    result.operation = "at";
+    LatencyRecorder recorder(options.budget);
+    StartCounters(options);
+    for (size_t i = 0; i < hits.size() && !recorder.outOfTime(); ++i)
+      recorder.add(TimeNanoseconds([&]() { checksum += kd.at(hits[i]); }));
+    StopCounters(options, result);
+    recorder.finish(result);
+    results.push_back(result);
+    ReportProgress(result);
+  }
+  for (size_t j = 0; j < sizeof(kKValues) / sizeof(kKValues[0]); ++j) {
+    Result result = base;
+    result.operation = "kNNValue";
+    result.k = kKValues[j];
+    LatencyRecorder recorder(options.budget);
+    StartCounters(options);
+    for (size_t i = 0; i < fresh.size() && !recorder.outOfTime(); ++i)
+      recorder.add(TimeNanoseconds([&]() { checksum += kd.kNNValue(fresh[i], result.k); }));
+    StopCounters(options, result);
+    recorder.finish(result);
+    results.push_back(result);
+    ReportProgress(result);
+  }
+
+  /* Keeps the compiler from discarding the work. */
+  if (checksum == size_t(-1)) cerr << "checksum " << checksum << endl;
+}
+
+/* Runs every requested dataset and size at one dimension, skipping sizes
+ * whose points, elements, tree and copy wouldn't fit in the memory limit.
+ */
+template <size_t N>
+void BenchmarkDimension(const Options& options, vector<Result>& results) {
+  if (find(options.dimensions.begin(), options.dimensions.end(), N) == options.dimensions.end())
+    return;
+
+  const double bytesPerPoint = 4.0 * (sizeof(Point<N>) + 3 * sizeof(size_t) + 2 * sizeof(void*));
+  for (size_t d = 0; d < options.datasets.size(); ++d) {
+    for (size_t s = 0; s < options.sizes.size(); ++s) {
+      size_t size = options.sizes[s];
+      if (bytesPerPoint * size > options.memoryLimit * 1048576.0) {
+        cerr << "Skipping " << options.datasets[d] << " N=" << N << " size=" << size
+             << ": over the memory limit" << endl;
+        continue;
+      }
+      BenchmarkConfiguration<N>(options, options.datasets[d], size, results);
+    }
+  }
+}
+
+/* Writes an event count per operation, leaving it blank or null if the
+ * event wasn't counted.
+ */
+string FormatPerOperation(double total, size_t count, const string& missing) {
+  if (std::isnan(total) || count == 0) return missing;
+  ostringstream out;
+  out << fixed << setprecision(3) << total / count;
+  return out.str();
+}
+
+/* Writes a latency, leaving it blank (CSV) or null (JSON) if missing. */
+string FormatLatency(double nanoseconds, const string& missing) {
+  if (std::isnan(nanoseconds)) return missing;
+  ostringstream out;
+  out << fixed << setprecision(1) << nanoseconds;
+  return out.str();
+}
+
+/* Writes the results in the requested format. */
+void WriteResults(const Options& options, const vector<Result>& results, ostream& out) {
+  vector<string> columns = { "dataset", "dimension", "size", "layout", "prefetch_distance", "operation", "k",
+                             "count", "total_seconds", "ops_per_second", "mean_ns", "p50_ns", "p99_ns" };
+  for (size_t e = 0; e < PerfCounters::kNumEvents; ++e)
+    columns.push_back(string(PerfCounters::name(PerfCounters::Event(e))) + "_per_op");
+  const size_t numColumns = columns.size();
+
+  bool json = options.format == "json";
+  if (json) out << "[\n";
+  else {
+    for (size_t c = 0; c < numColumns; ++c)
+      out << (c == 0 ? "" : ",") << columns[c];
+    out << "\n";
+  }
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& result = results[i];
+    double perSecond = result.seconds > 0 ? result.count / result.seconds : 0.0;
+    double mean = result.count > 0 ? result.seconds * 1e9 / result.count : 0.0;
+
+    ostringstream number;
+    number << fixed << setprecision(6) << result.seconds << ' ' << setprecision(1) << perSecond << ' ' << mean;
+    string seconds, rate, meanText;
+    istringstream(number.str()) >> seconds >> rate >> meanText;
+
+    string quote = json ? "\"" : "";
+    string missing = json ? "null" : "";
+    vector<string> values = {
+      quote + result.dataset + quote, to_string(result.dimension), to_string(result.size),
+      quote + options.layoutName + quote, to_string(KDTREE_PREFETCH_DISTANCE),
+      quote + result.operation + quote, to_string(result.k), to_string(result.count),
+      seconds, rate, meanText, FormatLatency(result.p50, missing), FormatLatency(result.p99, missing)
+    };
+    for (size_t e = 0; e < PerfCounters::kNumEvents; ++e)
+      values.push_back(FormatPerOperation(result.events[e], result.count, missing));
+
+    if (json) out << "  {";
+    for (size_t c = 0; c < numColumns; ++c) {
+      if (c != 0) out << (json ? ", " : ",");
+      if (json) out << "\"" << columns[c] << "\": ";
+      out << values[c];
+    }
+    if (json) out << (i + 1 == results.size() ? "}" : "},");
+    out << "\n";
+  }
+  if (json) out << "]\n";
+}
+
+/* Splits a comma-separated list. */
+vector<string> SplitList(const string& text) {
+  vector<string> items;
+  istringstream in(text);
+  string item;
+  while (getline(in, item, ','))
+    if (!item.empty()) items.push_back(item);
+  return items;
+}
+
+vector<size_t> SplitNumbers(const string& text) {
+  vector<string> items = SplitList(text);
+  vector<size_t> numbers;
+  for (size_t i = 0; i < items.size(); ++i)
+    numbers.push_back(size_t(atof(items[i].c_str())));
+  return numbers;
+}
+
+/* Parses the command line, throwing invalid_argument on anything unknown. */
+Options ParseOptions(int argc, char* argv[]) {
+  Options options;
+  options.datasets.assign(kDefaultDatasets, kDefaultDatasets + sizeof(kDefaultDatasets) / sizeof(kDefaultDatasets[0]));
+  options.dimensions.assign(kDefaultDimensions, kDefaultDimensions + sizeof(kDefaultDimensions) / sizeof(kDefaultDimensions[0]));
+  options.sizes.assign(kDefaultSizes, kDefaultSizes + sizeof(kDefaultSizes) / sizeof(kDefaultSizes[0]));
+  options.numQueries = kDefaultNumQueries;
+  options.budget = kDefaultBudget;
+  options.memoryLimit = kDefaultMemoryLimit;
+  options.layout = kKDTreeVanEmdeBoasOrder;
+  options.layoutName = "veb";
+  options.format = "csv";
+  options.counters = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    size_t equals = arg.find('=');
+    string name = arg.substr(0, equals);
+    string value = equals == string::npos ? "" : arg.substr(equals + 1);
+
+    if (name == "--datasets") options.datasets = SplitList(value);
+    else if (name == "--dims") options.dimensions = SplitNumbers(value);
+    else if (name == "--sizes") options.sizes = SplitNumbers(value);
+    else if (name == "--queries") options.numQueries = size_t(atof(value.c_str()));
+    else if (name == "--budget") options.budget = atof(value.c_str());
+    else if (name == "--memory-limit") options.memoryLimit = size_t(atof(value.c_str()));
+    else if (name == "--format" && (value == "csv" || value == "json")) options.format = value;
+    else if (name == "--output") options.output = value;
+    else if (name == "--counters" && value.empty()) options.counters = new PerfCounters;
+    else if (name == "--layout" && value == "veb") options.layout = kKDTreeVanEmdeBoasOrder;
+    else if (name == "--layout" && value == "bfs") options.layout = kKDTreeBreadthFirstOrder;
+    else if (name == "--layout" && value == "allocation") options.layout = kKDTreeAllocationOrder;
+    else throw invalid_argument("Unrecognized option " + arg);
+
+    if (name == "--layout") options.layoutName = value;
+  }
+  for (size_t i = 0; i < options.dimensions.size(); ++i) {
+    if (find(kDefaultDimensions, kDefaultDimensions + sizeof(kDefaultDimensions) / sizeof(kDefaultDimensions[0]),
+             options.dimensions[i]) == kDefaultDimensions + sizeof(kDefaultDimensions) / sizeof(kDefaultDimensions[0]))
+      throw invalid_argument("Dimension " + to_string(options.dimensions[i]) + " isn't compiled in");
+  }
+  if (options.numQueries == 0) options.numQueries = 1;
+  return options;
+}
+
+int main(int argc, char* argv[]) try {
+  Options options = ParseOptions(argc, argv);
+  if (options.counters != NULL && !options.counters->anyAvailable())
+    cerr << "Hardware counters are unavailable here; reporting timings only" << endl;
+
+  vector<Result> results;
+  BenchmarkDimension<1>(options, results);
+  BenchmarkDimension<2>(options, results);
+  BenchmarkDimension<3>(options, results);
+  BenchmarkDimension<16>(options, results);
+  BenchmarkDimension<784>(options, results);
+
+  if (options.output.empty()) {
+    WriteResults(options, results, cout);
+  } else {
+    ofstream out(options.output.c_str());
+    if (!out) throw runtime_error("Couldn't open " + options.output + " for writing");
+    WriteResults(options, results, out);
+  }
+  delete options.counters;
+  return 0;
+} catch (const exception& e) {
+  cerr << "benchmark-harness: " << e.what() << endl;
+  return 1;
+}
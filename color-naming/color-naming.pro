@@ -2,7 +2,7 @@
 # Project created by QtCreator 2010-05-16T13:21:00
 # -------------------------------------------------
 
-CONFIG = qt release properties
+CONFIG = qt release c++17 properties
 
 properties {
 TARGET = color-naming
@@ -12,5 +12,10 @@ SOURCES += main.cpp \
     ../KDTree.h
 HEADERS += mainwindow.h \
     ../KDTree.h \
-    ../BoundedPQueue.h
+    ../CompactKDTree.h \
+    ../MappedFile.h \
+    ../BoundedPQueue.h \
+    ../BinarySerialization.h \
+    ../WorkStealingPool.h \
+    ../Tracing.h
 }
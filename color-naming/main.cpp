@@ -14,5 +14,9 @@ int main(int argc, char *argv[])
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
-    return a.exec();
+    int result = a.exec();
+    
+    /* With tracing compiled in, save where the time went. */
+    KDTREE_TRACE_DUMP("kdtree-trace.json");
+    return result;
 }
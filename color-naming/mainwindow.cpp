@@ -19,7 +19,15 @@
 #include <sstream>
 using namespace std;
 
-/***** Module Helper Function *****/
+/***** Module Constants and Helper Function *****/
+
+/* The color data, and a snapshot of the tree built from it, written after the
+ * first successful load so that later runs can skip parsing colors.txt.  The
+ * snapshot records the fingerprint of the data it was built from and is
+ * rebuilt once the data changes.
+ */
+static const char kDataFile[] = "../../colors.txt";
+static const char kSnapshotFile[] = "../../colors.kdc";
 
 /* Utility function to convert an integer to a string. */
 static string IntegerToString(int val) {
@@ -33,9 +41,9 @@ static string IntegerToString(int val) {
 /* Loads the color data from disk into the out parameter.  This function
  * returns a boolean indicating whether it succeeded.
  */
-bool MainWindow::LoadingThread::loadDataSet(KDTree<3, string>& kd) {
+bool MainWindow::LoadingThread::loadDataSet(CompactKDTree<3, uint8_t, string>& kd) {
   /* Open the file; fail if we can't. */
-  ifstream input("../../colors.txt", ios::binary);
+  ifstream input(kDataFile, ios::binary);
   if (!input) return false;
   
   /* Read how many entries there are and preallocate space for them. */
@@ -44,42 +52,53 @@ bool MainWindow::LoadingThread::loadDataSet(KDTree<3, string>& kd) {
   
   if(!input.ignore(1)) return false; // Skip the newline character.
   
+  vector< pair<CompactPoint<3, uint8_t>, string> > colors;
+  colors.reserve(count);
+  
   /* Keep reading data out of the file and parsing it to color data. */
   size_t read = 0;
-  while (true) {
-    /* Read RGB */
-    char colorBuffer[3];
-    input.read(colorBuffer, streamsize(3));
-    
-    /* Read name size. */
-    char bufferSize = input.get();
-    size_t toRead = (unsigned char)(bufferSize);
-    
-    /* Read name from file.  Note that because characters range from
-     * 0 - 255, we can't overrun this buffer.
-     */
-    char nameBuffer[256];
-    input.read(nameBuffer, streamsize(toRead));
-    
-    /* Transform from a char array to a point. */
-    Point<3> pt;
-    pt[0] = (unsigned char)(colorBuffer[0]);
-    pt[1] = (unsigned char)(colorBuffer[1]);
-    pt[2] = (unsigned char)(colorBuffer[2]);
-    
-    /* Check for stream integrity. */
-    if (!input) break;
-    
-    /* Add to the data set. */
-    kd.insert(pt, string(nameBuffer, nameBuffer + toRead));
-    
-    /* Keep the GUI informed of what's going on. */
-    if (++read % 10000 == 0)
-      emit onDataLoaded(read);
+  {
+    KDTREE_TRACE_SPAN("Parse color data");
+    while (true) {
+      /* Read RGB */
+      char colorBuffer[3];
+      input.read(colorBuffer, streamsize(3));
+      
+      /* Read name size. */
+      char bufferSize = input.get();
+      size_t toRead = (unsigned char)(bufferSize);
+      
+      /* Read name from file.  Note that because characters range from
+       * 0 - 255, we can't overrun this buffer.
+       */
+      char nameBuffer[256];
+      input.read(nameBuffer, streamsize(toRead));
+      
+      /* Transform from a char array to a point. */
+      CompactPoint<3, uint8_t> pt;
+      pt[0] = (unsigned char)(colorBuffer[0]);
+      pt[1] = (unsigned char)(colorBuffer[1]);
+      pt[2] = (unsigned char)(colorBuffer[2]);
+      
+      /* Check for stream integrity. */
+      if (!input) break;
+      
+      /* Add to the data set. */
+      colors.push_back(make_pair(pt, string(nameBuffer, nameBuffer + toRead)));
+      
+      /* Keep the GUI informed of what's going on. */
+      if (++read % 10000 == 0)
+        emit onDataLoaded(read);
+    }
   }
   
-  /* Ensure we read enough. */
-  return read == count;
+  /* Ensure we read enough, then build the tree. */
+  if (read != count) return false;
+  {
+    KDTREE_TRACE_SPAN("Build color tree");
+    kd.build(move(colors));
+  }
+  return true;
 }
 
 /* LoadingThread constructor just stores a pointer back to the main
@@ -93,12 +112,33 @@ MainWindow::LoadingThread::LoadingThread(MainWindow* master) : master(master) {
  * then stores the result back in the master object.
  */
 void MainWindow::LoadingThread::run() {
+  KDTREE_TRACE_THREAD_NAME("Loading thread");
+  KDTREE_TRACE_SPAN("Load color data");
+  
+  /* Use the prebuilt snapshot if there is one and the data hasn't changed. */
+  uint64_t fingerprint = 0;
+  try {
+    fingerprint = FileFingerprint(kDataFile);
+    master->lookup.load(kSnapshotFile, fingerprint);
+    emit onDoneIndexing();
+    return;
+  } catch (const runtime_error&) {
+    // Fall through and parse the color data.
+  }
+  
   /* Load in the color data from the file. */
-  if (!loadDataSet(master->lookup)) {
+  bool loaded = loadDataSet(master->lookup);
+  if (!loaded) {
     QMessageBox::critical(0, tr("An error occurred loading color data.  This program will now exit"), tr("Color Lookup"));
     QCoreApplication::quit();
     return;
   }
+  
+  /* Cache the tree for next time.  Failure here isn't fatal. */
+  try {
+    master->lookup.save(kSnapshotFile, fingerprint);
+  } catch (const runtime_error&) {}
+  
   emit onDoneIndexing();
 }
 
@@ -144,8 +184,10 @@ void MainWindow::handleColorChange(const QColor& c) {
   if (!loadingThread->isFinished())
     return;
   
-  /* Convert the color from a QColor to a std::vector. */
-  Point<3> colorVector;
+  KDTREE_TRACE_SPAN("Name selected color");
+  
+  /* Convert the color from a QColor to a point. */
+  CompactPoint<3, uint8_t> colorVector;
   colorVector[0] = c.red();
   colorVector[1] = c.green();
   colorVector[2] = c.blue();
@@ -13,7 +13,8 @@
 
 #include <QtGui/QMainWindow>
 #include <QColorDialog>
-#include "../KDTree.h"
+#include "../CompactKDTree.h"
+#include "../MappedFile.h"
 #include <QThread>
 #include <string>
 using namespace std;
@@ -36,8 +37,8 @@ private:
    */
   QColorDialog* colorChooser;
   
-  /* The kd-tree used for k-NN lookup. */
-  KDTree<3, string> lookup;
+  /* The kd-tree used for k-NN lookup, keyed on the RGB bytes. */
+  CompactKDTree<3, uint8_t, string> lookup;
   
   /* A thread class responsible for loading data in parallel with the GUI.  This
    * keeps the GUI responsive even when a huge amount of data is being loaded.
@@ -72,7 +73,7 @@ public:
   virtual void run();
   
 private:
-  bool loadDataSet(KDTree<3, string>& dataSet);
+  bool loadDataSet(CompactKDTree<3, uint8_t, string>& dataSet);
   MainWindow* const master;
   
 signals:
@@ -1,7 +1,7 @@
 # -------------------------------------------------
 # Project created by QtCreator 2010-05-16T20:51:29
 # -------------------------------------------------
-CONFIG = qt release properties
+CONFIG = qt release c++17 properties
 
 properties {
 TARGET = digit-classifier
@@ -15,6 +15,12 @@ HEADERS += mainwindow.h \
     CanvasWidget.h \
     grid.h \
     ../KDTree.h \
+    ../LazyKDTree.h \
+    ../IdxFile.h \
+    ../MappedFile.h \
     ../BoundedPQueue.h \
+    ../BinarySerialization.h \
+    ../WorkStealingPool.h \
+    ../Tracing.h \
     autounlock.h
 }
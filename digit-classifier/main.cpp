@@ -18,5 +18,7 @@ int main(int argc, char *argv[]) {
     result = a.exec();
   }
   
+  /* With tracing compiled in, save where the time went. */
+  KDTREE_TRACE_DUMP("kdtree-trace.json");
   return result;
 }
@@ -22,6 +22,18 @@
 
 /***** Module Constants and Functions *****/
 
+/* The MNIST files, and a snapshot of the tree built from them, written after
+ * the first successful load so that later runs can skip parsing them.  The
+ * snapshot records the fingerprints of both files and is rebuilt once either
+ * of them changes.
+ */
+static const char kImagesFile[] = "../../training-images";
+static const char kLabelsFile[] = "../../training-labels";
+static const char kSnapshotFile[] = "../../training.kdl";
+
+/* How many images the loader converts in each task. */
+static const size_t kImagesPerChunk = 1000;
+
 /* Utility function to convert from ints to strings. */
 static string IntegerToString(int val) {
   stringstream converter;
@@ -285,87 +297,65 @@ void MainWindow::onProcessingResult(int result) {
 
 /************************** LoadingThread Implementation ***************************/
 
-/* Loads all of the image examples from disk. */
-bool MainWindow::LoadingThread::loadDataSet(KDTree<kImageSize, unsigned char>& kd) try {
-  /* These next lines tell the stream to generate exceptions on failure.
-   * This greatly simplifies processing.
-   */
-  ifstream images; // Image file
-  images.exceptions(ios::failbit | ios::badbit);
-  images.open("../../training-images", ios::binary);
-  
-  ifstream labels; // Labels for those images
-  labels.exceptions(ios::failbit | ios::badbit);
-  labels.open("../../training-labels", ios::binary);
-  
-  /* Each file begins with a "magic number" identifying the file.
-   * These numbers are stored as raw bytes in low-endian form.
-   * These next few lines read the data from the file and confirm
-   * that the values are what we'd expect them to be.
-   */
-  char buffer[4];
-  images.read(buffer, 4);
+/* Converts one image to a point.  Pixels range from 0 - 255; any ink at all
+ * becomes +1 and blank paper -1, to match the canvas.  The loop has no
+ * branches or calls, and __restrict tells the compiler the two arrays don't
+ * overlap, so it is vectorized even at -O2.
+ */
+static void ConvertPixels(const unsigned char* __restrict pixels, double* __restrict coords) {
+  for (size_t j = 0; j < kImageSize; ++j)
+    coords[j] = (pixels[j] != 0 ? 1.0 : -1.0);
+}
+
+/* Converts images [begin, end) and their labels to examples. */
+static void ConvertImages(const IdxFile& images, const IdxFile& labels, size_t begin, size_t end,
+                          vector< pair<Point<kImageSize>, unsigned char> >& examples) {
+  for (size_t i = begin; i < end; ++i) {
+    ConvertPixels(images.record(i), examples[i].first.begin());
+    examples[i].second = *labels.record(i);
+  }
+}
+
+/* Loads all of the image examples from disk.  Both files are mapped into
+ * memory and their headers checked, then blocks of images are converted on
+ * every core straight into the array the tree is built from.
+ */
+bool MainWindow::LoadingThread::loadDataSet(LazyKDTree<kImageSize, unsigned char>& kd) try {
+  IdxFile images(kImagesFile);
+  IdxFile labels(kLabelsFile);
   
-  /* memcmp is a function which compares raw memory and returns an integer
-   * based on their lexicographical ordering.  In particular, it should
-   * return zero if the values match.
+  /* The images must be a count of 28 x 28 bytes, with one byte-sized label
+   * for each of them.
    */
-  if (memcmp(buffer, "\x00\x00\x08\x03", 4) != 0)
+  const vector<size_t>& imageDims = images.dimensions();
+  if (images.dataType() != kIdxUnsignedByte || imageDims.size() != 3 ||
+      imageDims[1] != kImageDimension || imageDims[2] != kImageDimension)
     return false;
-  
-  /* Now read how many images there are.  This also requires some memory hackery
-   * because the integer is stored in low-endian format and we need to reconstruct
-   * it.
-   */
-  images.read(buffer, 4);
-  size_t numImages = ((unsigned char)buffer[0] << 24) +
-                     ((unsigned char)buffer[1] << 16) +
-                     ((unsigned char)buffer[2] <<  8) +
-                      (unsigned char)buffer[3];
-
-  /* Read the image dimensions.  We really don't care about these, so we just
-   * skip them.
-   */
-  images.ignore(streamsize(8));
-  
-  /* Now repeat this process for the labels file. */
-  labels.read(buffer, 4);
-  if (memcmp(buffer, "\x00\x00\x08\x01", 4) != 0)
+  if (labels.dataType() != kIdxUnsignedByte || labels.dimensions().size() != 1 ||
+      labels.count() != images.count())
     return false;
   
-  labels.read(buffer, 4);
-  size_t numLabels = ((unsigned char)buffer[0] << 24) +
-                     ((unsigned char)buffer[1] << 16) +
-                     ((unsigned char)buffer[2] <<  8) +
-                      (unsigned char)buffer[3];
-
-  /* Confirm that we have the same number of images as labels. */
-  if (numLabels != numImages) return false;
-  
-  
-  /* Read all images. */
-  for (size_t i = 0; i < numLabels; ++i) {
-    /* Images are stored as byte arrays ranging from 0 - 255.  We'll
-     * read the whole image in and then convert it to binary white/black
-     * to match our input format.
-     */
-    char buffer[kImageSize];
-    images.read(buffer, kImageSize);
-    
-    /* Convert from 0 - 255 to -1 - +1 */
-    Point<kImageSize> pt;
-    for (size_t j = 0; j < kImageSize; ++j)
-      pt[j] = (buffer[j] > 0 ? 1.0 : -1.0);
-    
-    /* Read label */
-    char byte;
-    labels.get(byte);
-    
-    kd.insert(pt, (unsigned char)byte);
-    
-    /* Keep the GUI informed about what's going on. */
-    if (i % 1000 == 0)
-      emit onDataLoaded(i);
+  /* Convert all images. */
+  size_t numImages = images.count();
+  vector< pair<Point<kImageSize>, unsigned char> > examples(numImages);
+  {
+    KDTREE_TRACE_SPAN("Convert training images");
+    WorkStealingPool pool;
+    WorkStealingPool::TaskGroup group;
+    for (size_t begin = 0; begin < numImages; begin += kImagesPerChunk) {
+      size_t end = min(begin + kImagesPerChunk, numImages);
+      pool.submit(group, [&images, &labels, &examples, begin, end]() {
+        ConvertImages(images, labels, begin, end, examples);
+      });
+    }
+    pool.wait(group);
+  }
+  emit onDataLoaded(numImages);
+  
+  /* Build the top of the tree; queries split the rest as they need it. */
+  {
+    KDTREE_TRACE_SPAN("Build training tree");
+    kd.build(move(examples));
   }
   return true;
 } catch (const exception&) {
@@ -381,13 +371,33 @@ MainWindow::LoadingThread::LoadingThread(MainWindow* master) : master(master) {
 
 /* Main thread routine loads data and builds it into a KD tree. */
 void MainWindow::LoadingThread::run() {
+  KDTREE_TRACE_THREAD_NAME("Loading thread");
+  KDTREE_TRACE_SPAN("Load training data");
+  
+  /* Use the prebuilt snapshot if there is one and the data hasn't changed. */
+  uint64_t fingerprint = 0;
+  try {
+    fingerprint = FileFingerprint(kImagesFile) * 31 + FileFingerprint(kLabelsFile);
+    master->lookup.load(kSnapshotFile, fingerprint);
+    emit onDoneIndexing();
+    return;
+  } catch (const runtime_error&) {
+    // Fall through and parse the training data.
+  }
+  
   /* Load in the color data from the file. */
-  if (!loadDataSet(master->lookup)) {
+  bool loaded = loadDataSet(master->lookup);
+  if (!loaded) {
     QMessageBox::critical(0, tr("An error occurred loading color data.  This program will now exit"), tr("Color Lookup"));
     QCoreApplication::quit();
     return;
   }
   
+  /* Cache the tree for next time.  Failure here isn't fatal. */
+  try {
+    master->lookup.save(kSnapshotFile, fingerprint);
+  } catch (const runtime_error&) {}
+  
   /* Success! */
   emit onDoneIndexing();
 }
@@ -401,6 +411,7 @@ MainWindow::WorkerThread::WorkerThread(MainWindow* master) : master(master) {
 
 /* Thread routine continuously waits for data to be ready, then processes it. */
 void MainWindow::WorkerThread::run() {
+  KDTREE_TRACE_THREAD_NAME("Classifier thread");
   while (true) {
     /* Wait for the queue to be ready. */
     master->queueReady.acquire();
@@ -423,6 +434,7 @@ void MainWindow::WorkerThread::run() {
     if (!master->loader->isFinished()) continue;
     
     emit onStartProcessing();
+    KDTREE_TRACE_SPAN("Classify drawing");
     
     /* Otherwise, ask the KD tree what this is... */
     emit onProcessingResult(master->lookup.kNNValue(dataPoint, 4));
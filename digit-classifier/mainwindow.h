@@ -17,7 +17,8 @@
 #include <QSemaphore>
 #include <queue>
 #include "CanvasWidget.h"
-#include "../KDTree.h"
+#include "../LazyKDTree.h"
+#include "../IdxFile.h"
 
 /* Constant: kImageDimension
  * Value: The size of one side of an image.
@@ -55,7 +56,7 @@ private:
   WorkerThread*  worker; // The instance of the worker thread.
   LoadingThread* loader; // The instance of the loading thread.
   
-  KDTree<kImageSize, unsigned char> lookup; // KDTree used for classification.
+  LazyKDTree<kImageSize, unsigned char> lookup; // Tree used for classification.
   
   queue< Point<kImageSize> > analysisQueue;    // List of images to classify.
 
@@ -80,7 +81,7 @@ public:
   virtual void run();
 
 private:
-  bool loadDataSet(KDTree<kImageSize, unsigned char>& kd);
+  bool loadDataSet(LazyKDTree<kImageSize, unsigned char>& kd);
     
   MainWindow* const master;
   
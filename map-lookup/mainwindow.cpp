@@ -11,6 +11,7 @@
 #include <stdexcept>
 #include <iostream>
 #include <vector>
+#include <iterator>
 #include <cmath>
 #include <numeric>
 #include <fstream>
@@ -30,6 +31,14 @@ static const int kImageWidth  = 1024;
 
 static const double kPi = 3.14159265358979323; // Pi,  used in coordinate transforms
 
+/* The place data, and a snapshot of the tree built from it, written after the
+ * first successful load so that later runs can skip parsing place-data.txt.
+ * The snapshot records the fingerprint of the data it was built from and is
+ * rebuilt once the data changes.
+ */
+static const char kDataFile[] = "../../place-data.txt";
+static const char kSnapshotFile[] = "../../place-data.kdl";
+
 /* Converts a click from a point in a window to a point in the unit box. */
 static Point<2> GetNormalizedClickLocation(const QPoint& where) {
   /* Normalize everything into [-1, 1] x [-1, 1] */
@@ -138,6 +147,7 @@ void MainWindow::onMapClick(const QPoint& where) {
     return;
   
   /* Convert from a point in the unit circle to a longitude and latitude. */
+  KDTREE_TRACE_SPAN("Look up clicked location");
   InvertMollwideProjection(location);
   
   /* Report the nearest neighbor. */
@@ -182,39 +192,82 @@ bool MainWindow::LoadingThread::loadGeoCodes(map<string, string>& geoLookup) {
   return true;
 }
 
-/* Loads all of the locations and their designations. */
-bool MainWindow::LoadingThread::loadGeographicData(KDTree<2, string>& kd) {
+/* Parses one chunk of place-data.txt, each line holding a latitude, a
+ * longitude and a label.  Runs on the ingestion pipeline's parser threads.
+ */
+static void ParsePlaceData(const string& chunk, IngestionPipeline<2, string>::Batch& places) {
+  ParseTextRecords(chunk.data(), chunk.data() + chunk.size(), places);
+}
+
+/* Loads all of the locations and their designations.  The file is mapped
+ * into memory and cut into chunks at line breaks, and a parser thread per
+ * core parses them while this thread gathers the parsed places.
+ */
+bool MainWindow::LoadingThread::loadGeographicData(InternedKDTree<2, string, LazyKDTree>& kd) try {
+  typedef IngestionPipeline<2, string> Pipeline;
+
   /* Load geographic data. */
-  ifstream input("../../place-data.txt");
-  if (!input) return false;
+  MappedFile file(kDataFile);
+  const char* pos = file.data();
+  const char* end = pos + file.size();
   
   /* Figure out how many there are and preallocate space for them. */
-  size_t totalNumber;
-  if(!(input >> totalNumber)) return false;
+  size_t totalNumber = ParseRecordCount(pos, end);
   
+  Pipeline::Batch places;
+  places.reserve(totalNumber);
+
   /* Load all data. */
-  size_t count = 0;
-  Point<2> pt;
-  string label;
-
-  while (input >> pt[0] >> pt[1] >> label) {
-    kd.insert(pt, label);
-    if (++count % 10000 == 0)
-      emit onLoadData(count);
+  {
+    KDTREE_TRACE_SPAN("Parse place data");
+    Pipeline().run(MappedChunkReader(pos, end), ParsePlaceData, [&](Pipeline::Batch& batch) {
+      size_t oldCount = places.size();
+      places.insert(places.end(), make_move_iterator(batch.begin()), make_move_iterator(batch.end()));
+      if (oldCount / 10000 != places.size() / 10000)
+        emit onLoadData(places.size());
+    });
   }
   
-  /* Succeed if we read enough. */
-  return count == totalNumber;
+  /* Succeed if we read enough.  Only the top of the tree is built here;
+   * the rest is split as lookups reach it.
+   */
+  if (places.size() != totalNumber) return false;
+  {
+    KDTREE_TRACE_SPAN("Build place tree");
+    kd.build(places);
+  }
+  return true;
+} catch (const runtime_error&) {
+  return false;
 }
 
 void MainWindow::LoadingThread::run() try {
+  KDTREE_TRACE_THREAD_NAME("Loading thread");
+  KDTREE_TRACE_SPAN("Load map data");
+  
   /* Load in the mapping from FIPS 10-4 codes to actual places. */
-  if (!loadGeoCodes(master->geoLookup))
-    throw runtime_error("Couldn't load FIPS codes.");
+  {
+    KDTREE_TRACE_SPAN("Parse FIPS codes");
+    if (!loadGeoCodes(master->geoLookup))
+      throw runtime_error("Couldn't load FIPS codes.");
+  }
   
-  /* Load the geographic data */
-  if (!loadGeographicData(master->kd))
-    throw runtime_error("Couldn't load geographic data.");
+  /* Load the geographic data, preferring the prebuilt snapshot if there is one
+   * and the data hasn't changed.
+   */
+  uint64_t fingerprint = 0;
+  try {
+    fingerprint = FileFingerprint(kDataFile);
+    master->kd.load(kSnapshotFile, fingerprint);
+  } catch (const runtime_error&) {
+    if (!loadGeographicData(master->kd))
+      throw runtime_error("Couldn't load geographic data.");
+    
+    /* Failing to cache the tree isn't fatal; we'll just rebuild next time. */
+    try {
+      master->kd.save(kSnapshotFile, fingerprint);
+    } catch (const runtime_error&) {}
+  }
 
   /* Report success! */
   emit onDoneIndexing();
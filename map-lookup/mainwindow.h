@@ -13,7 +13,11 @@
 #include <QThread>
 #include <string>
 #include <map>
-#include "../KDTree.h"
+#include "../LazyKDTree.h"
+#include "../InternedKDTree.h"
+#include "../IngestionPipeline.h"
+#include "../TextRecordParser.h"
+#include "../MappedFile.h"
 using namespace std;
 
 /* Forward-declare the class responsible for displaying the world map. */
@@ -28,7 +32,7 @@ public:
   
 private:
   PictureDisplay* worldMapPic;   // The widget that draws the earth.
-  KDTree<2, string> kd;          // The kd-tree that does 1-NN lookup.
+  InternedKDTree<2, string, LazyKDTree> kd; // 1-NN lookup; stores each FIPS code once.
   map<string, string> geoLookup; // Mapping from FIPS 10-4 codes to place names
 
   class LoadingThread;           // Thread that does loading off the main GUI loop.
@@ -57,7 +61,7 @@ signals:
   void onDoneIndexing();
   
 private:
-  bool loadGeographicData(KDTree<2, string>& kd);
+  bool loadGeographicData(InternedKDTree<2, string, LazyKDTree>& kd);
   bool loadGeoCodes(map<string, string>& geoLookup);
   
   MainWindow* const master;
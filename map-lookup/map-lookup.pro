@@ -2,7 +2,7 @@
 # Project created by QtCreator 2010-05-16T13:21:00
 # -------------------------------------------------
 
-CONFIG = qt release properties
+CONFIG = qt release c++17 properties
 
 properties {
 TARGET = map-lookup
@@ -12,5 +12,14 @@ SOURCES += main.cpp \
     ../KDTree.h
 HEADERS += mainwindow.h \
     ../KDTree.h \
-    ../BoundedPQueue.h
+    ../LazyKDTree.h \
+    ../InternedKDTree.h \
+    ../ValueDictionary.h \
+    ../IngestionPipeline.h \
+    ../TextRecordParser.h \
+    ../MappedFile.h \
+    ../BoundedPQueue.h \
+    ../BinarySerialization.h \
+    ../WorkStealingPool.h \
+    ../Tracing.h
 }
@@ -18,7 +18,24 @@
 #include <iomanip>
 #include <cstdarg>
 #include <set>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
 #include "../KDTree.h"
+#include "../KDTreeView.h"
+#include "../DynamicKDTree.h"
+#include "../SlidingWindowKDTree.h"
+#include "../LazyKDTree.h"
+#include "../IngestionPipeline.h"
+#include "../TextRecordParser.h"
+#include "../MappedFile.h"
+#include "../IdxFile.h"
+#include "../InternedKDTree.h"
+#include "../CompactKDTree.h"
+#include <atomic>
+#include <new>
+#include <fstream>
+#include <thread>
 using namespace std;
 
 /* These flags control which tests will be run.  Initially, only the
@@ -40,6 +57,86 @@ using namespace std;
 #define BasicCopyTestEnabled            1 // Step three checks
 #define ModerateCopyTestEnabled         1
 
+#define SnapshotTestEnabled             1 // Extension checks
+#define MappedViewTestEnabled           1
+#define BulkBuildTestEnabled            1
+#define ParallelQueryTestEnabled        1
+#define BatchQueryTestEnabled           1
+#define RelayoutTestEnabled             1
+#define QueryStatsTestEnabled           1
+#define ShapeStatsTestEnabled           1
+#define AllocationTestEnabled           1
+#define TracingTestEnabled              1
+#define DynamicTreeTestEnabled          1
+#define ScapegoatTestEnabled            1
+#define EraseTestEnabled                1
+#define SlidingWindowTestEnabled        1
+#define LazyTreeTestEnabled             1
+#define PipelineTestEnabled             1
+#define TextParserTestEnabled           1
+#define IdxFileTestEnabled              1
+#define InternedTreeTestEnabled         1
+#define OutOfLineValueTestEnabled       1
+#define CompactTreeTestEnabled          1
+
+/* Every allocation made through the global operator new is counted here, so
+ * that tests can check how much memory an operation allocates by comparing
+ * the counters before and after it.  The counters are atomic because some
+ * tests run work on a thread pool.
+ */
+static atomic<size_t> gAllocationCount(0);
+static atomic<size_t> gAllocationBytes(0);
+
+void* CountedAllocate(size_t numBytes) {
+  ++gAllocationCount;
+  gAllocationBytes += numBytes;
+  if (void* memory = malloc(numBytes == 0 ? 1 : numBytes)) return memory;
+  throw bad_alloc();
+}
+
+void* operator new(size_t numBytes) {
+  return CountedAllocate(numBytes);
+}
+void* operator new[](size_t numBytes) {
+  return CountedAllocate(numBytes);
+}
+void operator delete(void* memory) noexcept {
+  free(memory);
+}
+void operator delete[](void* memory) noexcept {
+  free(memory);
+}
+void operator delete(void* memory, size_t) noexcept {
+  free(memory);
+}
+void operator delete[](void* memory, size_t) noexcept {
+  free(memory);
+}
+
+/* Allocation counts and bytes since some earlier point. */
+struct AllocationTally {
+  size_t count;
+  size_t bytes;
+};
+
+AllocationTally CurrentAllocations() {
+  AllocationTally result = { gAllocationCount.load(), gAllocationBytes.load() };
+  return result;
+}
+
+AllocationTally AllocationsSince(const AllocationTally& start) {
+  AllocationTally current = CurrentAllocations();
+  AllocationTally result = { current.count - start.count, current.bytes - start.bytes };
+  return result;
+}
+
+/* Prints how much an operation allocated per call. */
+void ReportAllocations(const string& operation, const AllocationTally& tally, size_t numCalls) {
+  cout << "  " << setw(28) << left << operation << right << fixed << setprecision(2)
+       << setw(8) << double(tally.count) / numCalls << " allocations, "
+       << setw(8) << double(tally.bytes) / numCalls << " bytes per call" << endl;
+}
+
 /* A utility function to construct a Point from a range of iterators. */
 template <size_t N, typename IteratorType>
 Point<N> PointFromRange(IteratorType begin, IteratorType end) {
@@ -316,6 +413,21 @@ void EdgeCaseKDTreeTest() try {
   for (size_t i = 0; i < kd.size(); ++i)
     CheckCondition(kd.contains(PointFromRange<3>(dataPoints[i], dataPoints[i] + 3)), "Lookup succeeded.");
 
+  /* A NaN coordinate compares neither less nor greater, so it has nowhere to go. */
+  size_t numThrown = 0;
+  Point<3> unordered = MakePoint(nan(""), 0, 0);
+  try {
+    kd.insert(unordered, 99);
+  } catch (const runtime_error&) {
+    ++numThrown;
+  }
+  try {
+    kd[unordered] = 99;
+  } catch (const runtime_error&) {
+    ++numThrown;
+  }
+  CheckCondition(numThrown == 2 && kd.size() == 8, "Inserting a NaN coordinate throws.");
+
   EndTest();
 #else
   TestDisabled("EdgeCaseTreeTest");
@@ -739,6 +851,1927 @@ void ModerateCopyTest() try {
   FailTest(e);
 }
 
+/* Checks that a KDTree survives a round trip through a snapshot file, and that
+ * loading a bad file reports an error without damaging the destination tree.
+ */
+void SnapshotTest() try {
+#if SnapshotTestEnabled
+  PrintBanner("Snapshot Test");
+
+  const string filename = "snapshot-test.kdt";
+
+  /* Build a tree with string values so that variable-length data is exercised. */
+  KDTree<2, string> original;
+  for (size_t i = 0; i < 50; ++i) {
+    stringstream label;
+    label << "point " << i;
+    original.insert(MakePoint(double(i % 7), double(i) / 3.0), label.str());
+  }
+  original.save(filename);
+
+  KDTree<2, string> loaded;
+  loaded[MakePoint(100.0, 100.0)] = "should be replaced";
+  loaded.load(filename);
+
+  CheckCondition(loaded.size() == original.size(), "Loaded tree has the same number of elements.");
+  CheckCondition(!loaded.contains(MakePoint(100.0, 100.0)), "Loading replaces the old contents.");
+  for (size_t i = 0; i < 50; ++i) {
+    Point<2> pt = MakePoint(double(i % 7), double(i) / 3.0);
+    CheckCondition(loaded.at(pt) == original.at(pt), "Loaded tree has the original values.");
+    CheckCondition(loaded.kNNValue(pt, 3) == original.kNNValue(pt, 3), "Loaded tree gives the same k-NN answers.");
+  }
+
+  /* An empty tree should round-trip too. */
+  KDTree<2, string> empty;
+  empty.save(filename);
+  loaded.load(filename);
+  CheckCondition(loaded.empty(), "Empty tree round-trips.");
+
+  /* Loading a snapshot of the wrong dimension must fail and leave the tree alone. */
+  original.save(filename);
+  KDTree<3, string> wrongDimension;
+  wrongDimension[MakePoint(1, 2, 3)] = "kept";
+  bool didThrow = false;
+  try {
+    wrongDimension.load(filename);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "Loading a snapshot of the wrong dimension fails.");
+  CheckCondition(wrongDimension.size() == 1 && wrongDimension.at(MakePoint(1, 2, 3)) == "kept",
+                 "Failed load leaves the tree unchanged.");
+
+  /* Snapshots only load with the fingerprint they were saved with. */
+  original.save(filename, 31337);
+  loaded.load(filename, 31337);
+  CheckCondition(loaded.size() == original.size(), "A snapshot loads with its own fingerprint.");
+  didThrow = false;
+  try {
+    empty.save(filename);
+    loaded.load(filename, 31337);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow && loaded.size() == original.size(), "A snapshot with another fingerprint is rejected.");
+
+  /* A snapshot of a chain far deeper than the call stack could recurse
+   * through must load, save and be freed. */
+  const size_t kChainLength = 500000;
+  BinaryWriter chain;
+  chain.writeBytes("KDTR", 4);
+  chain.writeUInt32(1);
+  chain.writeUInt32(1);
+  chain.writeUInt64(0);
+  chain.writeUInt64(kChainLength);
+  for (size_t i = 0; i < kChainLength; ++i) {
+    chain.writeUInt8(i + 1 < kChainLength ? 0x2 : 0x0);
+    chain.writeUInt64(i);
+    chain.writeDouble(double(i));
+    ValueSerializer<size_t>::write(chain, i);
+  }
+  chain.saveToFile(filename);
+  {
+    KDTree<1, size_t> deep;
+    deep.load(filename);
+    CheckCondition(deep.size() == kChainLength, "Deep snapshots load.");
+    deep.save(filename);
+    KDTree<1, size_t> reloaded;
+    reloaded.load(filename);
+    CheckCondition(reloaded.size() == kChainLength, "Deep trees save.");
+    KDTree<1, size_t> copied(deep);
+    copied = reloaded;
+    CheckCondition(copied.size() == kChainLength && copied.at(MakePoint(double(kChainLength - 1))) == kChainLength - 1,
+                   "Deep trees copy.");
+    CheckCondition(deep.kNNValue(MakePoint(double(kChainLength)), 1) == kChainLength - 1, "Deep trees answer kNN queries.");
+    WorkStealingPool pool(2);
+    CheckCondition(deep.kNNValue(MakePoint(-1.0), 1, pool) == 0, "Deep trees answer parallel kNN queries.");
+    deep.relayout(kKDTreeVanEmdeBoasOrder);
+    reloaded.relayout(kKDTreeBreadthFirstOrder);
+    CheckCondition(deep.at(MakePoint(12345.0)) == 12345 && reloaded.at(MakePoint(12345.0)) == 12345,
+                   "Deep trees relayout.");
+    for (size_t i = 0; i < kChainLength / 2; ++i)
+      copied.erase(MakePoint(double(i)));
+    CheckCondition(copied.size() == kChainLength / 2 && copied.kNNValue(MakePoint(0.0), 1) == kChainLength / 2,
+                   "Deep trees compact.");
+  }
+
+  /* A node on the wrong side of an ancestor is corrupt, even if it is on
+   * the right side of its parent. */
+  BinaryWriter misordered;
+  misordered.writeBytes("KDTR", 4);
+  misordered.writeUInt32(1);
+  misordered.writeUInt32(1);
+  misordered.writeUInt64(0);
+  misordered.writeUInt64(3);
+  misordered.writeUInt8(0x1);
+  misordered.writeUInt64(0);
+  misordered.writeDouble(5.0);
+  ValueSerializer<size_t>::write(misordered, 5);
+  misordered.writeUInt8(0x2);
+  misordered.writeUInt64(1);
+  misordered.writeDouble(2.0);
+  ValueSerializer<size_t>::write(misordered, 2);
+  misordered.writeUInt8(0x0);
+  misordered.writeUInt64(2);
+  misordered.writeDouble(7.0);
+  ValueSerializer<size_t>::write(misordered, 7);
+  misordered.saveToFile(filename);
+  {
+    KDTree<1, size_t> unchanged;
+    bool rejected = false;
+    try {
+      unchanged.load(filename);
+    } catch (const runtime_error&) {
+      rejected = true;
+    }
+    CheckCondition(rejected && unchanged.empty(), "Snapshots out of kd order are rejected.");
+  }
+
+  /* A node whose stored level isn't its depth is corrupt. */
+  BinaryWriter misleveled;
+  misleveled.writeBytes("KDTR", 4);
+  misleveled.writeUInt32(1);
+  misleveled.writeUInt32(1);
+  misleveled.writeUInt64(0);
+  misleveled.writeUInt64(2);
+  misleveled.writeUInt8(0x2);
+  misleveled.writeUInt64(0);
+  misleveled.writeDouble(0.0);
+  ValueSerializer<size_t>::write(misleveled, 0);
+  misleveled.writeUInt8(0x0);
+  misleveled.writeUInt64(5);
+  misleveled.writeDouble(1.0);
+  ValueSerializer<size_t>::write(misleveled, 1);
+  misleveled.saveToFile(filename);
+  KDTree<1, size_t> kept;
+  kept.insert(MakePoint(7.0), 7);
+  didThrow = false;
+  try {
+    kept.load(filename);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow && kept.size() == 1 && kept.at(MakePoint(7.0)) == 7, "Snapshots with wrong levels are rejected.");
+
+  remove(filename.c_str());
+
+  EndTest();
+#else
+  TestDisabled("SnapshotTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks that a memory-mapped KDTreeView answers queries exactly as the tree
+ * it was exported from.
+ */
+void MappedViewTest() try {
+#if MappedViewTestEnabled
+  PrintBanner("Mapped View Test");
+
+  const string filename = "view-test.kdv";
+
+  KDTree<3, size_t> kd;
+  for (size_t i = 0; i < 200; ++i)
+    kd.insert(MakePoint(double((i * 37) % 101), double((i * 11) % 53), double(i % 5)), i % 4);
+  ExportKDTreeView(kd, filename);
+
+  {
+    KDTreeView<3, size_t> view(filename);
+    CheckCondition(view.dimension() == 3,      "View has the right dimension.");
+    CheckCondition(view.size() == kd.size(),   "View has the same number of elements.");
+
+    for (size_t i = 0; i < 200; ++i) {
+      Point<3> pt = MakePoint(double((i * 37) % 101), double((i * 11) % 53), double(i % 5));
+      CheckCondition(view.contains(pt) && view.at(pt) == kd.at(pt), "View has the original values.");
+    }
+    CheckCondition(!view.contains(MakePoint(0.5, 0.5, 0.5)), "Nonexistent elements aren't in the view.");
+
+    for (size_t i = 0; i < 50; ++i) {
+      Point<3> query = MakePoint(double(i) * 2.1, double(i) * 1.3, double(i % 3));
+      CheckCondition(view.kNNValue(query, 5) == kd.kNNValue(query, 5), "View gives the same k-NN answers.");
+    }
+
+    bool didThrow = false;
+    try {
+      view.at(MakePoint(-1, -1, -1));
+    } catch (const out_of_range&) {
+      didThrow = true;
+    }
+    CheckCondition(didThrow, "View lookup of a missing element throws.");
+  }
+
+  /* A view of the wrong shape must refuse to open the file. */
+  bool didThrow = false;
+  try {
+    KDTreeView<2, size_t> wrongDimension(filename);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "Opening an index of the wrong dimension fails.");
+
+  /* Child links that loop back up the tree or run off the end of the node
+   * array are rejected when a search follows them; opening the index
+   * doesn't read the nodes at all.  The root's left link follows its
+   * three coordinates; the header stores the node offset at byte 40. */
+  const uint64_t kBadLinks[] = { 0, kd.size() };
+  for (size_t i = 0; i < sizeof(kBadLinks) / sizeof(kBadLinks[0]); ++i) {
+    ExportKDTreeView(kd, filename);
+    fstream index(filename.c_str(), ios::in | ios::out | ios::binary);
+    uint64_t nodesOffset;
+    index.seekg(40);
+    index.read(reinterpret_cast<char*>(&nodesOffset), sizeof(nodesOffset));
+    index.seekp(streamoff(nodesOffset + 3 * sizeof(double)));
+    index.write(reinterpret_cast<const char*>(&kBadLinks[i]), sizeof(kBadLinks[i]));
+    index.close();
+
+    KDTreeView<3, size_t> corrupt(filename);
+    CheckCondition(corrupt.size() == kd.size(), "Opening an index doesn't check the child links.");
+    size_t numThrown = 0;
+    try {
+      corrupt.kNNValue(MakePoint(0, 0, 0), kd.size());
+    } catch (const runtime_error&) {
+      ++numThrown;
+    }
+    try {
+      corrupt.contains(MakePoint(-1, -1, -1));
+    } catch (const runtime_error&) {
+      ++numThrown;
+    }
+    CheckCondition(numThrown == 2, "Following a bad child link throws.");
+  }
+
+  /* A chain loaded from a snapshot exports to a view that can still be
+   * searched without recursing through it. */
+  const size_t kChainLength = 300000;
+  BinaryWriter chain;
+  chain.writeBytes("KDTR", 4);
+  chain.writeUInt32(1);
+  chain.writeUInt32(1);
+  chain.writeUInt64(0);
+  chain.writeUInt64(kChainLength);
+  for (size_t i = 0; i < kChainLength; ++i) {
+    chain.writeUInt8(i + 1 < kChainLength ? 0x2 : 0x0);
+    chain.writeUInt64(i);
+    chain.writeDouble(double(i));
+    ValueSerializer<size_t>::write(chain, i);
+  }
+  chain.saveToFile(filename);
+  {
+    KDTree<1, size_t> deep;
+    deep.load(filename);
+    ExportKDTreeView(deep, filename);
+    KDTreeView<1, size_t> view(filename);
+    CheckCondition(view.kNNValue(MakePoint(double(kChainLength)), 1) == kChainLength - 1,
+                   "A view of a deep tree answers kNN queries.");
+  }
+
+  remove(filename.c_str());
+
+  EndTest();
+#else
+  TestDisabled("MappedViewTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks that build produces the same tree contents serially and in parallel,
+ * keeps the last value for duplicate points, and answers nearest-neighbor
+ * queries correctly on a data set large enough to use parallel partitioning.
+ */
+void BulkBuildTest() try {
+#if BulkBuildTestEnabled
+  PrintBanner("Bulk Build Test");
+
+  /* A small data set with duplicates, built serially. */
+  vector< pair<Point<2>, size_t> > small;
+  for (size_t i = 0; i < 100; ++i)
+    small.push_back(make_pair(MakePoint(double(i % 10), double(i % 7)), i));
+
+  KDTree<2, size_t> inserted;
+  for (size_t i = 0; i < small.size(); ++i)
+    inserted.insert(small[i].first, small[i].second);
+
+  KDTree<2, size_t> built;
+  built[MakePoint(-5.0, -5.0)] = 0;
+  built.build(small);
+  CheckCondition(built.size() == inserted.size(), "Build drops duplicate points.");
+  CheckCondition(!built.contains(MakePoint(-5.0, -5.0)), "Build replaces the old contents.");
+  for (size_t i = 0; i < small.size(); ++i)
+    CheckCondition(built.at(small[i].first) == inserted.at(small[i].first), "Build keeps the last value for duplicates.");
+
+  /* A large random data set, built in parallel. */
+  srand(137);
+  vector< pair<Point<3>, size_t> > large;
+  for (size_t i = 0; i < 300000; ++i)
+    large.push_back(make_pair(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX), rand() / double(RAND_MAX)), i));
+  large.push_back(large[12345]); // A duplicate whose value should win.
+  large.back().second = 999999;
+
+  WorkStealingPool pool(4);
+  KDTree<3, size_t> parallel;
+  parallel.build(large, pool);
+  CheckCondition(parallel.size() == large.size() - 1, "Parallel build has the right number of elements.");
+
+  bool allFound = true;
+  for (size_t i = 0; i < large.size() - 1; i += 97)
+    if (i != 12345 && parallel.at(large[i].first) != i) allFound = false;
+  CheckCondition(allFound, "Parallel build contains the original points.");
+  CheckCondition(parallel.at(large[12345].first) == 999999, "Parallel build keeps the last value for duplicates.");
+
+  /* Compare 1-NN answers against a linear scan. */
+  bool allNearest = true;
+  for (size_t q = 0; q < 100; ++q) {
+    Point<3> query = MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX), rand() / double(RAND_MAX));
+    size_t best = 0;
+    for (size_t i = 1; i < large.size() - 1; ++i)
+      if (Distance(large[i].first, query) < Distance(large[best].first, query)) best = i;
+    if (best == 12345) best = 999999;
+    if (parallel.kNNValue(query, 1) != best) allNearest = false;
+  }
+  CheckCondition(allNearest, "Parallel build gives correct nearest neighbors.");
+
+  EndTest();
+#else
+  TestDisabled("BulkBuildTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks that splitting one k-NN search across a pool gives the same answers
+ * as the serial search.
+ */
+void ParallelQueryTest() try {
+#if ParallelQueryTestEnabled
+  PrintBanner("Parallel Query Test");
+
+  srand(271);
+  KDTree<16, size_t> kd;
+  for (size_t i = 0; i < 20000; ++i) {
+    Point<16> pt;
+    for (size_t j = 0; j < 16; ++j)
+      pt[j] = rand() / double(RAND_MAX);
+    kd.insert(pt, i);
+  }
+
+  WorkStealingPool pool(4);
+  bool allMatch = true;
+  for (size_t q = 0; q < 200; ++q) {
+    Point<16> query;
+    for (size_t j = 0; j < 16; ++j)
+      query[j] = rand() / double(RAND_MAX);
+    if (kd.kNNValue(query, 1, pool) != kd.kNNValue(query, 1)) allMatch = false;
+  }
+  CheckCondition(allMatch, "Parallel 1-NN matches serial 1-NN.");
+
+  /* With k > 1, use labels that repeat so that the vote matters. */
+  KDTree<2, char> lattice;
+  for (size_t i = 0; i < 400; ++i)
+    lattice[MakePoint(double(i % 20), double(i / 20) + 0.001 * i)] = char('a' + (i * 7) % 3);
+  allMatch = true;
+  for (size_t q = 0; q < 100; ++q) {
+    Point<2> query = MakePoint(rand() / double(RAND_MAX) * 20, rand() / double(RAND_MAX) * 20);
+    if (lattice.kNNValue(query, 5, pool) != lattice.kNNValue(query, 5)) allMatch = false;
+  }
+  CheckCondition(allMatch, "Parallel k-NN matches serial k-NN.");
+
+  EndTest();
+#else
+  TestDisabled("ParallelQueryTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks that the interleaved batch search returns the same answers as
+ * running each search on its own, regardless of how many are in flight.
+ */
+void BatchQueryTest() try {
+#if BatchQueryTestEnabled
+  PrintBanner("Batch Query Test");
+
+  srand(314);
+  KDTree<3, size_t> kd;
+  for (size_t i = 0; i < 5000; ++i)
+    kd.insert(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX), rand() / double(RAND_MAX)), i % 10);
+
+  vector< Point<3> > queries;
+  for (size_t i = 0; i < 300; ++i)
+    queries.push_back(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX), rand() / double(RAND_MAX)));
+
+  const size_t inFlight[] = { 1, 7, 16, 1000 };
+  for (size_t i = 0; i < sizeof(inFlight) / sizeof(inFlight[0]); ++i) {
+    vector<size_t> results = kd.kNNValues(queries, 4, inFlight[i]);
+    bool allMatch = results.size() == queries.size();
+    for (size_t q = 0; allMatch && q < queries.size(); ++q)
+      if (results[q] != kd.kNNValue(queries[q], 4)) allMatch = false;
+    CheckCondition(allMatch, "Batch k-NN matches individual k-NN.");
+  }
+
+  CheckCondition(kd.kNNValues(vector< Point<3> >(), 4).empty(), "Empty batch gives no results.");
+
+  EndTest();
+#else
+  TestDisabled("BatchQueryTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Checks that relaying out a tree's nodes doesn't change its contents, and that
+ * the tree keeps working as it is modified, copied and laid out again.
+ */
+void RelayoutTest() try {
+#if RelayoutTestEnabled
+  PrintBanner("Relayout Test");
+
+  srand(577);
+  vector< pair<Point<2>, size_t> > elems;
+  for (size_t i = 0; i < 3000; ++i)
+    elems.push_back(make_pair(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX)), i));
+
+  KDTree<2, size_t> reference;
+  for (size_t i = 0; i < elems.size(); ++i)
+    reference.insert(elems[i].first, elems[i].second);
+
+  const KDTreeNodeLayout layouts[] = { kKDTreeVanEmdeBoasOrder, kKDTreeBreadthFirstOrder, kKDTreeAllocationOrder };
+  for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); ++l) {
+    KDTree<2, size_t> kd = reference;
+    kd.relayout(layouts[l]);
+
+    bool allMatch = kd.size() == reference.size();
+    for (size_t i = 0; allMatch && i < elems.size(); ++i)
+      if (!kd.contains(elems[i].first) || kd.at(elems[i].first) != i) allMatch = false;
+    CheckCondition(allMatch, "Relaid-out tree has the original contents.");
+
+    allMatch = true;
+    for (size_t q = 0; q < 200; ++q) {
+      Point<2> query = MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX));
+      if (kd.kNNValue(query, 1) != reference.kNNValue(query, 1)) allMatch = false;
+    }
+    CheckCondition(allMatch, "Relaid-out tree gives the same k-NN answers.");
+
+    /* Mix in individually allocated nodes, then copy and lay out again. */
+    kd[MakePoint(2.0, 2.0)] = 12345;
+    kd.insert(elems[0].first, 54321);
+    KDTree<2, size_t> copy = kd;
+    copy.relayout(kKDTreeVanEmdeBoasOrder);
+    CheckCondition(copy.at(MakePoint(2.0, 2.0)) == 12345 && copy.at(elems[0].first) == 54321,
+                   "Inserts after relayout survive copying and another relayout.");
+    CheckCondition(copy.size() == reference.size() + 1, "Relaid-out copy has the right size.");
+  }
+
+  /* The build-time option should give the same tree contents. */
+  KDTree<2, size_t> built;
+  built.build(elems, kKDTreeVanEmdeBoasOrder);
+  bool allMatch = built.size() == elems.size();
+  for (size_t i = 0; allMatch && i < elems.size(); ++i)
+    if (built.at(elems[i].first) != i) allMatch = false;
+  CheckCondition(allMatch, "Building with a layout keeps the contents.");
+
+  EndTest();
+#else
+  TestDisabled("RelayoutTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This test checks the counters reported by the instrumented kNNValue. */
+void QueryStatsTest() try {
+#if QueryStatsTestEnabled
+  PrintBanner("Query Stats Test");
+
+  /* Inserting in sorted order makes a chain, which every query walks end to end.
+   * Eight points are few enough that the chain isn't rebalanced. */
+  KDTree<1, size_t> chain;
+  for (size_t i = 0; i < 8; ++i)
+    chain.insert(MakePoint(double(i)), i);
+
+  KDTreeQueryStats stats;
+  CheckCondition(chain.kNNValue(MakePoint(7.0), 1, stats) == 7, "Instrumented search finds the right value.");
+  CheckCondition(stats.nodesVisited == 8, "Every node of the chain is visited.");
+  CheckCondition(stats.distancesComputed == 8, "One distance is computed per node.");
+  CheckCondition(stats.maxDepth == 8, "Depth reaches the end of the chain.");
+  CheckCondition(stats.farBranchesExplored == 0 && stats.farBranchesPruned == 0, "A chain has no far branches.");
+  CheckCondition(stats.elapsedSeconds >= 0.0, "Elapsed time is recorded.");
+
+  /* On a random tree the counters should add up and the answers should match. */
+  srand(1033);
+  KDTree<2, size_t> kd;
+  for (size_t i = 0; i < 2000; ++i)
+    kd.insert(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX)), i % 5);
+
+  bool allMatch = true, consistent = true, pruned = false;
+  for (size_t q = 0; q < 100; ++q) {
+    Point<2> query = MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX));
+    if (kd.kNNValue(query, 3, stats) != kd.kNNValue(query, 3)) allMatch = false;
+    if (stats.nodesVisited != stats.distancesComputed || stats.nodesVisited > kd.size() ||
+        stats.maxDepth > stats.nodesVisited || stats.nodesVisited < stats.farBranchesExplored + 1)
+      consistent = false;
+    if (stats.farBranchesPruned != 0) pruned = true;
+  }
+  CheckCondition(allMatch, "Instrumented and plain searches agree.");
+  CheckCondition(consistent, "Counters are consistent with each other.");
+  CheckCondition(pruned, "Searches in a large tree prune far branches.");
+
+  /* Asking for every point can't prune anything. */
+  kd.kNNValue(MakePoint(0.5, 0.5), kd.size(), stats);
+  CheckCondition(stats.nodesVisited == kd.size() && stats.farBranchesPruned == 0,
+                 "Searching for every point visits every node.");
+
+  EndTest();
+#else
+  TestDisabled("QueryStatsTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This test checks the shape and memory report of stats(). */
+void ShapeStatsTest() try {
+#if ShapeStatsTestEnabled
+  PrintBanner("Shape Stats Test");
+
+  KDTree<1, size_t> empty;
+  KDTreeShapeStats shape = empty.stats();
+  CheckCondition(shape.height == 0 && shape.nodeCount == 0 && shape.totalBytes() == 0, "Empty tree has an empty shape.");
+
+  /* A few sorted inserts make a chain, short enough not to be rebalanced. */
+  KDTree<1, size_t> chain;
+  for (size_t i = 0; i < 8; ++i)
+    chain.insert(MakePoint(double(i)), i);
+  shape = chain.stats();
+  CheckCondition(shape.height == 8, "Chain has one level per node.");
+  CheckCondition(shape.nodeCount == 8 && shape.numElements == 8, "Chain node count matches its size.");
+  CheckCondition(shape.leafCount == 1 && shape.averageLeafDepth == 7.0, "Chain has a single leaf at the bottom.");
+  CheckCondition(shape.imbalanceAtDepth[0] == 1.0 && shape.imbalanceAtDepth[6] == 1.0, "Chain is completely unbalanced.");
+
+  /* A balanced build of seven points fills three levels exactly. */
+  vector< pair<Point<1>, size_t> > elems;
+  for (size_t i = 0; i < 7; ++i)
+    elems.push_back(make_pair(MakePoint(double(i)), i));
+  KDTree<1, size_t> balanced;
+  balanced.build(elems);
+  shape = balanced.stats();
+  CheckCondition(shape.height == 3, "Balanced tree has three levels.");
+  CheckCondition(shape.nodesAtDepth.size() == 3 && shape.nodesAtDepth[0] == 1 &&
+                 shape.nodesAtDepth[1] == 2 && shape.nodesAtDepth[2] == 4, "Levels are full.");
+  CheckCondition(shape.leafCount == 4 && shape.averageLeafDepth == 2.0, "Leaves are all on the last level.");
+  CheckCondition(shape.imbalanceAtDepth[0] == 0.5 && shape.imbalanceAtDepth[1] == 0.5, "Balanced tree has no imbalance.");
+  CheckCondition(shape.coordinateBytes == 7 * sizeof(Point<1>) && shape.valueBytes == 7 * sizeof(size_t),
+                 "Coordinate and value bytes are counted per node.");
+  CheckCondition(shape.nodeOverheadBytes > 0, "Node overhead is counted.");
+
+  EndTest();
+#else
+  TestDisabled("ShapeStatsTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This test counts the allocations made by inserts and queries, and checks
+ * that the lookups documented as allocation-free really don't allocate.
+ */
+void AllocationTest() try {
+#if AllocationTestEnabled
+  PrintBanner("Allocation Test");
+
+  const size_t kNumPoints = 2000;
+  srand(1037);
+  vector< Point<3> > points;
+  for (size_t i = 0; i < kNumPoints; ++i)
+    points.push_back(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX), rand() / double(RAND_MAX)));
+
+  KDTree<3, size_t> kd;
+  KDTree<3, string> named;
+  AllocationTally start = CurrentAllocations();
+  for (size_t i = 0; i < kNumPoints; ++i)
+    kd.insert(points[i], i);
+  AllocationTally numbers = AllocationsSince(start);
+  start = CurrentAllocations();
+  for (size_t i = 0; i < kNumPoints; ++i)
+    named.insert(points[i], "A value long enough not to fit in a short string");
+  AllocationTally names = AllocationsSince(start);
+
+  cout << "Allocations per call:" << endl;
+  ReportAllocations("insert (size_t values)", numbers, kNumPoints);
+  ReportAllocations("insert (string values)", names, kNumPoints);
+  CheckCondition(numbers.count == kNumPoints, "Each insert of a new point allocates exactly one node.");
+
+  /* Lookups must not allocate, whether they hit or miss. */
+  const KDTree<3, size_t>& constKd = kd;
+  size_t checksum = 0;
+  start = CurrentAllocations();
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    checksum += kd.contains(points[i]);
+    checksum += kd.contains(MakePoint(2.0, double(i), 0.0));
+  }
+  AllocationTally lookups = AllocationsSince(start);
+  ReportAllocations("contains", lookups, 2 * kNumPoints);
+  CheckCondition(lookups.count == 0, "contains is allocation-free.");
+
+  start = CurrentAllocations();
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    checksum += kd.at(points[i]);
+    checksum += constKd.at(points[i]);
+    checksum += named.at(points[i]).size();
+  }
+  lookups = AllocationsSince(start);
+  ReportAllocations("at", lookups, 3 * kNumPoints);
+  CheckCondition(lookups.count == 0, "at is allocation-free.");
+
+  /* Searches allocate for the bounded queue and the vote; report how much. */
+  const size_t kValues[] = { 1, 8 };
+  for (size_t j = 0; j < sizeof(kValues) / sizeof(kValues[0]); ++j) {
+    start = CurrentAllocations();
+    for (size_t i = 0; i < kNumPoints; ++i)
+      checksum += kd.kNNValue(points[(i * 7) % kNumPoints], kValues[j]);
+    ostringstream label;
+    label << "kNNValue, k = " << kValues[j];
+    ReportAllocations(label.str(), AllocationsSince(start), kNumPoints);
+  }
+
+  /* With one point, a search enqueues once and votes once, and the vote
+   * reads the queue in place rather than copying it.
+   */
+  KDTree<1, size_t> single;
+  single.insert(MakePoint(0.0), 1);
+  start = CurrentAllocations();
+  checksum += single.kNNValue(MakePoint(1.0), 1);
+  AllocationTally search = AllocationsSince(start);
+  CheckCondition(search.count == 2, "k-NN allocates only for its queue entry and its vote.");
+
+  CheckCondition(checksum != 0, "Lookups found their points.");
+
+  EndTest();
+#else
+  TestDisabled("AllocationTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This test records spans on two threads and checks the trace file they
+ * produce.  The tracing macros are compiled out here, so the recorder is
+ * used directly.
+ */
+void TracingTest() try {
+#if TracingTestEnabled
+  PrintBanner("Tracing Test");
+
+  {
+    TraceSpan span("Tracing test span");
+  }
+  thread worker([]() {
+    TraceRecorder::instance().nameThread("Tracing test \"worker\"");
+    TraceSpan span("Tracing test worker span");
+  });
+  worker.join();
+
+  /* A thread that records more spans than it keeps drops the oldest. */
+  thread ring([]() {
+    TraceRecorder& recorder = TraceRecorder::instance();
+    recorder.record("Tracing test evicted span", recorder.now(), 0.0);
+    for (size_t i = 0; i < kTraceEventsPerThread; ++i)
+      recorder.record("Tracing test kept span", recorder.now(), 0.0);
+  });
+  ring.join();
+
+  const string filename = "tracing-test.json";
+  TraceRecorder::instance().save(filename);
+
+  ifstream input(filename.c_str());
+  stringstream contents;
+  contents << input.rdbuf();
+  string trace = contents.str();
+
+  CheckCondition(trace.find("{\"traceEvents\":[") == 0, "Trace is a trace-event JSON object.");
+  CheckCondition(trace.find("\"name\":\"Tracing test span\",\"cat\":\"kdtree\",\"ph\":\"X\"") != string::npos,
+                 "Spans are recorded as complete events.");
+  CheckCondition(trace.find("Tracing test worker span") != string::npos, "Spans on other threads are recorded.");
+  CheckCondition(trace.find("\"args\":{\"name\":\"Tracing test \\\"worker\\\"\"}") != string::npos,
+                 "Thread names are recorded and escaped.");
+  size_t numKept = 0, numEvicted = 0;
+  for (size_t pos = trace.find("Tracing test kept span"); pos != string::npos;
+       pos = trace.find("Tracing test kept span", pos + 1))
+    ++numKept;
+  for (size_t pos = trace.find("Tracing test evicted span"); pos != string::npos;
+       pos = trace.find("Tracing test evicted span", pos + 1))
+    ++numEvicted;
+  CheckCondition(numKept == kTraceEventsPerThread && numEvicted == 0,
+                 "Each thread keeps only its most recent spans.");
+
+  bool didThrow = false;
+  try {
+    TraceRecorder::instance().save("no-such-directory/trace.json");
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "Saving to an unwritable path fails.");
+
+  remove(filename.c_str());
+
+  EndTest();
+#else
+  TestDisabled("TracingTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This function verifies that a DynamicKDTree holds the same points and
+ * answers the same queries as a KDTree built by inserting the same points.
+ */
+void DynamicTreeTest() try {
+#if DynamicTreeTestEnabled
+  PrintBanner("Dynamic Tree Test");
+
+  DynamicKDTree<2, size_t> dynamicTree;
+  KDTree<2, size_t> plainTree;
+  CheckCondition(dynamicTree.empty(), "New dynamic tree is empty.");
+  CheckCondition(dynamicTree.kNNValue(MakePoint(0, 0), 3) == 0, "k-NN on an empty tree gives the default value.");
+
+  srand(389);
+  vector< Point<2> > points;
+  for (size_t i = 0; i < 5000; ++i) {
+    Point<2> pt = MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX));
+    points.push_back(pt);
+    dynamicTree.insert(pt, i % 7);
+    plainTree.insert(pt, i % 7);
+  }
+  CheckCondition(dynamicTree.size() == plainTree.size(), "Dynamic tree has the right size.");
+
+  bool allFound = true;
+  for (size_t i = 0; i < points.size(); ++i) {
+    if (!dynamicTree.contains(points[i]) || dynamicTree.at(points[i]) != plainTree.at(points[i]))
+      allFound = false;
+  }
+  CheckCondition(allFound, "Every inserted point is found with its value.");
+  CheckCondition(!dynamicTree.contains(MakePoint(2, 2)), "Missing point is not found.");
+
+  bool didThrow = false;
+  try {
+    dynamicTree.at(MakePoint(2, 2));
+  } catch (const out_of_range&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "at throws on a missing point.");
+
+  const size_t kValues[] = { 1, 4, 16, 64 };
+  for (size_t j = 0; j < sizeof(kValues) / sizeof(kValues[0]); ++j) {
+    bool allMatch = true;
+    for (size_t i = 0; i < 500; ++i) {
+      Point<2> query = MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX));
+      if (dynamicTree.kNNValue(query, kValues[j]) != plainTree.kNNValue(query, kValues[j]))
+        allMatch = false;
+    }
+    CheckCondition(allMatch, "k-NN across the levels matches a single tree.");
+  }
+
+  size_t oldSize = dynamicTree.size();
+  dynamicTree.insert(points[123], 100);
+  dynamicTree.at(points[456]) = 200;
+  CheckCondition(dynamicTree.size() == oldSize, "Reinserting a point doesn't grow the tree.");
+  CheckCondition(dynamicTree.at(points[123]) == 100, "Reinserting a point overwrites its value.");
+  CheckCondition(dynamicTree.at(points[456]) == 200, "at returns a writable reference.");
+  CheckCondition(dynamicTree.kNNValue(points[123], 1) == 100, "k-NN sees the overwritten value.");
+
+  EndTest();
+#else
+  TestDisabled("DynamicTreeTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This function checks that inserts in adversarial orders keep the tree's
+ * height logarithmic, and that rebalancing loses nothing.
+ */
+void ScapegoatTest() try {
+#if ScapegoatTestEnabled
+  PrintBanner("Scapegoat Test");
+
+  const size_t kNumPoints = 20000;
+  /* log base 4/3 of kNumPoints, plus the new point's own level. */
+  const size_t kMaxHeight = size_t(log(double(kNumPoints)) / log(4.0 / 3.0)) + 1;
+
+  KDTree<2, size_t> sorted;
+  for (size_t i = 0; i < kNumPoints; ++i)
+    sorted.insert(MakePoint(double(i), double(i)), i);
+  KDTreeShapeStats shape = sorted.stats();
+  CheckCondition(shape.nodeCount == kNumPoints && sorted.size() == kNumPoints, "Sorted inserts keep every point.");
+  CheckCondition(shape.height <= kMaxHeight, "Sorted inserts keep the height logarithmic.");
+
+  bool allFound = true;
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    if (!sorted.contains(MakePoint(double(i), double(i))) || sorted.at(MakePoint(double(i), double(i))) != i)
+      allFound = false;
+  }
+  CheckCondition(allFound, "Every point keeps its value through the rebuilds.");
+  CheckCondition(sorted.kNNValue(MakePoint(1234.2, 1234.2), 1) == 1234, "Nearest neighbor is found after rebuilds.");
+
+  /* operator[] rebalances too, and its references survive later rebuilds. */
+  KDTree<2, size_t> indexed;
+  size_t& first = indexed[MakePoint(0.0, 0.0)];
+  first = 42;
+  for (size_t i = kNumPoints; i > 0; --i)
+    indexed[MakePoint(double(i), 0.0)] = i;
+  CheckCondition(indexed.stats().height <= kMaxHeight + 1, "Reverse-sorted operator[] keeps the height logarithmic.");
+  CheckCondition(first == 42 && indexed.at(MakePoint(0.0, 0.0)) == 42, "References from operator[] stay valid.");
+
+  /* Points that tie on one axis can't be split on that axis at all, but
+   * the tree should still answer correctly. */
+  KDTree<2, size_t> ties;
+  for (size_t i = 0; i < kNumPoints; ++i)
+    ties.insert(MakePoint(double(i % 3), double(i)), i);
+  bool tiesFound = true;
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    if (ties.at(MakePoint(double(i % 3), double(i))) != i) tiesFound = false;
+  }
+  CheckCondition(tiesFound && ties.size() == kNumPoints, "Heavily tied points survive rebuilding.");
+  CheckCondition(ties.kNNValue(MakePoint(1.0, 5000.2), 1) == 5000, "Nearest neighbor among tied points is found.");
+
+  /* Rebuilding a relaid-out tree mixes arena nodes with fresh ones. */
+  sorted.relayout();
+  for (size_t i = 0; i < 1000; ++i)
+    sorted.insert(MakePoint(double(kNumPoints + i), double(kNumPoints + i)), kNumPoints + i);
+  CheckCondition(sorted.size() == kNumPoints + 1000 && sorted.at(MakePoint(5.0, 5.0)) == 5,
+                 "Rebuilding after a relayout keeps every point.");
+
+  EndTest();
+#else
+  TestDisabled("ScapegoatTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This function checks erase: erased points disappear from every kind of
+ * query, can be inserted again, survive copies and snapshots as erased,
+ * and are eventually compacted away.
+ */
+void EraseTest() try {
+#if EraseTestEnabled
+  PrintBanner("Erase Test");
+
+  KDTree<2, size_t> kd;
+  CheckCondition(!kd.erase(MakePoint(0, 0)), "Erasing from an empty tree fails.");
+
+  srand(491);
+  const size_t kNumPoints = 4000;
+  vector< Point<2> > points;
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    points.push_back(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX)));
+    kd.insert(points[i], i);
+  }
+
+  /* Erase a fifth of the points, which isn't enough to compact. */
+  KDTree<2, size_t> reference;
+  bool allErased = true;
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    if (i % 5 == 0)
+      allErased = kd.erase(points[i]) && allErased;
+    else
+      reference.insert(points[i], i);
+  }
+  CheckCondition(allErased, "Erasing a present point succeeds.");
+  CheckCondition(!kd.erase(points[0]), "Erasing a point twice fails.");
+  CheckCondition(kd.size() == reference.size(), "Erasing shrinks the tree.");
+  CheckCondition(kd.stats().nodeCount == kNumPoints, "Erased nodes stay until the tree is compacted.");
+  CheckCondition(!kd.contains(points[0]) && kd.contains(points[1]), "contains skips erased points.");
+
+  bool didThrow = false;
+  try {
+    kd.at(points[5]);
+  } catch (const out_of_range&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "at throws on an erased point.");
+  CheckCondition(kd.elements().size() == reference.size(), "elements skips erased points.");
+
+  vector< Point<2> > queries;
+  for (size_t i = 0; i < 300; ++i)
+    queries.push_back(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX)));
+  WorkStealingPool pool(2);
+  vector<size_t> batch = kd.kNNValues(queries, 4);
+  bool allMatch = true;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    size_t expected = reference.kNNValue(queries[i], 4);
+    if (kd.kNNValue(queries[i], 4) != expected || kd.kNNValue(queries[i], 4, pool) != expected ||
+        batch[i] != expected)
+      allMatch = false;
+  }
+  CheckCondition(allMatch, "Every k-NN search skips erased points.");
+  CheckCondition(kd.kNNValue(points[10], 1) != 10, "An erased point is never its own nearest neighbor.");
+
+  /* Copies and snapshots keep the erased points erased. */
+  KDTree<2, size_t> copy(kd);
+  CheckCondition(copy.size() == kd.size() && !copy.contains(points[0]), "Copies keep erased points erased.");
+  const string filename = "erase-test.kdt";
+  kd.save(filename);
+  KDTree<2, size_t> loaded;
+  loaded.load(filename);
+  remove(filename.c_str());
+  CheckCondition(loaded.size() == kd.size() && !loaded.contains(points[0]) && loaded.contains(points[1]),
+                 "Snapshots keep erased points erased.");
+  CheckCondition(loaded.kNNValue(queries[0], 4) == reference.kNNValue(queries[0], 4), "Loaded tree skips erased points.");
+  const string viewFilename = "erase-test.kdv";
+  ExportKDTreeView(kd, viewFilename);
+  {
+    KDTreeView<2, size_t> view(viewFilename);
+    CheckCondition(view.size() == kd.size() && !view.contains(points[0]) && view.contains(points[1]),
+                   "Exported views leave out erased points.");
+  }
+  remove(viewFilename.c_str());
+
+  /* Inserting an erased point brings it back. */
+  kd.insert(points[0], 12345);
+  kd[points[5]] = 678;
+  CheckCondition(kd.contains(points[0]) && kd.at(points[0]) == 12345, "insert brings back an erased point.");
+  CheckCondition(kd.at(points[5]) == 678, "operator[] brings back an erased point.");
+  CheckCondition(kd.size() == reference.size() + 2, "Brought-back points count again.");
+  kd.erase(points[0]);
+  kd.erase(points[5]);
+
+  /* Erasing past a quarter of the nodes compacts the tree. */
+  for (size_t i = 1; i < kNumPoints && kd.stats().nodeCount != kd.size(); i += 5)
+    kd.erase(points[i]);
+  KDTreeShapeStats shape = kd.stats();
+  CheckCondition(shape.nodeCount == kd.size(), "Compaction frees the erased nodes.");
+  CheckCondition(shape.height <= 2 * size_t(log2(double(kd.size())) + 1), "Compaction leaves a balanced tree.");
+  bool survivorsFound = true;
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    if (kd.contains(points[i]) && kd.at(points[i]) != i) survivorsFound = false;
+  }
+  CheckCondition(survivorsFound, "Compaction keeps the remaining values.");
+
+  /* Erased points in a relaid-out tree live in the arena. */
+  KDTree<2, size_t> arena(reference);
+  arena.relayout();
+  for (size_t i = 0; i < kNumPoints; i += 2)
+    arena.erase(points[i]);
+  CheckCondition(!arena.contains(points[2]) && arena.contains(points[1]), "Arena trees erase points.");
+  arena.compact();
+  CheckCondition(arena.size() == arena.stats().nodeCount && arena.at(points[1]) == 1, "Arena trees compact.");
+  arena.compact();
+  CheckCondition(arena.at(points[1]) == 1, "Compacting again is harmless.");
+
+  /* A fully erased tree votes for the default value. */
+  KDTree<2, size_t> emptied;
+  KDTree<2, double> emptiedDoubles;
+  for (size_t i = 0; i < 10; ++i) {
+    emptied.insert(points[i], i + 1);
+    emptiedDoubles.insert(points[i], i + 1.5);
+  }
+  for (size_t i = 0; i < 10; ++i) {
+    emptied.erase(points[i]);
+    emptiedDoubles.erase(points[i]);
+  }
+  CheckCondition(emptied.size() == 0 && emptied.empty(), "Erasing every point empties the tree.");
+  CheckCondition(emptied.kNNValue(points[0], 3) == 0, "k-NN on a fully erased tree returns the default value.");
+  CheckCondition(emptiedDoubles.kNNValue(points[0], 1) == 0.0, "k-NN on a fully erased tree of doubles returns 0.");
+
+  EndTest();
+#else
+  TestDisabled("EraseTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This function streams points through a SlidingWindowKDTree and checks it
+ * against a KDTree holding exactly the points that should still be live.
+ */
+void SlidingWindowTest() try {
+#if SlidingWindowTestEnabled
+  PrintBanner("Sliding Window Test");
+
+  bool didThrow = false;
+  try {
+    SlidingWindowKDTree<2, size_t> bad(10.0, 0.0);
+  } catch (const invalid_argument&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "Partitions must have a positive length.");
+
+  /* A window of 100 time units in partitions of 10, fed one point per unit. */
+  SlidingWindowKDTree<2, size_t> window(100.0, 10.0);
+  CheckCondition(window.empty() && window.kNNValue(MakePoint(0, 0), 3) == 0, "New window is empty.");
+
+  srand(577);
+  vector< Point<2> > points;
+  for (size_t t = 0; t < 1000; ++t) {
+    points.push_back(MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX)));
+    window.insert(points[t], t % 7, double(t));
+  }
+
+  /* At time 999 the partitions starting at 890 and later are live. */
+  KDTree<2, size_t> live;
+  for (size_t t = 890; t < 1000; ++t)
+    live.insert(points[t], t % 7);
+  CheckCondition(window.size() == live.size() && window.numPartitions() == 11, "Old partitions are dropped whole.");
+  CheckCondition(window.contains(points[950]) && window.contains(points[890]), "Recent points are kept.");
+  CheckCondition(!window.contains(points[889]) && !window.contains(points[100]), "Expired points are gone.");
+
+  const size_t kValues[] = { 1, 5, 20 };
+  for (size_t j = 0; j < sizeof(kValues) / sizeof(kValues[0]); ++j) {
+    bool allMatch = true;
+    for (size_t i = 0; i < 200; ++i) {
+      Point<2> query = MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX));
+      if (window.kNNValue(query, kValues[j]) != live.kNNValue(query, kValues[j])) allMatch = false;
+    }
+    CheckCondition(allMatch, "k-NN across the partitions matches a single tree of the live points.");
+  }
+
+  /* Late points go to their own partition, or are ignored once expired. */
+  window.insert(MakePoint(2.0, 2.0), 100, 955.5);
+  window.insert(MakePoint(3.0, 3.0), 200, 500.0);
+  CheckCondition(window.contains(MakePoint(2.0, 2.0)) && window.kNNValue(MakePoint(2.0, 2.0), 1) == 100,
+                 "Late points within the window are kept.");
+  CheckCondition(!window.contains(MakePoint(3.0, 3.0)) && window.size() == live.size() + 1,
+                 "Points older than the window are ignored.");
+
+  /* The same point seen at two times is two observations. */
+  window.insert(MakePoint(4.0, 4.0), 1, 1000.0);
+  window.insert(MakePoint(4.0, 4.0), 2, 1010.0);
+  CheckCondition(window.kNNValue(MakePoint(4.0, 4.0), 2) == 1, "Repeated observations are all searched.");
+
+  window.advanceTo(5000.0);
+  CheckCondition(window.empty() && window.numPartitions() == 0, "Advancing far enough empties the window.");
+
+  EndTest();
+#else
+  TestDisabled("SlidingWindowTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This function builds a LazyKDTree and checks its answers against a KDTree
+ * holding the same points, both before and after every block is split.
+ */
+void LazyTreeTest() try {
+#if LazyTreeTestEnabled
+  PrintBanner("Lazy Tree Test");
+
+  LazyKDTree<3, size_t> empty;
+  CheckCondition(empty.empty() && !empty.contains(MakePoint(0, 0, 0)), "New lazy tree is empty.");
+  CheckCondition(empty.kNNValue(MakePoint(0, 0, 0), 3) == 0, "Searching an empty lazy tree is harmless.");
+
+  const size_t kNumPoints = 20000;
+  srand(1043);
+  vector< pair<Point<3>, size_t> > elems;
+  KDTree<3, size_t> reference;
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    /* Coarse coordinates, so that many points share a splitting coordinate. */
+    Point<3> pt = MakePoint(rand() % 50, rand() / double(RAND_MAX), rand() % 20);
+    if (reference.contains(pt)) continue;
+    elems.push_back(make_pair(pt, i % 7));
+    reference.insert(pt, i % 7);
+  }
+
+  LazyKDTree<3, size_t> lazy;
+  lazy.build(elems);
+  size_t eagerSplits = lazy.splitCount();
+  CheckCondition(lazy.size() == elems.size() && lazy.dimension() == 3, "Lazy tree holds every point.");
+  CheckCondition(eagerSplits > 0 && eagerSplits < 64, "build splits only the top levels.");
+
+  vector< Point<3> > queries;
+  for (size_t i = 0; i < 100; ++i)
+    queries.push_back(MakePoint(rand() % 50, rand() / double(RAND_MAX), rand() % 20));
+  bool allMatch = true;
+  for (size_t i = 0; i < 10; ++i) {
+    if (lazy.kNNValue(queries[i], 5) != reference.kNNValue(queries[i], 5)) allMatch = false;
+  }
+  CheckCondition(allMatch, "First queries match a KDTree.");
+  CheckCondition(lazy.splitCount() < elems.size() / kLazyKDTreeLeafSize / 4, "First queries split only what they visit.");
+
+  bool allFound = true;
+  for (size_t i = 0; i < elems.size(); i += 7) {
+    if (!lazy.contains(elems[i].first) || lazy.at(elems[i].first) != elems[i].second) allFound = false;
+  }
+  CheckCondition(allFound, "Lazy tree finds points that share splitting coordinates.");
+  CheckCondition(!lazy.contains(MakePoint(0.5, 0.5, 0.5)), "Lazy tree doesn't contain a missing point.");
+  bool didThrow = false;
+  try {
+    lazy.at(MakePoint(0.5, 0.5, 0.5));
+  } catch (const out_of_range&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "at throws on a missing point.");
+
+  /* Queries from several threads at once split blocks safely. */
+  LazyKDTree<3, size_t> shared;
+  shared.build(elems, 1);
+  vector<size_t> answers(queries.size());
+  vector<thread> workers;
+  for (size_t t = 0; t < 4; ++t) {
+    workers.push_back(thread([&shared, &queries, &answers, t]() {
+      for (size_t i = t; i < queries.size(); i += 4)
+        answers[i] = shared.kNNValue(queries[i], 9);
+    }));
+  }
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  allMatch = true;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    if (answers[i] != reference.kNNValue(queries[i], 9)) allMatch = false;
+  }
+  CheckCondition(allMatch, "Concurrent queries match a KDTree.");
+
+  const size_t kValues[] = { 1, 4, 25 };
+  lazy.splitAll();
+  CheckCondition(lazy.splitCount() > eagerSplits && lazy.splitCount() < elems.size(), "splitAll splits the remaining blocks.");
+  for (size_t j = 0; j < sizeof(kValues) / sizeof(kValues[0]); ++j) {
+    allMatch = true;
+    for (size_t i = 0; i < queries.size(); ++i) {
+      if (lazy.kNNValue(queries[i], kValues[j]) != reference.kNNValue(queries[i], kValues[j])) allMatch = false;
+    }
+    CheckCondition(allMatch, "Fully split lazy tree matches a KDTree.");
+  }
+
+  /* Snapshots keep the split blocks split. */
+  const string filename = "lazy-tree-test.kdl";
+  shared.save(filename);
+  LazyKDTree<3, size_t> loaded;
+  loaded.load(filename);
+  remove(filename.c_str());
+  CheckCondition(loaded.size() == shared.size() && loaded.splitCount() == shared.splitCount(), "Snapshots keep the splits.");
+  allMatch = true;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    if (loaded.kNNValue(queries[i], 4) != reference.kNNValue(queries[i], 4)) allMatch = false;
+  }
+  CheckCondition(allMatch && loaded.at(elems[0].first) == elems[0].second, "Loaded lazy tree matches a KDTree.");
+
+  /* Splitting moves coordinates and values separately; each value must
+   * end up with its own point. */
+  vector< pair<Point<5>, string> > labeledElems;
+  for (size_t i = 0; i < 2000; ++i) {
+    Point<5> pt;
+    for (size_t j = 0; j < 5; ++j)
+      pt[j] = rand() / double(RAND_MAX);
+    labeledElems.push_back(make_pair(pt, "point " + to_string(i)));
+  }
+  LazyKDTree<5, string> labeled;
+  labeled.build(labeledElems, 0);
+  labeled.splitAll();
+  allFound = true;
+  for (size_t i = 0; i < labeledElems.size(); ++i) {
+    const pair<Point<5>, string>& elem = labeledElems[i];
+    if (labeled.at(elem.first) != elem.second || labeled.kNNValue(elem.first, 1) != elem.second) allFound = false;
+  }
+  CheckCondition(allFound, "Every point keeps its value through the splits.");
+  didThrow = false;
+  try {
+    LazyKDTree<2, size_t> wrongDimension;
+    wrongDimension.load(filename);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "Loading a missing snapshot throws.");
+
+  /* Repeated points keep the last value given, as a KDTree does. */
+  vector< pair<Point<3>, size_t> > repeated;
+  repeated.push_back(make_pair(MakePoint(1, 1, 1), 2));
+  repeated.push_back(make_pair(MakePoint(1, 1, 1), 2));
+  repeated.push_back(make_pair(MakePoint(9, 9, 9), 1));
+  repeated.push_back(make_pair(MakePoint(1, 1, 1), 1));
+  repeated.push_back(make_pair(MakePoint(5, 5, 5), 2));
+  LazyKDTree<3, size_t> multi;
+  multi.build(repeated);
+  KDTree<3, size_t> inserted;
+  for (size_t i = 0; i < repeated.size(); ++i)
+    inserted.insert(repeated[i].first, repeated[i].second);
+  CheckCondition(multi.size() == inserted.size() && multi.at(MakePoint(1, 1, 1)) == 1,
+                 "Repeated points keep the last value.");
+  CheckCondition(multi.kNNValue(MakePoint(1, 1, 1), 3) == inserted.kNNValue(MakePoint(1, 1, 1), 3),
+                 "Repeated points vote once, as in a KDTree.");
+
+  /* Repeats are only found as the blocks holding them are split, so a build
+   * still splits just its top levels, and the last copy given answers. */
+  vector< pair<Point<3>, size_t> > copies;
+  for (size_t round = 0; round < 4; ++round) {
+    for (size_t i = 0; i < 500; ++i)
+      copies.push_back(make_pair(MakePoint(double((i * 37) % 101), double((i * 11) % 53), double(i % 5)), round));
+  }
+  LazyKDTree<3, size_t> folded;
+  folded.build(copies, 2);
+  CheckCondition(folded.splitCount() == 3, "Building with repeated points splits only the top levels.");
+  CheckCondition(folded.size() <= copies.size() && folded.size() > 500, "Repeats in unsplit blocks are still counted.");
+  bool allLast = true;
+  for (size_t i = 0; i < 500; ++i)
+    allLast &= folded.at(copies[i].first) == 3;
+  CheckCondition(allLast, "Lookups find the last copy of a point.");
+  CheckCondition(folded.kNNValue(MakePoint(50, 25, 2), 20) == 3, "Searches only see the last copy of a point.");
+  folded.splitAll();
+  CheckCondition(folded.size() == 500, "Splitting every block sets aside every repeat.");
+  folded.save(filename);
+  LazyKDTree<3, size_t> refolded;
+  refolded.load(filename);
+  CheckCondition(refolded.size() == 500 && refolded.at(copies[0].first) == 3, "Snapshots remember the repeats set aside.");
+
+  /* Snapshots remember the fingerprint of their source data. */
+  multi.save(filename, 12345);
+  LazyKDTree<3, size_t> stamped;
+  stamped.load(filename, 12345);
+  CheckCondition(stamped.size() == multi.size(), "A snapshot loads with its own fingerprint.");
+  size_t numRejected = 0;
+  const uint64_t kOtherFingerprints[] = { 0, 12346 };
+  for (size_t i = 0; i < 2; ++i) {
+    try {
+      loaded.load(filename, kOtherFingerprints[i]);
+    } catch (const runtime_error&) {
+      ++numRejected;
+    }
+  }
+  remove(filename.c_str());
+  CheckCondition(numRejected == 2 && loaded.size() == shared.size(), "A snapshot of different data is rejected.");
+
+  EndTest();
+#else
+  TestDisabled("LazyTreeTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Parses lines of the form "x y value" for PipelineTest. */
+void ParseTestLines(const string& chunk, IngestionPipeline<2, size_t>::Batch& batch) {
+  istringstream input(chunk);
+  Point<2> pt;
+  size_t value;
+  while (input >> pt[0] >> pt[1] >> value)
+    batch.push_back(make_pair(pt, value));
+  if (!input.eof())
+    throw runtime_error("Malformed line");
+}
+
+/* This function runs text through an IngestionPipeline and checks that every
+ * line comes out exactly once, whatever the chunk size and thread count.
+ */
+void PipelineTest() try {
+#if PipelineTestEnabled
+  PrintBanner("Pipeline Test");
+
+  typedef IngestionPipeline<2, size_t> Pipeline;
+  const size_t kNumLines = 20000;
+  ostringstream text;
+  for (size_t i = 0; i < kNumLines; ++i)
+    text << i * 0.5 << ' ' << -double(i) << ' ' << i << (i + 1 < kNumLines ? "\n" : "");
+
+  /* Tiny chunks split lines everywhere; the last line has no newline. */
+  const size_t kChunkSizes[] = { 7, 4096, kIngestionChunkSize };
+  const size_t kParsers[] = { 1, 3, 0 };
+  for (size_t j = 0; j < sizeof(kChunkSizes) / sizeof(kChunkSizes[0]); ++j) {
+    istringstream input(text.str());
+    Pipeline pipeline(kParsers[j]);
+    vector<size_t> seen(kNumLines);
+    bool allCorrect = true;
+    size_t numBatches = 0;
+    pipeline.run(TextChunkReader(input, kChunkSizes[j]), ParseTestLines, [&](Pipeline::Batch& batch) {
+      ++numBatches;
+      for (size_t i = 0; i < batch.size(); ++i) {
+        size_t value = batch[i].second;
+        if (value >= kNumLines || batch[i].first != MakePoint(value * 0.5, -double(value))) {
+          allCorrect = false;
+        } else {
+          ++seen[value];
+        }
+      }
+    });
+    CheckCondition(allCorrect && count(seen.begin(), seen.end(), size_t(1)) == kNumLines,
+                   "Every line is parsed exactly once.");
+    CheckCondition(kChunkSizes[j] == kIngestionChunkSize || numBatches > 1, "Input is split into several batches.");
+  }
+  CheckCondition(Pipeline().numParsers() >= 1, "Default pipeline has parsers.");
+
+  /* Batches build into a tree that matches one built serially. */
+  istringstream input(text.str());
+  Pipeline::Batch elems;
+  Pipeline(4).run(TextChunkReader(input, 1000), ParseTestLines, [&](Pipeline::Batch& batch) {
+    elems.insert(elems.end(), batch.begin(), batch.end());
+  });
+  KDTree<2, size_t> kd;
+  kd.build(elems);
+  CheckCondition(kd.size() == kNumLines && kd.at(MakePoint(50.0, -100.0)) == 100, "Pipeline output builds a tree.");
+
+  /* A failing stage stops the pipeline and its exception comes out of run. */
+  istringstream bad(text.str() + "\n1 2 oops\n");
+  bool didThrow = false;
+  try {
+    Pipeline(3).run(TextChunkReader(bad, 512), ParseTestLines, [](Pipeline::Batch&) {});
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "Parser errors are rethrown.");
+
+  istringstream good(text.str());
+  didThrow = false;
+  size_t built = 0;
+  try {
+    Pipeline(2).run(TextChunkReader(good, 256), ParseTestLines, [&](Pipeline::Batch&) {
+      if (++built == 3) throw out_of_range("Builder failed");
+    });
+  } catch (const out_of_range&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow && built == 3, "Builder errors stop the pipeline.");
+
+  EndTest();
+#else
+  TestDisabled("PipelineTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Adapts ParseTextRecords to the ingestion pipeline for TextParserTest. */
+void ParseTestRecords(const string& chunk, IngestionPipeline<2, string>::Batch& batch) {
+  ParseTextRecords(chunk.data(), chunk.data() + chunk.size(), batch);
+}
+
+/* This function checks that ParseTextRecords reads the same records as iostream
+ * extraction, and that it can parse a mapped file through the pipeline.
+ */
+void TextParserTest() try {
+#if TextParserTestEnabled
+  PrintBanner("Text Parser Test");
+
+  typedef IngestionPipeline<2, string> Pipeline;
+  const size_t kNumRecords = 5000;
+  srand(1045);
+  ostringstream text;
+  text << kNumRecords << "\n";
+  for (size_t i = 0; i < kNumRecords; ++i) {
+    text << setprecision(17) << (rand() / double(RAND_MAX) - 0.5) * 180 << (i % 3 == 0 ? "\t" : " ")
+         << (rand() / double(RAND_MAX) - 0.5) * 1e-5 << "  place" << i % 97 << (i % 5 == 0 ? "\r\n" : "\n");
+  }
+  const string data = text.str();
+
+  Pipeline::Batch expected;
+  istringstream input(data);
+  size_t count;
+  input >> count;
+  Point<2> pt;
+  string label;
+  while (input >> pt[0] >> pt[1] >> label)
+    expected.push_back(make_pair(pt, label));
+
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  CheckCondition(ParseRecordCount(pos, end) == kNumRecords, "Record count header is read.");
+  Pipeline::Batch records;
+  ParseTextRecords(pos, end, records);
+  CheckCondition(records == expected, "from_chars parsing matches iostream extraction.");
+
+  /* Records parsed from a mapped file through the pipeline, in small chunks. */
+  const string filename = "text-parser-test.txt";
+  {
+    ofstream out(filename.c_str(), ios::binary);
+    out << data;
+  }
+  Pipeline::Batch piped;
+  {
+    MappedFile file(filename);
+    const char* filePos = file.data();
+    const char* fileEnd = filePos + file.size();
+    CheckCondition(ParseRecordCount(filePos, fileEnd) == kNumRecords, "Mapped header count is read.");
+    Pipeline(3).run(MappedChunkReader(filePos, fileEnd, 1000), ParseTestRecords, [&](Pipeline::Batch& batch) {
+      piped.insert(piped.end(), batch.begin(), batch.end());
+    });
+  }
+
+  /* Rewrites within the same second still change the fingerprint. */
+  struct timespec times[2];
+  times[0].tv_sec = times[1].tv_sec = 1000000000;
+  times[0].tv_nsec = times[1].tv_nsec = 1000;
+  utimensat(AT_FDCWD, filename.c_str(), times, 0);
+  uint64_t before = FileFingerprint(filename);
+  times[0].tv_nsec = times[1].tv_nsec = 2000;
+  utimensat(AT_FDCWD, filename.c_str(), times, 0);
+  CheckCondition(FileFingerprint(filename) != before, "Fingerprints see sub-second modification times.");
+  remove(filename.c_str());
+  bool missingThrew = false;
+  try {
+    FileFingerprint(filename);
+  } catch (const runtime_error&) {
+    missingThrew = true;
+  }
+  CheckCondition(missingThrew, "Fingerprinting a missing file throws.");
+  /* Batches arrive in any order, so compare the records in a fixed one. */
+  auto byCoordinates = [](const pair<Point<2>, string>& one, const pair<Point<2>, string>& two) {
+    return lexicographical_compare(one.first.begin(), one.first.end(), two.first.begin(), two.first.end());
+  };
+  sort(piped.begin(), piped.end(), byCoordinates);
+  sort(expected.begin(), expected.end(), byCoordinates);
+  CheckCondition(piped == expected, "Mapped chunks parse to the same records.");
+
+  /* Malformed input is rejected. */
+  const char* const kBadInputs[] = { "1.0 2.0\n", "1.0 x2 label\n", "1.0 2.0 label extra\n", "1.0,2.0 label\n" };
+  bool allThrew = true;
+  for (size_t i = 0; i < sizeof(kBadInputs) / sizeof(kBadInputs[0]); ++i) {
+    Pipeline::Batch bad;
+    try {
+      ParseTextRecords(kBadInputs[i], kBadInputs[i] + strlen(kBadInputs[i]), bad);
+      allThrew = false;
+    } catch (const runtime_error&) {}
+  }
+  CheckCondition(allThrew, "Malformed records are rejected.");
+  bool didThrow = false;
+  try {
+    const char* header = "count\n";
+    ParseRecordCount(header, header + 6);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "Malformed record counts are rejected.");
+
+  EndTest();
+#else
+  TestDisabled("TextParserTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Writes an IDX file with the specified magic number, dimensions and
+ * payload for IdxFileTest.
+ */
+void WriteTestIdxFile(const string& filename, const string& magic, const vector<uint32_t>& dims,
+                      const string& payload) {
+  ofstream out(filename.c_str(), ios::binary);
+  out << magic;
+  for (size_t i = 0; i < dims.size(); ++i) {
+    out.put(char(dims[i] >> 24));
+    out.put(char(dims[i] >> 16));
+    out.put(char(dims[i] >> 8));
+    out.put(char(dims[i]));
+  }
+  out << payload;
+}
+
+/* Returns whether opening the specified file as an IDX file throws. */
+bool IdxFileThrows(const string& filename) {
+  try {
+    IdxFile file(filename);
+  } catch (const runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+/* This function maps small IDX files, checking that the records come back as
+ * written and that malformed headers are rejected.
+ */
+void IdxFileTest() try {
+#if IdxFileTestEnabled
+  PrintBanner("IDX File Test");
+
+  const string filename = "idx-file-test.idx";
+  const size_t kNumImages = 5;
+  string pixels;
+  for (size_t i = 0; i < kNumImages * 3 * 4; ++i)
+    pixels += char(i * 37);
+  vector<uint32_t> dims;
+  dims.push_back(kNumImages);
+  dims.push_back(3);
+  dims.push_back(4);
+
+  WriteTestIdxFile(filename, string("\0\0\x08\x03", 4), dims, pixels);
+  {
+    IdxFile images(filename);
+    CheckCondition(images.dataType() == kIdxUnsignedByte && images.dimensions().size() == 3,
+                   "Header gives the type and dimensions.");
+    CheckCondition(images.count() == kNumImages && images.recordSize() == 12 && images.dimensions()[2] == 4,
+                   "Header gives the record count and size.");
+    CheckCondition(memcmp(images.record(3), pixels.data() + 36, 12) == 0, "Records point at the right bytes.");
+  }
+
+  vector<uint32_t> shortDims(1, 3);
+  WriteTestIdxFile(filename, string("\0\0\x0D\x01", 4), shortDims, string(12, 'x'));
+  {
+    IdxFile floats(filename);
+    CheckCondition(floats.dataType() == kIdxFloat && floats.recordSize() == 4, "Element sizes follow the type.");
+  }
+
+  WriteTestIdxFile(filename, string("\0\0\x08\x03", 4), dims, pixels.substr(1));
+  CheckCondition(IdxFileThrows(filename), "Truncated files are rejected.");
+  WriteTestIdxFile(filename, string("\0\0\x08\x03", 4), dims, pixels + "x");
+  CheckCondition(IdxFileThrows(filename), "Files with trailing data are rejected.");
+  WriteTestIdxFile(filename, string("\0\x01\x08\x03", 4), dims, pixels);
+  CheckCondition(IdxFileThrows(filename), "Bad magic numbers are rejected.");
+  WriteTestIdxFile(filename, string("\0\0\x07\x03", 4), dims, pixels);
+  CheckCondition(IdxFileThrows(filename), "Unknown element types are rejected.");
+  vector<uint32_t> hugeDims(3, 0xFFFFFFFFu);
+  WriteTestIdxFile(filename, string("\0\0\x0E\x03", 4), hugeDims, pixels);
+  CheckCondition(IdxFileThrows(filename), "Absurd dimensions are rejected.");
+  remove(filename.c_str());
+  CheckCondition(IdxFileThrows(filename), "Missing files are rejected.");
+
+  EndTest();
+#else
+  TestDisabled("IdxFileTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* This function checks a ValueDictionary, then checks that interned trees
+ * answer every query exactly as a plain tree over the same points does.
+ */
+void InternedTreeTest() try {
+#if InternedTreeTestEnabled
+  PrintBanner("Interned Tree Test");
+
+  ValueDictionary<string> dictionary;
+  uint32_t id;
+  CheckCondition(dictionary.intern("US06") == 0 && dictionary.intern("CA10") == 1, "IDs count up from zero.");
+  CheckCondition(dictionary.intern("US06") == 0 && dictionary.size() == 2, "Interning again reuses the ID.");
+  CheckCondition(dictionary.find("CA10", id) && id == 1 && !dictionary.find("MX05", id), "find doesn't intern.");
+  CheckCondition(dictionary.value(1) == "CA10", "IDs map back to their values.");
+  bool didThrow = false;
+  try {
+    dictionary.value(2);
+  } catch (const out_of_range&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "Unknown IDs throw.");
+
+  /* Labels are first seen in sorted order, so IDs sort like the labels do
+   * and ties in votes are broken the same way as in a plain tree.
+   */
+  const size_t kNumPoints = 5000;
+  const size_t kNumLabels = 40;
+  srand(1047);
+  vector< pair<Point<2>, string> > elems;
+  KDTree<2, string> reference;
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    ostringstream label;
+    label << "label" << setw(2) << setfill('0') << i % kNumLabels;
+    Point<2> pt = MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX));
+    elems.push_back(make_pair(pt, label.str()));
+    reference.insert(pt, label.str());
+  }
+
+  InternedKDTree<2, string> inserted;
+  CheckCondition(inserted.empty() && inserted.kNNValue(MakePoint(0, 0), 3) == "", "New interned tree is empty.");
+  for (size_t i = 0; i < elems.size(); ++i)
+    inserted.insert(elems[i].first, elems[i].second);
+  InternedKDTree<2, string, LazyKDTree> lazy;
+  lazy.build(elems);
+  CheckCondition(inserted.size() == kNumPoints && lazy.size() == kNumPoints, "Interned trees hold every point.");
+  CheckCondition(inserted.dictionary().size() == kNumLabels && lazy.dictionary().size() == kNumLabels,
+                 "Each label is stored once.");
+  CheckCondition(inserted.contains(elems[17].first) && inserted.at(elems[17].first) == elems[17].second &&
+                 lazy.at(elems[17].first) == elems[17].second, "Lookups return the original values.");
+
+  const size_t kValues[] = { 1, 4, 9 };
+  for (size_t j = 0; j < sizeof(kValues) / sizeof(kValues[0]); ++j) {
+    bool allMatch = true;
+    for (size_t i = 0; i < 200; ++i) {
+      Point<2> query = MakePoint(rand() / double(RAND_MAX), rand() / double(RAND_MAX));
+      string expected = reference.kNNValue(query, kValues[j]);
+      if (inserted.kNNValue(query, kValues[j]) != expected || lazy.kNNValue(query, kValues[j]) != expected)
+        allMatch = false;
+    }
+    CheckCondition(allMatch, "Votes on IDs match votes on values.");
+  }
+
+  /* Snapshots carry the dictionary in a second file. */
+  const string filename = "interned-test.kdl";
+  lazy.save(filename);
+  InternedKDTree<2, string, LazyKDTree> loaded;
+  loaded.load(filename);
+  remove(filename.c_str());
+  remove((filename + ".values").c_str());
+  CheckCondition(loaded.size() == kNumPoints && loaded.at(elems[99].first) == elems[99].second,
+                 "Snapshots keep the values.");
+  didThrow = false;
+  try {
+    loaded.load(filename);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow && loaded.size() == kNumPoints, "A failed load leaves the tree unchanged.");
+
+  /* A tree file only loads with the dictionary it was saved with. */
+  const string otherFilename = "interned-test-other.kdl";
+  InternedKDTree<2, string, LazyKDTree> fewer;
+  fewer.build(vector< pair<Point<2>, string> >(elems.begin(), elems.begin() + 3));
+  lazy.save(filename);
+  fewer.save(otherFilename);
+  rename((otherFilename + ".values").c_str(), (filename + ".values").c_str());
+  didThrow = false;
+  try {
+    loaded.load(filename);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  remove(filename.c_str());
+  remove((filename + ".values").c_str());
+  remove(otherFilename.c_str());
+  CheckCondition(didThrow && loaded.size() == kNumPoints && loaded.dictionary().size() == kNumLabels,
+                 "A tree paired with the wrong dictionary is rejected.");
+
+  const string treeFilename = "interned-test.kdt";
+  inserted.save(treeFilename, 99);
+  InternedKDTree<2, string> reloaded;
+  reloaded.load(treeFilename, 99);
+  CheckCondition(reloaded.size() == kNumPoints && reloaded.at(elems[5].first) == elems[5].second,
+                 "Interned KDTrees round-trip.");
+  didThrow = false;
+  try {
+    reloaded.load(treeFilename, 100);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  remove(treeFilename.c_str());
+  remove((treeFilename + ".values").c_str());
+  CheckCondition(didThrow, "A tree built from different data is rejected.");
+
+  EndTest();
+#else
+  TestDisabled("InternedTreeTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* A value too large to want in every node, for OutOfLineValueTest. */
+struct LargeRecord {
+  size_t id;
+  char payload[256];
+};
+
+bool operator<(const LargeRecord& one, const LargeRecord& two) {
+  return one.id < two.id;
+}
+
+template <> struct KDTreeValuesOutOfLine<LargeRecord> : true_type {};
+
+LargeRecord MakeRecord(size_t id) {
+  LargeRecord record = LargeRecord();
+  record.id = id;
+  return record;
+}
+
+/* This function checks that a tree keeping its values out of line behaves
+ * exactly like one keeping them in its nodes, through every operation that
+ * creates, moves or frees nodes.
+ */
+void OutOfLineValueTest() try {
+#if OutOfLineValueTestEnabled
+  PrintBanner("Out-of-Line Value Test");
+
+  const size_t kNumPoints = 3000;
+  srand(1048);
+  vector< pair<Point<2>, LargeRecord> > elems;
+  KDTree<2, size_t> reference;
+  for (size_t i = 0; i < kNumPoints; ++i) {
+    Point<2> pt = MakePoint(rand() / double(RAND_MAX) * 1000, rand() / double(RAND_MAX) * 1000);
+    elems.push_back(make_pair(pt, MakeRecord(i % 11)));
+    reference.insert(pt, i % 11);
+  }
+
+  KDTree<2, LargeRecord> inserted;
+  for (size_t i = 0; i < elems.size(); ++i)
+    inserted.insert(elems[i].first, elems[i].second);
+  WorkStealingPool pool(4);
+  KDTree<2, LargeRecord> built;
+  built.build(elems, pool);
+  CheckCondition(inserted.size() == reference.size() && built.size() == reference.size(),
+                 "Out-of-line trees hold every point once.");
+
+  KDTreeShapeStats shape = built.stats();
+  CheckCondition(shape.nodeOverheadBytes + shape.coordinateBytes < shape.nodeCount * sizeof(LargeRecord) / 4,
+                 "Nodes hold a handle instead of the value.");
+  CheckCondition(shape.valueBytes == shape.nodeCount * sizeof(LargeRecord), "Values are still counted.");
+
+  bool allMatch = true;
+  for (size_t i = 0; i < elems.size(); ++i) {
+    size_t expected = reference.at(elems[i].first);
+    if (inserted.at(elems[i].first).id != expected || built.at(elems[i].first).id != expected) allMatch = false;
+  }
+  CheckCondition(allMatch, "Lookups find the values.");
+
+  const size_t kValues[] = { 1, 5, 12 };
+  for (size_t j = 0; j < sizeof(kValues) / sizeof(kValues[0]); ++j) {
+    allMatch = true;
+    for (size_t i = 0; i < 200; ++i) {
+      Point<2> query = MakePoint(rand() / double(RAND_MAX) * 1000, rand() / double(RAND_MAX) * 1000);
+      size_t expected = reference.kNNValue(query, kValues[j]);
+      if (inserted.kNNValue(query, kValues[j]).id != expected || built.kNNValue(query, kValues[j]).id != expected)
+        allMatch = false;
+    }
+    CheckCondition(allMatch, "k-NN votes match a tree with inline values.");
+  }
+
+  /* Copies are deep, and references stay valid across inserts. */
+  KDTree<2, LargeRecord> copy(built);
+  LargeRecord& first = built.at(elems[0].first);
+  first.id = 99;
+  for (size_t i = 0; i < 100; ++i)
+    built.insert(MakePoint(2000 + i, i), MakeRecord(i));
+  CheckCondition(built.at(elems[0].first).id == 99 && copy.at(elems[0].first).id == reference.at(elems[0].first),
+                 "Copies don't share values.");
+  copy = built;
+  CheckCondition(copy.at(elems[0].first).id == 99 && copy.at(MakePoint(2050, 50)).id == 50, "Assignment copies values.");
+  CheckCondition(built[MakePoint(-1, -1)].id == 0 && built.contains(MakePoint(-1, -1)), "operator[] makes a default value.");
+
+  /* Erasing, compacting and relaying out keep the surviving values. */
+  for (size_t i = 1; i < elems.size(); i += 2)
+    built.erase(elems[i].first);
+  built.compact();
+  built.relayout(kKDTreeBreadthFirstOrder);
+  allMatch = true;
+  for (size_t i = 2; i < elems.size(); i += 2) {
+    if (!built.contains(elems[i].first) || built.at(elems[i].first).id != reference.at(elems[i].first)) allMatch = false;
+  }
+  CheckCondition(allMatch && built.stats().nodeCount == built.size(), "Compaction and relayout keep the values.");
+
+  EndTest();
+#else
+  TestDisabled("OutOfLineValueTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
+/* Computes the k-NN vote for CompactTreeTest by brute force, breaking ties
+ * between values the way MostCommonValue does.  Returns false if the k-th
+ * and (k + 1)-th nearest points are the same distance away, since the vote
+ * then depends on which of them the search keeps.
+ */
+static bool BruteForceCompactVote(const vector< pair<CompactPoint<3, uint8_t>, size_t> >& elems,
+                                  const CompactPoint<3, uint8_t>& key, size_t k, size_t& vote) {
+  vector< pair<int, size_t> > byDistance;
+  for (size_t i = 0; i < elems.size(); ++i) {
+    int distance = 0;
+    for (size_t j = 0; j < 3; ++j)
+      distance += (int(elems[i].first[j]) - int(key[j])) * (int(elems[i].first[j]) - int(key[j]));
+    byDistance.push_back(make_pair(distance, elems[i].second));
+  }
+  sort(byDistance.begin(), byDistance.end());
+  if (k < byDistance.size() && byDistance[k - 1].first == byDistance[k].first) return false;
+
+  map<size_t, size_t> counts;
+  for (size_t i = 0; i < k && i < byDistance.size(); ++i)
+    ++counts[byDistance[i].second];
+  size_t bestCount = 0;
+  for (map<size_t, size_t>::iterator it = counts.begin(); it != counts.end(); ++it) {
+    if (it->second > bestCount) {
+      vote = it->first;
+      bestCount = it->second;
+    }
+  }
+  return true;
+}
+
+/* Builds a CompactPoint<3, uint8_t> from three bytes. */
+static CompactPoint<3, uint8_t> MakeColor(int red, int green, int blue) {
+  CompactPoint<3, uint8_t> result;
+  result[0] = uint8_t(red);
+  result[1] = uint8_t(green);
+  result[2] = uint8_t(blue);
+  return result;
+}
+
+/* Checks CompactKDTree against brute force on integer colors, including the
+ * frequent distance ties that integer coordinates produce.
+ */
+void CompactTreeTest() try {
+#if CompactTreeTestEnabled
+  PrintBanner("Compact Tree Test");
+
+  CheckCondition(sizeof(CompactPoint<3, uint8_t>) == 3 && sizeof(CompactPoint<2, uint16_t>) == 4,
+                 "Compact points are packed.");
+
+  CompactKDTree<3, uint8_t, size_t> empty;
+  CheckCondition(empty.empty() && !empty.contains(MakeColor(0, 0, 0)), "New compact tree is empty.");
+  CheckCondition(empty.kNNValue(MakeColor(0, 0, 0), 3) == 0, "Searching an empty compact tree is harmless.");
+
+  srand(1050);
+  set<int> used;
+  vector< pair<CompactPoint<3, uint8_t>, size_t> > elems;
+  for (size_t i = 0; elems.size() < 5000; ++i) {
+    int red = rand() % 256, green = rand() % 256, blue = rand() % 256;
+    if (!used.insert((red << 16) | (green << 8) | blue).second) continue;
+    elems.push_back(make_pair(MakeColor(red, green, blue), i % 11));
+  }
+  CompactKDTree<3, uint8_t, size_t> colors;
+  colors.build(elems);
+  CheckCondition(colors.size() == elems.size() && colors.dimension() == 3, "Compact tree holds every point.");
+
+  vector< CompactPoint<3, uint8_t> > queries;
+  for (size_t i = 0; i < 300; ++i)
+    queries.push_back(MakeColor(rand() % 256, rand() % 256, rand() % 256));
+  const size_t kValues[] = { 1, 3, 7 };
+  for (size_t j = 0; j < sizeof(kValues) / sizeof(kValues[0]); ++j) {
+    bool allMatch = true;
+    size_t checked = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+      size_t expected = 0;
+      if (!BruteForceCompactVote(elems, queries[i], kValues[j], expected)) continue;
+      ++checked;
+      if (colors.kNNValue(queries[i], kValues[j]) != expected) allMatch = false;
+    }
+    CheckCondition(allMatch && checked > queries.size() / 2, "Compact tree k-NN matches brute force.");
+  }
+
+  bool allFound = true;
+  for (size_t i = 0; i < elems.size(); i += 5) {
+    if (!colors.contains(elems[i].first) || colors.at(elems[i].first) != elems[i].second) allFound = false;
+  }
+  CheckCondition(allFound, "Compact tree finds every point.");
+  CompactPoint<3, uint8_t> missing = MakeColor(0, 0, 0);
+  for (int blue = 0; used.count(blue); ++blue)
+    missing[2] = uint8_t(blue + 1);
+  CheckCondition(!colors.contains(missing), "Compact tree doesn't contain a missing point.");
+  bool didThrow = false;
+  try {
+    colors.at(missing);
+  } catch (const out_of_range&) {
+    didThrow = true;
+  }
+  CheckCondition(didThrow, "at throws on a missing point.");
+
+  /* Sixteen-bit coordinates need 64-bit squared distances. */
+  CompactKDTree<2, uint16_t, string> wide;
+  vector< pair<CompactPoint<2, uint16_t>, string> > corners;
+  const int kCorners[][2] = { { 0, 0 }, { 65535, 0 }, { 0, 65535 }, { 65535, 65535 } };
+  for (size_t i = 0; i < 4; ++i) {
+    for (size_t copy = 0; copy < 20; ++copy) {
+      CompactPoint<2, uint16_t> pt;
+      pt[0] = uint16_t(abs(kCorners[i][0] - int(copy)));
+      pt[1] = uint16_t(abs(kCorners[i][1] - int(copy)));
+      corners.push_back(make_pair(pt, "corner " + to_string(i)));
+    }
+  }
+  wide.build(corners);
+  bool allMatch = true;
+  for (size_t i = 0; i < 4; ++i) {
+    CompactPoint<2, uint16_t> key;
+    key[0] = uint16_t(kCorners[i][0] == 0 ? 1000 : 64535);
+    key[1] = uint16_t(kCorners[i][1] == 0 ? 1000 : 64535);
+    if (wide.kNNValue(key, 15) != "corner " + to_string(i)) allMatch = false;
+  }
+  CheckCondition(allMatch, "Sixteen-bit coordinates measure distances correctly.");
+
+  /* Snapshots round-trip, and refuse coordinates of the wrong size. */
+  const string filename = "compact-tree-test.kdc";
+  colors.save(filename);
+  CompactKDTree<3, uint8_t, size_t> loaded;
+  loaded.load(filename);
+  allMatch = loaded.size() == colors.size();
+  for (size_t i = 0; i < queries.size(); ++i) {
+    if (loaded.kNNValue(queries[i], 3) != colors.kNNValue(queries[i], 3)) allMatch = false;
+  }
+  CheckCondition(allMatch && loaded.at(elems[0].first) == elems[0].second, "Loaded compact tree matches the original.");
+
+  CompactKDTree<3, uint16_t, size_t> mismatched;
+  didThrow = false;
+  try {
+    mismatched.load(filename);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  remove(filename.c_str());
+  CheckCondition(didThrow && mismatched.empty(), "Loading coordinates of the wrong size fails.");
+
+  colors.save(filename, 777);
+  didThrow = false;
+  try {
+    loaded.load(filename, 778);
+  } catch (const runtime_error&) {
+    didThrow = true;
+  }
+  remove(filename.c_str());
+  CheckCondition(didThrow && loaded.size() == colors.size(), "A snapshot of different data is rejected.");
+
+  /* Repeated points keep the last value given. */
+  vector< pair<CompactPoint<3, uint8_t>, size_t> > repeated;
+  repeated.push_back(make_pair(MakeColor(10, 10, 10), 1));
+  repeated.push_back(make_pair(MakeColor(10, 10, 10), 1));
+  repeated.push_back(make_pair(MakeColor(20, 20, 20), 3));
+  repeated.push_back(make_pair(MakeColor(10, 10, 10), 2));
+  CompactKDTree<3, uint8_t, size_t> merged;
+  merged.build(repeated);
+  CheckCondition(merged.size() == 2 && merged.at(MakeColor(10, 10, 10)) == 2, "Repeated points keep the last value.");
+  CheckCondition(merged.kNNValue(MakeColor(10, 10, 10), 3) == 2, "Repeated points vote once.");
+
+  EndTest();
+#else
+  TestDisabled("CompactTreeTest");
+#endif
+} catch (const exception& e) {
+  FailTest(e);
+}
+
 /* Main entry point simply runs all the tests.  Note that these functions might be no-ops
  * if they are disabled by the configuration settings at the top of the program.
  */
@@ -760,6 +2793,29 @@ int main() {
   BasicCopyTest();
   ModerateCopyTest();
 
+  /* Extension Tests */
+  SnapshotTest();
+  MappedViewTest();
+  BulkBuildTest();
+  ParallelQueryTest();
+  BatchQueryTest();
+  RelayoutTest();
+  QueryStatsTest();
+  ShapeStatsTest();
+  AllocationTest();
+  TracingTest();
+  DynamicTreeTest();
+  ScapegoatTest();
+  EraseTest();
+  SlidingWindowTest();
+  LazyTreeTest();
+  PipelineTest();
+  TextParserTest();
+  IdxFileTest();
+  InternedTreeTest();
+  OutOfLineValueTest();
+  CompactTreeTest();
+
 #if (BasicKDTreeTestEnabled && \
      ModerateKDTreeTestEnabled && \
      HarderKDTreeTestEnabled &&   \
@@ -770,7 +2826,28 @@ int main() {
      NearestNeighborTestEnabled &&  \
      MoreNearestNeighborTestEnabled && \
      BasicCopyTestEnabled && \
-     ModerateCopyTestEnabled)
+     ModerateCopyTestEnabled && \
+     SnapshotTestEnabled && \
+     MappedViewTestEnabled && \
+     BulkBuildTestEnabled && \
+     ParallelQueryTestEnabled && \
+     BatchQueryTestEnabled && \
+     RelayoutTestEnabled && \
+     QueryStatsTestEnabled && \
+     ShapeStatsTestEnabled && \
+     AllocationTestEnabled && \
+     TracingTestEnabled && \
+     DynamicTreeTestEnabled && \
+     ScapegoatTestEnabled && \
+     EraseTestEnabled && \
+     SlidingWindowTestEnabled && \
+     LazyTreeTestEnabled && \
+     PipelineTestEnabled && \
+     TextParserTestEnabled && \
+     IdxFileTestEnabled && \
+     InternedTreeTestEnabled && \
+     OutOfLineValueTestEnabled && \
+     CompactTreeTestEnabled)
   cout << "All tests completed!  If they passed, you should be good to go!" << endl << endl;
 #else
   cout << "Not all tests were run.  Enable the rest of the tests, then run again." << endl << endl;